@@ -0,0 +1,627 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "queue.h"
+#include "uart.h"
+#include "processor_interface.h"
+#include "peripheral_emulator.h"
+#include "crc.h"
+#include "trace.h"
+
+/* Throughput and latency benchmarks for the queue and the UART ISR paths.
+Usage: bench [--format csv|json] [--bytes N] [--samples N] [--replay TRACE]
+Every result is one row/object with the same fields so the output can be diffed between releases:
+ - queue_ops: single threaded enqueue/dequeue (message_size 1) or bulk (message_size > 1) ops/sec
+ - queue_spsc: producer and consumer on separate threads through one queue
+ - queue_mpsc: threads - 1 producers reserving and committing whole messages in a shared queue
+ (see queue_reserve_shared) with one consumer draining it
+ - isr_latency: time from a byte arriving in the RX FIFO to a blocked reader returning it
+ - uart_end_to_end: bytes/sec through uart_write -> uart_isr -> emulator sink and emulator source ->
+ uart_isr -> uart_read at the same time, threads is the number of channels running at once and
+ drops is how many received bytes never made it to the reader. isrs and wasted_isrs are the ISR
+ invocations and how many of those had nothing to do, from uart_get_stats
+ - uart_end_to_end_rts_cts/uart_end_to_end_xon_xoff: the same with the channel and the emulator doing
+ hardware/software flow control, so drops should be 0 however far behind the reader gets
+ - uart_end_to_end_poll: the same as uart_end_to_end but with one thread reading every channel as
+ uart_poll says it's readable, rather than a reader thread per channel
+ - uart_route: every channel's receive stream routed out of its neighbour (looped back with one
+ channel) with RTS/CTS, emulator source -> uart_isr -> route -> uart_isr -> emulator sink with no task
+ in between. bytes_per_sec is what came out of the sinks, drops is what never got there
+ - crc16/crc32/crc32c_<implementation>: bytes/sec through crc_update in message_size pieces
+ - trace_replay: with --replay, only this runs. A recorded trace (see trace.h) is played back
+ through uart_isr as fast as it will go, ops_per_sec is events/sec and samples is the event count
+*/
+
+typedef struct {
+    const char* benchmark;
+    size_t queue_size;
+    size_t message_size;
+    size_t threads;
+    double ops_per_sec;
+    double bytes_per_sec;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    size_t samples;
+    size_t drops;
+    size_t isrs;
+    size_t wasted_isrs;
+} BenchResult;
+
+static const char* output_format = "csv";
+static size_t total_bytes = 1 << 20;
+static size_t latency_samples = 10000;
+static size_t results_written = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ULL + (uint64_t)time.tv_nsec;
+}
+
+static void write_result(const BenchResult* result) {
+    if (strcmp(output_format, "json") == 0) {
+        printf("%s  {\"benchmark\": \"%s\", \"queue_size\": %zu, \"message_size\": %zu, \"threads\": %zu, "
+            "\"ops_per_sec\": %.0f, \"bytes_per_sec\": %.0f, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+            "\"p999_ns\": %llu, \"samples\": %zu, \"drops\": %zu, \"isrs\": %zu, \"wasted_isrs\": %zu}", results_written ? ",\n" : "", result->benchmark,
+            result->queue_size, result->message_size, result->threads, result->ops_per_sec,
+            result->bytes_per_sec, (unsigned long long)result->p50_ns, (unsigned long long)result->p99_ns,
+            (unsigned long long)result->p999_ns, result->samples, result->drops, result->isrs, result->wasted_isrs);
+    } else {
+        printf("%s,%zu,%zu,%zu,%.0f,%.0f,%llu,%llu,%llu,%zu,%zu,%zu,%zu\n", result->benchmark, result->queue_size,
+            result->message_size, result->threads, result->ops_per_sec, result->bytes_per_sec,
+            (unsigned long long)result->p50_ns, (unsigned long long)result->p99_ns,
+            (unsigned long long)result->p999_ns, result->samples, result->drops, result->isrs, result->wasted_isrs);
+    }
+    fflush(stdout);
+    results_written++;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t left = *(const uint64_t*)a;
+    uint64_t right = *(const uint64_t*)b;
+    return (left > right) - (left < right);
+}
+
+// Fills in the percentiles from the samples, sorting them in place
+static void fill_percentiles(BenchResult* result, uint64_t* samples, size_t count) {
+    result->samples = count;
+    if (count == 0) return;
+    qsort(samples, count, sizeof(uint64_t), compare_u64);
+    result->p50_ns = samples[(count * 50) / 100];
+    result->p99_ns = samples[(count * 99) / 100];
+    result->p999_ns = samples[(count * 999) / 1000];
+}
+
+static void bench_queue_ops(size_t queue_size, size_t message_size) {
+    Queue* queue = initialise_queue((uint16_t)queue_size);
+    if (queue == NULL) return;
+    uint8_t message[4096] = {0};
+    size_t operations = total_bytes / message_size;
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < operations; i++) {
+        if (message_size == 1) {
+            enqueue(queue, message[0]);
+            dequeue(queue, &message[0]);
+        } else {
+            enqueue_bulk(queue, message, message_size, NULL);
+            dequeue_bulk(queue, message, message_size, NULL);
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    delete_queue(queue);
+
+    BenchResult result = { .benchmark = "queue_ops", .queue_size = queue_size, .message_size = message_size, .threads = 1 };
+    // One op is an enqueue and a dequeue
+    result.ops_per_sec = (double)operations * 2 * 1e9 / (double)elapsed;
+    result.bytes_per_sec = (double)(operations * message_size) * 1e9 / (double)elapsed;
+    write_result(&result);
+}
+
+typedef struct {
+    Queue* queue;
+    size_t message_size;
+    size_t bytes;
+} SpscArgs;
+
+static void* spsc_producer(void* argument) {
+    SpscArgs* args = (SpscArgs*)argument;
+    uint8_t message[4096] = {0};
+    size_t sent = 0;
+    while (sent < args->bytes) {
+        size_t chunk = args->bytes - sent < args->message_size ? args->bytes - sent : args->message_size;
+        size_t written = 0;
+        if (enqueue_bulk(args->queue, message, chunk, &written) == BUSY) sched_yield();
+        sent += written;
+    }
+    return NULL;
+}
+
+static void bench_queue_spsc(size_t queue_size, size_t message_size) {
+    Queue* queue = initialise_queue((uint16_t)queue_size);
+    if (queue == NULL) return;
+    SpscArgs args = { .queue = queue, .message_size = message_size, .bytes = total_bytes };
+    uint8_t message[4096];
+
+    uint64_t start = now_ns();
+    pthread_t producer;
+    pthread_create(&producer, NULL, spsc_producer, &args);
+    size_t received = 0;
+    size_t operations = 0;
+    while (received < total_bytes) {
+        size_t read = 0;
+        if (dequeue_bulk(queue, message, message_size, &read) == EMPTY) sched_yield();
+        received += read;
+        operations += read != 0;
+    }
+    pthread_join(producer, NULL);
+    uint64_t elapsed = now_ns() - start;
+    delete_queue(queue);
+
+    BenchResult result = { .benchmark = "queue_spsc", .queue_size = queue_size, .message_size = message_size, .threads = 2 };
+    result.ops_per_sec = (double)operations * 1e9 / (double)elapsed;
+    result.bytes_per_sec = (double)total_bytes * 1e9 / (double)elapsed;
+    write_result(&result);
+}
+
+typedef struct {
+    UartHandle uart;
+    size_t samples;
+    _Atomic uint64_t sent_at;
+    _Atomic size_t completed;
+    uint64_t* latencies;
+} LatencyArgs;
+
+static void* latency_reader(void* argument) {
+    LatencyArgs* args = (LatencyArgs*)argument;
+    for (size_t i = 0; i < args->samples; i++) {
+        uint8_t data;
+        uart_read_bytes_from_receive_queue_blocking(args->uart, &data, 1);
+        args->latencies[i] = now_ns() - atomic_load(&args->sent_at);
+        atomic_store(&args->completed, i + 1);
+    }
+    return NULL;
+}
+
+// This thread plays the peripheral and the interrupt controller, one byte at a time so that each
+// sample is the latency of an otherwise idle path
+static void bench_isr_latency(size_t queue_size) {
+    UartConfig config = { .receive_queue_size = (uint16_t)queue_size, .transmit_queue_size = (uint16_t)queue_size,
+        .priority_queue_size = PRIORITY_QUEUE_SIZE,
+        .rx_trigger_level = 1, .tx_empty_threshold = 0 };
+    UartHandle uart;
+    if (initialise_uart(0, &config, &uart) != SUCCESS) return;
+
+    LatencyArgs args = { .uart = uart, .samples = latency_samples };
+    args.latencies = (uint64_t*)calloc(latency_samples, sizeof(uint64_t));
+    atomic_init(&args.sent_at, 0);
+    atomic_init(&args.completed, 0);
+    pthread_t reader;
+    pthread_create(&reader, NULL, latency_reader, &args);
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < latency_samples; i++) {
+        atomic_store(&args.sent_at, now_ns());
+        peripheral_receive_byte(0, (uint8_t)i);
+        raise_pending_interrupt(0);
+        while (atomic_load(&args.completed) <= i) sched_yield();
+    }
+    pthread_join(reader, NULL);
+    uint64_t elapsed = now_ns() - start;
+    stop_uart(uart);
+
+    BenchResult result = { .benchmark = "isr_latency", .queue_size = queue_size, .message_size = 1, .threads = 2 };
+    result.ops_per_sec = (double)latency_samples * 1e9 / (double)elapsed;
+    result.bytes_per_sec = result.ops_per_sec;
+    fill_percentiles(&result, args.latencies, latency_samples);
+    write_result(&result);
+    free(args.latencies);
+}
+
+static void bench_crc(CrcType type, uint8_t hardware, const char* name, size_t message_size) {
+    if (crc_select_implementation(type, hardware) != SUCCESS) return;
+    uint8_t* buffer = (uint8_t*)malloc(message_size);
+    if (buffer == NULL) return;
+    for (size_t i = 0; i < message_size; i++) buffer[i] = (uint8_t)(i * 131);
+    size_t operations = total_bytes / message_size;
+    Crc crc;
+    crc_init(&crc, type);
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < operations; i++) {
+        crc_update(&crc, buffer, message_size);
+    }
+    uint64_t elapsed = now_ns() - start;
+    // Stops the compiler throwing the loop away
+    if (crc_value(&crc) == 0x12345678) printf("#\n");
+    free(buffer);
+
+    char benchmark[32];
+    snprintf(benchmark, sizeof(benchmark), "%s_%s", name, crc_implementation_name(type));
+    BenchResult result = { .benchmark = benchmark, .message_size = message_size, .threads = 1 };
+    result.ops_per_sec = (double)operations * 1e9 / (double)elapsed;
+    result.bytes_per_sec = (double)(operations * message_size) * 1e9 / (double)elapsed;
+    write_result(&result);
+}
+
+typedef struct {
+    Queue* queue;
+    size_t message_size;
+    size_t messages;
+} MpscArgs;
+
+static void* mpsc_producer(void* argument) {
+    MpscArgs* args = (MpscArgs*)argument;
+    uint8_t message[4096] = {0};
+    for (size_t sent = 0; sent < args->messages;) {
+        QueueReservation reservation;
+        if (queue_reserve_shared(args->queue, args->message_size, &reservation) != SUCCESS) {
+            sched_yield();
+            continue;
+        }
+        memcpy(reservation.spans[0].data, message, reservation.spans[0].size);
+        memcpy(reservation.spans[1].data, message, reservation.spans[1].size);
+        queue_commit_shared(args->queue, &reservation);
+        sent++;
+    }
+    return NULL;
+}
+
+static void bench_queue_mpsc(size_t queue_size, size_t message_size, size_t producers) {
+    Queue* queue = initialise_shared_queue((uint16_t)queue_size);
+    if (queue == NULL) return;
+    MpscArgs args = { .queue = queue, .message_size = message_size, .messages = total_bytes / message_size / producers };
+    size_t bytes = args.messages * message_size * producers;
+    uint8_t message[4096];
+
+    uint64_t start = now_ns();
+    pthread_t threads[8];
+    for (size_t i = 0; i < producers; i++) pthread_create(&threads[i], NULL, mpsc_producer, &args);
+    size_t received = 0;
+    while (received < bytes) {
+        size_t read = 0;
+        if (dequeue_bulk(queue, message, sizeof(message), &read) == EMPTY) sched_yield();
+        received += read;
+    }
+    for (size_t i = 0; i < producers; i++) pthread_join(threads[i], NULL);
+    uint64_t elapsed = now_ns() - start;
+    delete_queue(queue);
+
+    BenchResult result = { .benchmark = "queue_mpsc", .queue_size = queue_size, .message_size = message_size, .threads = producers + 1 };
+    // One op is a message through the queue
+    result.ops_per_sec = (double)(args.messages * producers) * 1e9 / (double)elapsed;
+    result.bytes_per_sec = (double)bytes * 1e9 / (double)elapsed;
+    write_result(&result);
+}
+
+typedef struct {
+    UartHandle uart;
+    PeripheralEmulator* emulator;
+    size_t message_size;
+    size_t bytes;
+    size_t bytes_moved;
+    uint8_t* buffer;
+} ChannelArgs;
+
+static void* end_to_end_writer(void* argument) {
+    ChannelArgs* args = (ChannelArgs*)argument;
+    for (size_t sent = 0; sent < args->bytes; sent += args->message_size) {
+        size_t chunk = args->bytes - sent < args->message_size ? args->bytes - sent : args->message_size;
+        uart_write_bytes_to_transmit_queue(args->uart, UART_PRIORITY_NORMAL, args->buffer, chunk);
+    }
+    args->bytes_moved = args->bytes;
+    return NULL;
+}
+
+// Bytes dropped because the receive queue was full never turn up, so the reader gives up once the
+// line has gone quiet rather than waiting for them forever
+static void* end_to_end_reader(void* argument) {
+    ChannelArgs* args = (ChannelArgs*)argument;
+    size_t received = 0;
+    while (received < args->bytes) {
+        size_t chunk = args->bytes - received < args->message_size ? args->bytes - received : args->message_size;
+        size_t read = 0;
+        Status status = uart_read_bytes_from_receive_queue_timeout(args->uart, args->buffer, chunk, 20, &read);
+        received += read;
+        if (status == BUSY && read == 0 && peripheral_emulator_rx_complete(args->emulator)) break;
+    }
+    args->bytes_moved = received;
+    return NULL;
+}
+
+typedef struct {
+    ChannelArgs* channels;
+    size_t count;
+} PollerArgs;
+
+// Reads every channel from one thread, going by uart_poll. Like the per channel readers it gives up
+// on a channel once its line has gone quiet.
+static void* end_to_end_poller(void* argument) {
+    PollerArgs* args = (PollerArgs*)argument;
+    UartPollSet* set;
+    if (uart_poll_create(&set) != SUCCESS) return NULL;
+    for (size_t i = 0; i < args->count; i++) uart_poll_add(set, args->channels[i].uart, UART_POLL_READABLE, 0);
+    size_t remaining = args->count;
+    while (remaining != 0) {
+        UartPollEvent events[UART_CHANNEL_COUNT];
+        size_t ready = 0;
+        Status status = uart_poll(set, 20, events, UART_CHANNEL_COUNT, &ready);
+        for (size_t i = 0; i < args->count; i++) {
+            ChannelArgs* channel = &args->channels[i];
+            if (channel->bytes_moved >= channel->bytes) continue;
+            uint8_t readable = 0;
+            for (size_t j = 0; j < ready; j++) readable |= events[j].uart == channel->uart;
+            if (readable) {
+                size_t read;
+                do {
+                    uart_read_bytes_from_receive_queue_nonblocking(channel->uart, channel->buffer, channel->message_size, &read);
+                    channel->bytes_moved += read;
+                } while (read == channel->message_size);
+            }
+            if (channel->bytes_moved >= channel->bytes || (status == BUSY && peripheral_emulator_rx_complete(channel->emulator))) {
+                uart_poll_remove(set, channel->uart);
+                // Quiet lines are only given up on once, this stops them being counted again
+                channel->bytes = channel->bytes_moved;
+                remaining--;
+            }
+        }
+    }
+    uart_poll_destroy(set);
+    return NULL;
+}
+
+static void bench_end_to_end(size_t queue_size, size_t message_size, size_t channels, UartFlowControl flow_control, size_t burst_size,
+    uint8_t polled) {
+    static const char* names[] = {
+        [UART_FLOW_NONE] = "uart_end_to_end",
+        [UART_FLOW_RTS_CTS] = "uart_end_to_end_rts_cts",
+        [UART_FLOW_XON_XOFF] = "uart_end_to_end_xon_xoff"
+    };
+    UartConfig config = { .receive_queue_size = (uint16_t)queue_size, .receive_burst_size = (uint16_t)burst_size,
+        .transmit_queue_size = (uint16_t)queue_size, .priority_queue_size = PRIORITY_QUEUE_SIZE,
+        .rx_trigger_level = UART_DEFAULT_RX_TRIGGER_LEVEL, .tx_empty_threshold = UART_DEFAULT_TX_EMPTY_THRESHOLD,
+        .flow_control = flow_control };
+    size_t bytes = total_bytes / channels;
+    uint8_t* source = (uint8_t*)malloc(bytes);
+    uint8_t* buffers = (uint8_t*)malloc(2 * channels * message_size);
+    if (source == NULL || buffers == NULL) {
+        free(source);
+        free(buffers);
+        return;
+    }
+    // Printable so that none of it is mistaken for XON/XOFF
+    for (size_t i = 0; i < bytes; i++) source[i] = (uint8_t)(' ' + i % 95);
+    memset(buffers, 'w', 2 * channels * message_size);
+
+    UartHandle uarts[UART_CHANNEL_COUNT];
+    PeripheralEmulator* emulators[UART_CHANNEL_COUNT];
+    ChannelArgs writer_args[UART_CHANNEL_COUNT];
+    ChannelArgs reader_args[UART_CHANNEL_COUNT];
+    pthread_t writers[UART_CHANNEL_COUNT];
+    pthread_t readers[UART_CHANNEL_COUNT];
+
+    for (size_t channel = 0; channel < channels; channel++) {
+        if (initialise_uart((uint8_t)channel, &config, &uarts[channel]) != SUCCESS) return;
+    }
+    uint64_t start = now_ns();
+    for (size_t channel = 0; channel < channels; channel++) {
+        PeripheralEmulatorConfig emulator_config = { .channel = (uint8_t)channel, .baud_rate = 0,
+            .rx_source = source, .rx_source_length = bytes,
+            .hardware_flow_control = flow_control == UART_FLOW_RTS_CTS, .software_flow_control = flow_control == UART_FLOW_XON_XOFF };
+        peripheral_emulator_start(&emulator_config, &emulators[channel]);
+        writer_args[channel] = (ChannelArgs){ uarts[channel], emulators[channel], message_size, bytes, 0, &buffers[2 * channel * message_size] };
+        reader_args[channel] = (ChannelArgs){ uarts[channel], emulators[channel], message_size, bytes, 0, &buffers[(2 * channel + 1) * message_size] };
+        pthread_create(&writers[channel], NULL, end_to_end_writer, &writer_args[channel]);
+        if (!polled) pthread_create(&readers[channel], NULL, end_to_end_reader, &reader_args[channel]);
+    }
+    PollerArgs poller_args = { reader_args, channels };
+    if (polled) pthread_create(&readers[0], NULL, end_to_end_poller, &poller_args);
+
+    size_t moved = 0;
+    size_t drops = 0;
+    for (size_t channel = 0; channel < channels; channel++) {
+        pthread_join(writers[channel], NULL);
+        PeripheralEmulatorStats stats;
+        do {
+            peripheral_emulator_get_stats(emulators[channel], &stats);
+            sched_yield();
+        } while (stats.tx_bytes_sent < bytes);
+        if (!polled || channel == 0) pthread_join(readers[channel], NULL);
+    }
+    for (size_t channel = 0; channel < channels; channel++) {
+        moved += writer_args[channel].bytes_moved + reader_args[channel].bytes_moved;
+        drops += bytes - reader_args[channel].bytes_moved;
+    }
+    uint64_t elapsed = now_ns() - start;
+    size_t isrs = 0;
+    size_t wasted_isrs = 0;
+    for (size_t channel = 0; channel < channels; channel++) {
+        peripheral_emulator_stop(emulators[channel]);
+        UartStats stats;
+        if (uart_get_stats(uarts[channel], &stats, 0) == SUCCESS) {
+            isrs += stats.isr_count;
+            wasted_isrs += stats.isr_spurious;
+        }
+        stop_uart(uarts[channel]);
+    }
+
+    const char* name = polled ? "uart_end_to_end_poll" : burst_size != 0 ? "uart_end_to_end_elastic" : names[flow_control];
+    BenchResult result = { .benchmark = name, .queue_size = queue_size, .message_size = message_size, .threads = channels };
+    // Bytes counted in both directions
+    result.bytes_per_sec = (double)moved * 1e9 / (double)elapsed;
+    result.ops_per_sec = result.bytes_per_sec / (double)message_size;
+    result.drops = drops;
+    result.isrs = isrs;
+    result.wasted_isrs = wasted_isrs;
+    write_result(&result);
+    free(source);
+    free(buffers);
+}
+
+static void bench_route(size_t channels) {
+    UartConfig config = UART_DEFAULT_CONFIG;
+    config.flow_control = UART_FLOW_RTS_CTS;
+    size_t bytes = total_bytes / channels;
+    uint8_t* source = (uint8_t*)malloc(bytes);
+    if (source == NULL) return;
+    for (size_t i = 0; i < bytes; i++) source[i] = (uint8_t)i;
+
+    UartHandle uarts[UART_CHANNEL_COUNT];
+    PeripheralEmulator* emulators[UART_CHANNEL_COUNT];
+    for (size_t channel = 0; channel < channels; channel++) {
+        if (initialise_uart((uint8_t)channel, &config, &uarts[channel]) != SUCCESS) return;
+    }
+    // Neighbours in pairs, a lone channel to itself
+    for (size_t channel = 0; channel < channels; channel++) {
+        uart_route(uarts[channel], uarts[channels == 1 ? channel : channel ^ 1]);
+    }
+    uint64_t start = now_ns();
+    for (size_t channel = 0; channel < channels; channel++) {
+        PeripheralEmulatorConfig emulator_config = { .channel = (uint8_t)channel, .baud_rate = 0,
+            .rx_source = source, .rx_source_length = bytes, .hardware_flow_control = 1 };
+        peripheral_emulator_start(&emulator_config, &emulators[channel]);
+    }
+
+    // Finished once every sink has had everything, or nothing has moved for a while (bytes lost to
+    // an overrun never turn up)
+    size_t sent = 0;
+    size_t last_sent = 0;
+    uint64_t last_progress = now_ns();
+    while (sent < bytes * channels && now_ns() - last_progress < 100000000ULL) {
+        sched_yield();
+        sent = 0;
+        for (size_t channel = 0; channel < channels; channel++) {
+            PeripheralEmulatorStats stats;
+            peripheral_emulator_get_stats(emulators[channel], &stats);
+            sent += stats.tx_bytes_sent;
+        }
+        if (sent != last_sent) {
+            last_sent = sent;
+            last_progress = now_ns();
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    size_t isrs = 0;
+    size_t wasted_isrs = 0;
+    for (size_t channel = 0; channel < channels; channel++) {
+        peripheral_emulator_stop(emulators[channel]);
+        UartStats stats;
+        if (uart_get_stats(uarts[channel], &stats, 0) == SUCCESS) {
+            isrs += stats.isr_count;
+            wasted_isrs += stats.isr_spurious;
+        }
+    }
+    for (size_t channel = 0; channel < channels; channel++) stop_uart(uarts[channel]);
+
+    BenchResult result = { .benchmark = "uart_route", .queue_size = QUEUE_SIZE, .message_size = 1, .threads = channels };
+    result.bytes_per_sec = (double)sent * 1e9 / (double)elapsed;
+    result.ops_per_sec = result.bytes_per_sec;
+    result.drops = bytes * channels - sent;
+    result.isrs = isrs;
+    result.wasted_isrs = wasted_isrs;
+    write_result(&result);
+    free(source);
+}
+
+static int bench_trace_replay(const char* path) {
+    TraceReplayResult replay;
+    if (trace_replay(path, TRACE_REPLAY_BENCHMARK, &replay) != SUCCESS || replay.elapsed_ns == 0) {
+        fprintf(stderr, "Couldn't replay %s\n", path);
+        return 1;
+    }
+    BenchResult result = { .benchmark = "trace_replay", .threads = 1, .samples = replay.events, .isrs = replay.isrs };
+    result.ops_per_sec = (double)replay.events * 1e9 / (double)replay.elapsed_ns;
+    write_result(&result);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    const char* replay_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            output_format = argv[++i];
+        } else if (strcmp(argv[i], "--bytes") == 0 && i + 1 < argc) {
+            total_bytes = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            latency_samples = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--format csv|json] [--bytes N] [--samples N] [--replay TRACE]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (total_bytes == 0 || latency_samples == 0) return 1;
+
+    if (strcmp(output_format, "json") == 0) {
+        printf("[\n");
+    } else {
+        printf("benchmark,queue_size,message_size,threads,ops_per_sec,bytes_per_sec,p50_ns,p99_ns,p999_ns,samples,drops,isrs,wasted_isrs\n");
+    }
+
+    if (replay_path != NULL) {
+        int failed = bench_trace_replay(replay_path);
+        if (strcmp(output_format, "json") == 0) printf("\n]\n");
+        return failed;
+    }
+
+    static const size_t queue_sizes[] = { 64, 256, 1024, 4096 };
+    static const size_t message_sizes[] = { 1, 16, 64, 256 };
+    static const size_t channel_counts[] = { 1, 2, 4, 8 };
+    size_t queue_size_count = sizeof(queue_sizes) / sizeof(queue_sizes[0]);
+    size_t message_size_count = sizeof(message_sizes) / sizeof(message_sizes[0]);
+
+    for (size_t q = 0; q < queue_size_count; q++) {
+        for (size_t m = 0; m < message_size_count; m++) {
+            if (message_sizes[m] > queue_sizes[q]) continue;
+            bench_queue_ops(queue_sizes[q], message_sizes[m]);
+            bench_queue_spsc(queue_sizes[q], message_sizes[m]);
+        }
+    }
+    for (size_t c = 0; c < sizeof(channel_counts) / sizeof(channel_counts[0]); c++) {
+        for (size_t m = 1; m < message_size_count; m++) {
+            bench_queue_mpsc(QUEUE_SIZE, message_sizes[m], channel_counts[c]);
+        }
+    }
+    for (size_t q = 0; q < queue_size_count; q++) {
+        bench_isr_latency(queue_sizes[q]);
+    }
+    for (size_t m = 0; m < message_size_count; m++) {
+        bench_crc(CRC_16, 0, "crc16", message_sizes[m]);
+        bench_crc(CRC_32, 0, "crc32", message_sizes[m]);
+        bench_crc(CRC_32C, 0, "crc32c", message_sizes[m]);
+        bench_crc(CRC_32C, 1, "crc32c", message_sizes[m]);
+    }
+    for (int flow_control = UART_FLOW_NONE; flow_control <= UART_FLOW_XON_XOFF; flow_control++) {
+        for (size_t c = 0; c < sizeof(channel_counts) / sizeof(channel_counts[0]); c++) {
+            for (size_t m = 1; m < message_size_count; m++) {
+                bench_end_to_end(QUEUE_SIZE, message_sizes[m], channel_counts[c], (UartFlowControl)flow_control, 0, 0);
+            }
+        }
+    }
+    // Small receive queues with the segment pool shared out between the channels for bursts
+    for (size_t c = 0; c < sizeof(channel_counts) / sizeof(channel_counts[0]); c++) {
+        size_t burst_size = QUEUE_SEGMENT_COUNT / channel_counts[c] * QUEUE_SEGMENT_SIZE;
+        if (burst_size > UINT16_MAX) burst_size = UINT16_MAX / QUEUE_SEGMENT_SIZE * QUEUE_SEGMENT_SIZE;
+        for (size_t m = 1; m < message_size_count; m++) {
+            bench_end_to_end(queue_sizes[0], message_sizes[m], channel_counts[c], UART_FLOW_NONE, burst_size, 0);
+        }
+    }
+    for (size_t c = 0; c < sizeof(channel_counts) / sizeof(channel_counts[0]); c++) {
+        for (size_t m = 1; m < message_size_count; m++) {
+            bench_end_to_end(QUEUE_SIZE, message_sizes[m], channel_counts[c], UART_FLOW_NONE, 0, 1);
+        }
+    }
+    for (size_t c = 0; c < sizeof(channel_counts) / sizeof(channel_counts[0]); c++) {
+        bench_route(channel_counts[c]);
+    }
+
+    if (strcmp(output_format, "json") == 0) printf("\n]\n");
+    return 0;
+}
@@ -0,0 +1,159 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "uart.h"
+#include "pty_bridge.h"
+
+/* Puts a channel on a pseudo terminal for host tooling to talk to, see pty_bridge.h.
+Usage: uart_bridge [--channel N] [--mode loopback|echo] [--flow none|rts-cts|xon-xoff] [--seconds N]
+ - loopback routes the channel back to itself (see uart_route), so everything written to the pty
+ comes straight back through the RX interrupt, the receive queue and the TX interrupt
+ - echo has a task reading the receive queue and writing what it got to the transmit queue, so it
+ goes through the task side of the driver as well
+With xon-xoff the host can't send the XON/XOFF bytes themselves, the same as on a real line.
+The slave's path is printed at the start, then the throughput each second until --seconds have
+passed (0, the default, for until interrupted) and the totals at the end.
+*/
+
+#define ECHO_BUFFER_SIZE 1024
+
+static volatile sig_atomic_t interrupted = 0;
+static _Atomic uint8_t echoing = 1;
+
+static void on_signal(int signal_number) {
+    (void)signal_number;
+    interrupted = 1;
+}
+
+static void* echo_task(void* argument) {
+    UartHandle uart = (UartHandle)argument;
+    uint8_t buffer[ECHO_BUFFER_SIZE];
+    while (atomic_load(&echoing)) {
+        size_t read = 0;
+        // Woken as soon as there's anything, the timeout is only so it notices being stopped
+        uart_read_bytes_from_receive_queue_timeout(uart, buffer, 1, 100, &read);
+        if (read == 0) continue;
+        size_t more = 0;
+        uart_read_bytes_from_receive_queue_nonblocking(uart, &buffer[1], sizeof(buffer) - 1, &more);
+        // Retried rather than blocking outright, a host that's stopped reading would leave it stuck
+        size_t written = 0;
+        while (written < read + more && atomic_load(&echoing)) {
+            size_t count = 0;
+            uart_write_bytes_to_transmit_queue_timeout(uart, UART_PRIORITY_NORMAL, &buffer[written], read + more - written, 100, &count);
+            written += count;
+        }
+    }
+    return NULL;
+}
+
+static void print_stats(const char* label, const PtyBridgeStats* stats) {
+    printf("%s: %llu bytes in (%.0f/s), %llu bytes out (%.0f/s), %.1f bytes per pty read, %.1f per write, %llu interrupts\n",
+        label, (unsigned long long)stats->rx_bytes, stats->rx_bytes_per_sec, (unsigned long long)stats->tx_bytes,
+        stats->tx_bytes_per_sec, stats->pty_reads != 0 ? (double)stats->rx_bytes / (double)stats->pty_reads : 0.0,
+        stats->pty_writes != 0 ? (double)stats->tx_bytes / (double)stats->pty_writes : 0.0,
+        (unsigned long long)stats->interrupts_raised);
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    unsigned long channel = 0;
+    unsigned long seconds = 0;
+    uint8_t echo = 0;
+    UartFlowControl flow_control = UART_FLOW_NONE;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--channel") == 0 && i + 1 < argc) {
+            channel = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc && (strcmp(argv[i + 1], "loopback") == 0 || strcmp(argv[i + 1], "echo") == 0)) {
+            echo = strcmp(argv[++i], "echo") == 0;
+        } else if (strcmp(argv[i], "--flow") == 0 && i + 1 < argc && strcmp(argv[i + 1], "none") == 0) {
+            flow_control = UART_FLOW_NONE;
+            i++;
+        } else if (strcmp(argv[i], "--flow") == 0 && i + 1 < argc && strcmp(argv[i + 1], "rts-cts") == 0) {
+            flow_control = UART_FLOW_RTS_CTS;
+            i++;
+        } else if (strcmp(argv[i], "--flow") == 0 && i + 1 < argc && strcmp(argv[i + 1], "xon-xoff") == 0) {
+            flow_control = UART_FLOW_XON_XOFF;
+            i++;
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = strtoul(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "Usage: %s [--channel N] [--mode loopback|echo] [--flow none|rts-cts|xon-xoff] [--seconds N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (channel >= UART_CHANNEL_COUNT) {
+        fprintf(stderr, "There are only %d channels\n", UART_CHANNEL_COUNT);
+        return 1;
+    }
+
+    UartConfig config = UART_DEFAULT_CONFIG;
+    config.flow_control = flow_control;
+    UartHandle uart;
+    if (initialise_uart((uint8_t)channel, &config, &uart) != SUCCESS) {
+        fprintf(stderr, "Initialising UART channel %lu failed\n", channel);
+        return 1;
+    }
+    PtyBridgeConfig bridge_config = { .channel = (uint8_t)channel, .hardware_flow_control = flow_control == UART_FLOW_RTS_CTS,
+        .software_flow_control = flow_control == UART_FLOW_XON_XOFF };
+    PtyBridge* bridge;
+    if (pty_bridge_start(&bridge_config, &bridge) != SUCCESS) {
+        fprintf(stderr, "Couldn't open a pseudo terminal\n");
+        stop_uart(uart);
+        return 1;
+    }
+    pthread_t echo_thread;
+    uint8_t started;
+    if (echo) {
+        started = pthread_create(&echo_thread, NULL, echo_task, uart) == 0;
+    } else {
+        started = uart_route(uart, uart) == SUCCESS;
+    }
+    if (!started) {
+        fprintf(stderr, "Couldn't start the %s\n", echo ? "echo task" : "loopback route");
+        pty_bridge_stop(bridge);
+        stop_uart(uart);
+        return 1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    printf("Channel %lu is on %s (%s)\n", channel, pty_bridge_slave_path(bridge), echo ? "echo" : "loopback");
+    fflush(stdout);
+    PtyBridgeStats stats;
+    PtyBridgeStats last = { 0 };
+    for (unsigned long second = 0; !interrupted && (seconds == 0 || second < seconds); second++) {
+        struct timespec one_second = { 1, 0 };
+        nanosleep(&one_second, NULL);
+        pty_bridge_get_stats(bridge, &stats);
+        PtyBridgeStats interval = stats;
+        interval.rx_bytes -= last.rx_bytes;
+        interval.tx_bytes -= last.tx_bytes;
+        interval.pty_reads -= last.pty_reads;
+        interval.pty_writes -= last.pty_writes;
+        interval.interrupts_raised -= last.interrupts_raised;
+        interval.elapsed_ns -= last.elapsed_ns;
+        interval.rx_bytes_per_sec = (double)interval.rx_bytes * 1e9 / (double)interval.elapsed_ns;
+        interval.tx_bytes_per_sec = (double)interval.tx_bytes * 1e9 / (double)interval.elapsed_ns;
+        print_stats("Last second", &interval);
+        last = stats;
+    }
+
+    if (echo) {
+        atomic_store(&echoing, 0);
+        pthread_join(echo_thread, NULL);
+    }
+    pty_bridge_get_stats(bridge, &stats);
+    pty_bridge_stop(bridge);
+    stop_uart(uart);
+    print_stats("Total", &stats);
+    return 0;
+}
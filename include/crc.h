@@ -0,0 +1,60 @@
+#ifndef CRC_H
+#define CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "macros.h"
+
+/* crc.h and crc.c are running CRCs that can be fed a piece at a time, so a check can be worked out
+as the bytes go past rather than in a second pass over a copy.
+ - CRC_16 is CRC-16/X-25 (the HDLC/PPP frame check sequence)
+ - CRC_32 is the ethernet/zip CRC-32
+ - CRC_32C is CRC-32C (Castagnoli)
+All three are reflected so they share one slice-by-8 table implementation, which takes 8 bytes per
+step. CRC_32C uses the SSE4.2 or ARMv8 CRC32C instructions instead when the CPU has them, picked at
+runtime the first time crc_init is called.
+
+The value is sent least significant byte first after the data it covers. Because of that, running the
+CRC over data followed by its CRC always ends on the same residue. crc_check tests for that residue,
+so a receiver can feed everything through and only look at the result at the end.
+*/
+
+typedef enum {
+    CRC_NONE,
+    CRC_16,
+    CRC_32,
+    CRC_32C,
+    CRC_TYPE_COUNT
+} CrcType;
+
+#define CRC_MAX_SIZE 4 // Bytes in the biggest CRC
+
+typedef struct {
+    uint32_t value; // Running register, before the final xor
+    CrcType type;
+} Crc;
+
+void crc_init(Crc* crc, CrcType type);
+
+void crc_update(Crc* crc, const uint8_t* data, size_t size);
+
+// The CRC of everything fed in so far
+uint32_t crc_value(const Crc* crc);
+
+// 1 if everything fed in so far was some data followed by its correct CRC
+uint8_t crc_check(const Crc* crc);
+
+// Writes crc_value least significant byte first, returning how many bytes that was
+size_t crc_write(const Crc* crc, uint8_t* bytes);
+
+// Size in bytes of the given CRC, 0 for CRC_NONE
+size_t crc_size(CrcType type);
+
+// Forces the table implementation (hardware 0) or the CPU's instructions (hardware 1) for a type.
+// FAILURE if the CPU can't do that type in hardware. Mostly for benchmarking the two against each other.
+Status crc_select_implementation(CrcType type, uint8_t hardware);
+
+// e.g. "slice-by-8", "sse4.2", "armv8"
+const char* crc_implementation_name(CrcType type);
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "macros.h"
+#include "uart.h"
+#include "crc.h"
+
+/* frame.h and frame.c put COBS framed packets on top of a channel's byte queues.
+ - frame_send COBS encodes a packet straight into the transmit queue (no staging buffer) and ends
+ it with the FRAME_DELIMITER byte. Any number of tasks can send frames on a channel at once, each
+ frame goes in whole
+ - frame_receive decodes whatever has arrived into a Frame taken from a FramePool and hands back a
+ pointer to it once its delimiter turns up. The caller gives it back with frame_release when done.
+ - Either side can optionally carry a CRC (see crc.h) on the end of each frame. It's worked out while
+ the bytes are being encoded/decoded, so it costs no extra passes over the data
+ - Decoding works on the receive queue in place, finding delimiters with memchr and copying whole
+ COBS blocks at a time rather than going a byte at a time
+
+COBS (consistent overhead byte stuffing) replaces every 0 in the packet so that 0 can be used as
+the delimiter, costing at most one extra byte per 254. A receiver that starts mid packet or sees a
+corrupted one just drops bytes up to the next delimiter and carries on.
+*/
+
+#define FRAME_DELIMITER 0x00
+// Worst case encoded size of a packet of size bytes, including the delimiter
+#define FRAME_ENCODED_MAX_SIZE(size) ((size) + (size) / 254 + 2)
+
+typedef struct {
+    _Atomic uint32_t next; // Only used while the frame is sitting in the pool
+    uint16_t length;
+    uint8_t data[FRAME_MAX_SIZE];
+} Frame;
+
+// Fixed size block pool of frames. Lock-free (a Treiber stack of block indices with a tag to stop
+// ABA) so frames can be acquired and released from any context, including more than one at once.
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t head; // Free list head index in the low half, tag in the high half
+    Frame blocks[FRAME_POOL_BLOCKS];
+} FramePool;
+
+void frame_pool_init(FramePool* pool);
+
+// NULL if every frame is in use
+Frame* frame_pool_acquire(FramePool* pool);
+
+void frame_release(FramePool* pool, Frame* frame);
+
+// Number of frames currently free, only a snapshot if other contexts are using the pool
+size_t frame_pool_available(FramePool* pool);
+
+// Decoder state for one channel's receive side. Like the queue underneath only one task may be
+// receiving frames on a channel at a time.
+typedef struct {
+    UartHandle uart;
+    FramePool* pool;
+    Frame* current; // Frame being decoded into, NULL between frames
+    uint8_t code; // Current COBS block code, 0 at the start of a frame
+    uint8_t remaining; // Data bytes left in the current block
+    uint8_t discarding; // Dropping everything up to the next delimiter after a bad frame
+    CrcType crc_type;
+    Crc crc; // Running CRC of the frame being decoded
+    uint32_t frames_received;
+    uint32_t frames_dropped; // Too long for a Frame or cut short by a delimiter
+    uint32_t crc_errors; // Frames dropped because their CRC didn't match
+} FrameReceiver;
+
+void frame_receiver_init(FrameReceiver* receiver, UartHandle uart, FramePool* pool);
+
+// Frames from now on end in a CRC of this type, which is checked and stripped off before they're
+// handed back. CRC_NONE (the default) turns it off.
+void frame_receiver_set_crc(FrameReceiver* receiver, CrcType crc_type);
+
+// Nonblocking. SUCCESS with *frame set once a whole frame has been decoded, EMPTY if there isn't one
+// yet (any partial frame is kept for next time) and BUSY if the pool has no frames to decode into,
+// in which case the bytes are left in the receive queue.
+Status frame_receive(FrameReceiver* receiver, Frame** frame);
+
+// Nonblocking. Encodes size bytes (up to FRAME_MAX_SIZE) into the transmit queue as one frame, or
+// BUSY without queueing anything if the encoded frame (at most FRAME_ENCODED_MAX_SIZE(size) bytes)
+// doesn't fit in the free space.
+Status frame_send(UartHandle uart, const uint8_t* data, size_t size);
+
+// Same as frame_send but with a CRC of the data appended to the frame, size plus the CRC must fit
+// in FRAME_MAX_SIZE
+Status frame_send_with_crc(UartHandle uart, CrcType crc_type, const uint8_t* data, size_t size);
+
+// Same as frame_send_with_crc but into the given priority's transmit lane (the others use the normal
+// one), so control frames can go ahead of bulk traffic. The frame is still only ever sent whole.
+Status frame_send_with_priority(UartHandle uart, UartPriority priority, CrcType crc_type, const uint8_t* data, size_t size);
+
+#endif
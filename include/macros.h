@@ -1,22 +1,111 @@
 #ifndef MACROS_H
 #define MACROS_H
+// UART channel layout
+// Each channel has its own block of registers, channel n's block starts at
+// UART_BASE_ADDRESS + n * UART_CHANNEL_STRIDE with the registers at the offsets below
+#define UART_CHANNEL_COUNT 8
+#define UART_BASE_ADDRESS 0x80000120
+#define UART_CHANNEL_STRIDE 0x10
+#define STATUS_REGISTER_OFFSET 0x0
+#define DATA_REGISTER_OFFSET 0x2
+#define FIFO_CONTROL_REGISTER_OFFSET 0x4
+#define STATUS_SET_REGISTER_OFFSET 0x6 // Write 1s to set status bits, the rest are left alone
+#define STATUS_CLEAR_REGISTER_OFFSET 0x8 // Write 1s to clear status bits, the rest are left alone
+
+#define UART_STATUS_REGISTER_ADDRESS(channel) (UART_BASE_ADDRESS + (channel) * UART_CHANNEL_STRIDE + STATUS_REGISTER_OFFSET)
+#define UART_DATA_REGISTER_ADDRESS(channel) (UART_BASE_ADDRESS + (channel) * UART_CHANNEL_STRIDE + DATA_REGISTER_OFFSET)
+#define UART_FIFO_CONTROL_REGISTER_ADDRESS(channel) (UART_BASE_ADDRESS + (channel) * UART_CHANNEL_STRIDE + FIFO_CONTROL_REGISTER_OFFSET)
+#define UART_STATUS_SET_REGISTER_ADDRESS(channel) (UART_BASE_ADDRESS + (channel) * UART_CHANNEL_STRIDE + STATUS_SET_REGISTER_OFFSET)
+#define UART_STATUS_CLEAR_REGISTER_ADDRESS(channel) (UART_BASE_ADDRESS + (channel) * UART_CHANNEL_STRIDE + STATUS_CLEAR_REGISTER_OFFSET)
+
 // UART status register information
-#define STATUS_REGISTER_ADDRESS 0x80000120
+#define STATUS_REGISTER_ADDRESS UART_STATUS_REGISTER_ADDRESS(0) // Channel 0
 #define RX_NOT_EMPTY_BIT 0
 #define TX_NOT_FULL_BIT 1
 #define RX_ERROR_BIT 2
+#define CTS_BIT 3 // Clear to send input, set while the far end is ready for more
+#define RTS_BIT 10 // Request to send output, set while this end is ready for more
+#define AUTO_CTS_ENABLE_BIT 11 // The transmitter holds the next byte back while CTS is clear
+#define TX_INTERRUPT_ENABLE_BIT 12 // Masks just the TX empty interrupt, the transmitter keeps going
 #define TX_ENABLE_BIT 13
 #define RX_ENABLE_BIT 14
 #define INTERRUPT_ENABLE_BIT 15
 
+// All of the writable bits are in the upper byte of the status register, the lower byte is owned
+// by the peripheral and is never written back by the processor
+#define STATUS_WRITABLE_MASK ((1U << RTS_BIT) | (1U << AUTO_CTS_ENABLE_BIT) | (1U << TX_INTERRUPT_ENABLE_BIT) \
+    | (1U << TX_ENABLE_BIT) | (1U << RX_ENABLE_BIT) | (1U << INTERRUPT_ENABLE_BIT))
+
 #define RX_INTERRUPT_BITS ((1U << RX_NOT_EMPTY_BIT) | (1U << RX_ENABLE_BIT)) // Bit mask for an RX interrupt
-#define TX_INTERRUPT_BITS ((1U << TX_NOT_FULL_BIT) | (1U << TX_ENABLE_BIT)) // Bit mas for a TX interrupt
+#define TX_INTERRUPT_BITS ((1U << TX_NOT_FULL_BIT) | (1U << TX_INTERRUPT_ENABLE_BIT) | (1U << TX_ENABLE_BIT)) // Bit mas for a TX interrupt
+
+// Software flow control characters (DC1 and DC3)
+#define UART_XON 0x11
+#define UART_XOFF 0x13
 
 // UART data register information
-#define DATA_REGISTER_ADDRESS 0x80000122 // Access most recently received byte here
+#define DATA_REGISTER_ADDRESS UART_DATA_REGISTER_ADDRESS(0) // Access most recently received byte here (channel 0)
+
+// UART FIFO control register information
+// Byte 0 - RX trigger level, RX interrupt fires once this many bytes are in the RX FIFO
+// Byte 1 - TX empty threshold, TX interrupt fires once the TX FIFO has this many bytes or fewer
+#define UART_FIFO_MAX_DEPTH 64 // Must be a power of two
+#define UART_FIFO_DEFAULT_DEPTH 16
+#define UART_DEFAULT_RX_TRIGGER_LEVEL 8
+#define UART_DEFAULT_TX_EMPTY_THRESHOLD 4
 
 // Queues
-#define QUEUE_SIZE 256
+#ifndef QUEUE_SIZE
+#define QUEUE_SIZE 256 // Default size of each channel's queues, must be a power of two
+#endif
+#ifndef PRIORITY_QUEUE_SIZE
+#define PRIORITY_QUEUE_SIZE 64 // Default size of the high priority transmit lane, it's for short messages
+#endif
+// Bytes the higher transmit lanes can send while a lower lane has a message waiting before that
+// message gets to go next
+#ifndef UART_TX_STARVATION_BYTES
+#define UART_TX_STARVATION_BYTES 256
+#endif
+
+// Segments elastic queues borrow once their own storage is full (see queue_set_elastic). The pool
+// is shared by every queue, so QUEUE_SEGMENT_SIZE * QUEUE_SEGMENT_COUNT is all the burst memory there is.
+#ifndef QUEUE_SEGMENT_SIZE
+#define QUEUE_SEGMENT_SIZE 64
+#endif
+#ifndef QUEUE_SEGMENT_COUNT
+#define QUEUE_SEGMENT_COUNT 64
+#endif
+
+// Heap free build, selected with make STATIC_QUEUES=1 which defines UART_STATIC_QUEUES. Every
+// channel's queues are declared statically with the capacities below instead of initialise_uart
+// allocating them, and the queue sizes in UartConfig are ignored. Capacities must be powers of two
+// no bigger than UART_STATIC_QUEUE_MAX_CAPACITY, which also picks the width of the queue indices.
+// Both can be overridden from the command line to size the queues for a particular target.
+#ifdef UART_STATIC_QUEUES
+#ifndef UART_STATIC_QUEUE_CAPACITIES
+// X(channel, receive queue capacity, transmit queue capacity, high priority transmit lane capacity)
+#define UART_STATIC_QUEUE_CAPACITIES(X) \
+    X(0, QUEUE_SIZE, QUEUE_SIZE, PRIORITY_QUEUE_SIZE) X(1, 64, 32, 16) X(2, QUEUE_SIZE, QUEUE_SIZE, PRIORITY_QUEUE_SIZE) \
+    X(3, 64, 64, 32) X(4, 64, 64, 32) X(5, 64, 64, 32) X(6, 64, 64, 32) X(7, 64, 64, 32)
+#endif
+#ifndef UART_STATIC_QUEUE_MAX_CAPACITY
+#define UART_STATIC_QUEUE_MAX_CAPACITY QUEUE_SIZE
+#endif
+#endif
+
+// Frames (see frame.h)
+#ifndef FRAME_MAX_SIZE
+#define FRAME_MAX_SIZE 128 // Biggest decoded packet, encoded it has to fit in the transmit queue
+#endif
+#ifndef FRAME_POOL_BLOCKS
+#define FRAME_POOL_BLOCKS 8 // Frames in each FramePool
+#endif
+
+// Used to keep data written by different contexts on separate cache lines. Targets without a data
+// cache can set this to the pointer size to stop the padding costing RAM.
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
 
 // Status class to be used globally
 typedef enum Status {
@@ -0,0 +1,59 @@
+#ifndef PERIPHERAL_EMULATOR_H
+#define PERIPHERAL_EMULATOR_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "macros.h"
+
+/* peripheral_emulator.h and peripheral_emulator.c act as the other end of the serial line and the
+interrupt controller for one channel, running on their own thread. They:
+ - Stream bytes from a source buffer into the channel's RX FIFO
+ - Drain bytes out of the channel's TX FIFO into a sink buffer
+ - Do both one character time at a time for the configured baud rate (or as fast as possible)
+ - Raise the channel's interrupt through the vector table whenever it is asserted, which only
+ happens if the UART's interrupt enable bit and global interrupts are both enabled
+ - Optionally do flow control, holding the source back while the channel has RTS clear or between
+ an XOFF and an XON from the channel
+This means the ISR runs asynchronously to the task side code, the same as it would on hardware.
+*/
+
+typedef struct {
+    uint8_t channel;
+    uint32_t baud_rate; // 0 means as fast as possible
+    // Bytes that arrive on the line, may be NULL if nothing is to be received
+    const uint8_t* rx_source;
+    size_t rx_source_length;
+    // Where the bytes sent out on the line go, anything past tx_sink_size is counted but dropped
+    uint8_t* tx_sink;
+    size_t tx_sink_size;
+    // The far end's flow control. Hardware watches the channel's RTS (and keeps its CTS set as the
+    // sink never fills), software takes XON/XOFF out of what the channel sends rather than putting
+    // them in the sink.
+    uint8_t hardware_flow_control;
+    uint8_t software_flow_control;
+} PeripheralEmulatorConfig;
+
+typedef struct {
+    size_t rx_bytes_delivered; // Bytes put into the RX FIFO
+    size_t rx_overruns; // Bytes lost because the RX FIFO was full
+    size_t tx_bytes_sent; // Bytes taken out of the TX FIFO, not counting XON/XOFF with software flow control
+    size_t rx_flow_holds; // Character times the source was held back by flow control
+    size_t interrupts_raised; // Times the ISR was called
+} PeripheralEmulatorStats;
+
+typedef struct PeripheralEmulator PeripheralEmulator;
+
+// Starts the emulator thread. The channel's ISR must not be called from anywhere else until the
+// emulator has been stopped.
+Status peripheral_emulator_start(const PeripheralEmulatorConfig* config, PeripheralEmulator** emulator);
+
+// Stops and joins the emulator thread and frees it
+void peripheral_emulator_stop(PeripheralEmulator* emulator);
+
+// Safe to call while the emulator is running
+void peripheral_emulator_get_stats(PeripheralEmulator* emulator, PeripheralEmulatorStats* stats);
+
+// 1 once every source byte has been put on the line (delivered or overrun)
+uint8_t peripheral_emulator_rx_complete(PeripheralEmulator* emulator);
+
+#endif
@@ -3,28 +3,223 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "macros.h"
+#include "trace.h"
 
 /* processor_interface.h and processor_interface.c are meant to act as interfaces for interaction
 with the direct hardware of the processor. Things that are included in here are:
  - Accessing global interrupt mask through macros
  - Reading and writing to status register
  - Reading and writing to data register
+ - Reading and writing to FIFO control register
+ - Writing to the status set/clear aliases
 */
 
 /* Some points about how this has been implemented
- - Addresses that are not part of these two registers are treated as read only that are set to
+ - Addresses that are not part of these registers are treated as read only that are set to
  0 always. Not really important to be creating a whole processor emulator here.
  - All possible ways of interacting with the register contents are implemented, even if they won't be
  used just so that I'm doing the best that I can to actually "simulate" interacting with the processor
  - Assume that second byte of data register is reserved and reads always as 0s and can't be written to
+ - There are UART_CHANNEL_COUNT channels, each with its own status/data register pair. Channel n's
+ registers are at UART_BASE_ADDRESS + n * UART_CHANNEL_STRIDE and addresses are decoded into a channel
+ and an offset within that channel's block
+ - Each channel has an RX and a TX hardware FIFO. The RX not empty and TX not full status bits
+ reflect the FIFOs, reading the data register pops from the RX FIFO and writing it pushes to the TX FIFO
+ - Writing 1s to the status set/clear aliases sets/clears just those bits atomically, the same as the
+ SET/CLR register aliases a lot of microcontrollers have. They read as 0.
+ - The modem lines are in the status register too. RTS is an output the processor drives, CTS an
+ input the far end drives (it reads as set when nothing is driving it). With auto CTS enabled the
+ transmitter won't take the next byte out of the TX FIFO while CTS is clear, the same as the auto
+ flow control on a 16750.
+ - In a trace build every access and line side event can be recorded, see trace.h
 */
 
 // Global interrupt macros
-static volatile uint8_t are_interrupts_enabled = 0;
+// Defined once in processor_interface.c so that every file (and thread) sees the same mask
+extern _Atomic uint8_t are_interrupts_enabled;
 #define INTERRUPT_DISABLE() are_interrupts_enabled = 0
 #define INTERRUPT_ENABLE() are_interrupts_enabled = 1
 #define IS_INTERRUPT_ENABLED() (are_interrupts_enabled)
 
+// Free running cycle counter for timing things like the ISR, the same job as DWT->CYCCNT on a
+// Cortex-M. Only differences between two reads mean anything.
+static inline uint64_t read_cycle_counter(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t value;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return (uint64_t)time.tv_sec * 1000000000ULL + (uint64_t)time.tv_nsec;
+#endif
+}
+
+// Each channel has the same register block, padded out to its own cache line so that one channel
+// being serviced doesn't drag another channel's registers into the cache. It lives in the header so
+// that the typed accessors below can be inlined. values holds the register bytes at their offsets:
+// Byte 0 - First byte of status register
+// Byte 1 - Second byte of status register
+// Byte 2 - First Byte of data register (last byte that went through it)
+// Byte 3 - Second Byte of data register
+// Byte 4 - RX trigger level
+// Byte 5 - TX empty threshold
+#define REGISTER_BLOCK_BYTES (FIFO_CONTROL_REGISTER_OFFSET + 2)
+
+// Hardware FIFO between the data register and the line. Single producer/single consumer, the
+// peripheral fills the RX FIFO and the processor empties it, the other way round for TX.
+// front and rear are free running and masked with UART_FIFO_MAX_DEPTH, depth limits how full it gets.
+typedef struct {
+    _Atomic uint8_t front;
+    _Atomic uint8_t rear;
+    uint8_t data[UART_FIFO_MAX_DEPTH];
+} HardwareFifo;
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint8_t values[REGISTER_BLOCK_BYTES];
+    _Atomic uint8_t rx_timeout; // Set by the peripheral when the line goes idle with data in the RX FIFO
+    uint8_t fifo_depth;
+    HardwareFifo rx_fifo;
+    HardwareFifo tx_fifo;
+} RegisterBlock;
+
+extern RegisterBlock register_blocks[UART_CHANNEL_COUNT];
+
+static inline uint8_t hardware_fifo_level(HardwareFifo* fifo) {
+    return (uint8_t)(atomic_load_explicit(&fifo->rear, memory_order_acquire)
+        - atomic_load_explicit(&fifo->front, memory_order_acquire));
+}
+
+static inline Status hardware_fifo_push(HardwareFifo* fifo, uint8_t depth, uint8_t value) {
+    uint8_t rear = atomic_load_explicit(&fifo->rear, memory_order_relaxed);
+    uint8_t front = atomic_load_explicit(&fifo->front, memory_order_acquire);
+    if ((uint8_t)(rear - front) >= depth) return BUSY;
+    fifo->data[rear & (UART_FIFO_MAX_DEPTH - 1)] = value;
+    atomic_store_explicit(&fifo->rear, (uint8_t)(rear + 1), memory_order_release);
+    return SUCCESS;
+}
+
+static inline Status hardware_fifo_pop(HardwareFifo* fifo, uint8_t* value) {
+    uint8_t front = atomic_load_explicit(&fifo->front, memory_order_relaxed);
+    uint8_t rear = atomic_load_explicit(&fifo->rear, memory_order_acquire);
+    if (front == rear) return EMPTY;
+    *value = fifo->data[front & (UART_FIFO_MAX_DEPTH - 1)];
+    atomic_store_explicit(&fifo->front, (uint8_t)(front + 1), memory_order_release);
+    return SUCCESS;
+}
+
+// Typed register accessors. These have the same side effects as going through read_address_* and
+// write_address_* but skip the runtime address decode, so for a constant channel uart_registers
+// folds down to a constant address the same way a CMSIS style UART0->STATUS access does.
+// In a trace build (see trace.h) each one is also a trace event, the fetch_* helpers underneath
+// are the same access without one so the accessors can be built out of each other.
+static inline RegisterBlock* uart_registers(uint8_t channel) {
+    return &register_blocks[channel];
+}
+
+static inline uint8_t register_block_channel(RegisterBlock* block) {
+    return (uint8_t)(block - register_blocks);
+}
+
+// Reading the lower status byte reports the live FIFO state and clears the RX error (read to clear)
+static inline uint8_t fetch_uart_status_low(RegisterBlock* block) {
+    uint8_t value = atomic_fetch_and(&block->values[STATUS_REGISTER_OFFSET], (uint8_t)~(1U << RX_ERROR_BIT));
+    value &= (uint8_t)~((1U << RX_NOT_EMPTY_BIT) | (1U << TX_NOT_FULL_BIT));
+    if (hardware_fifo_level(&block->rx_fifo) != 0) value |= (1U << RX_NOT_EMPTY_BIT);
+    if (hardware_fifo_level(&block->tx_fifo) < block->fifo_depth) value |= (1U << TX_NOT_FULL_BIT);
+    return value;
+}
+
+// The upper status byte is just the enable bits so reading it has no side effects
+static inline uint8_t fetch_uart_status_high(RegisterBlock* block) {
+    return block->values[STATUS_REGISTER_OFFSET + 1];
+}
+
+static inline uint16_t fetch_uart_status(RegisterBlock* block) {
+    uint16_t low = fetch_uart_status_low(block);
+    return (uint16_t)((fetch_uart_status_high(block) << 8) | low);
+}
+
+// Reading the data register pops the next byte out of the RX FIFO. If it's empty then the last
+// byte that went through the data register is read again.
+static inline uint8_t fetch_uart_data(RegisterBlock* block) {
+    uint8_t value;
+    if (hardware_fifo_pop(&block->rx_fifo, &value) == SUCCESS) {
+        block->values[DATA_REGISTER_OFFSET] = value;
+        if (hardware_fifo_level(&block->rx_fifo) == 0) block->rx_timeout = 0;
+    }
+    return block->values[DATA_REGISTER_OFFSET];
+}
+
+static inline uint8_t read_uart_status_low(RegisterBlock* block) {
+    TRACE_BEGIN();
+    uint8_t value = fetch_uart_status_low(block);
+    TRACE_END(TRACE_READ_STATUS_LOW, register_block_channel(block), value);
+    return value;
+}
+
+static inline uint8_t read_uart_status_high(RegisterBlock* block) {
+    TRACE_BEGIN();
+    uint8_t value = fetch_uart_status_high(block);
+    TRACE_END(TRACE_READ_STATUS_HIGH, register_block_channel(block), value);
+    return value;
+}
+
+static inline uint16_t read_uart_status(RegisterBlock* block) {
+    TRACE_BEGIN();
+    uint16_t value = fetch_uart_status(block);
+    TRACE_END(TRACE_READ_STATUS, register_block_channel(block), value);
+    return value;
+}
+
+static inline uint8_t read_uart_data(RegisterBlock* block) {
+    TRACE_BEGIN();
+    uint8_t value = fetch_uart_data(block);
+    TRACE_END(TRACE_READ_DATA, register_block_channel(block), value);
+    return value;
+}
+
+// Status in bits 0-15 and the data byte in bits 16-23, the same as a 32 bit read at the status
+// register. The snapshot only pops the data register if its own status says there's a byte there,
+// so a byte landing between the two halves can't be taken without the status showing it.
+static inline uint32_t read_uart_status_and_data(RegisterBlock* block) {
+    TRACE_BEGIN();
+    uint32_t status = fetch_uart_status(block);
+    uint32_t data = ((status >> RX_NOT_EMPTY_BIT) & 0x1) ? fetch_uart_data(block) : block->values[DATA_REGISTER_OFFSET];
+    uint32_t value = status | (data << 16);
+    TRACE_END(TRACE_READ_STATUS_AND_DATA, register_block_channel(block), value);
+    return value;
+}
+
+// Writing the data register pushes into the TX FIFO, writes while it is full are lost
+static inline void write_uart_data(RegisterBlock* block, uint8_t value) {
+    TRACE_BEGIN();
+    block->values[DATA_REGISTER_OFFSET] = value;
+    hardware_fifo_push(&block->tx_fifo, block->fifo_depth, value);
+    TRACE_END(TRACE_WRITE_DATA, register_block_channel(block), value);
+}
+
+// The status set/clear aliases, only the bits given change and it's one atomic operation
+static inline void set_uart_status_bits(RegisterBlock* block, uint16_t bits) {
+    TRACE_BEGIN();
+    atomic_fetch_or(&block->values[STATUS_REGISTER_OFFSET + 1], (uint8_t)((bits & STATUS_WRITABLE_MASK) >> 8));
+    TRACE_END(TRACE_SET_STATUS_BITS, register_block_channel(block), bits);
+}
+
+static inline void clear_uart_status_bits(RegisterBlock* block, uint16_t bits) {
+    TRACE_BEGIN();
+    atomic_fetch_and(&block->values[STATUS_REGISTER_OFFSET + 1], (uint8_t)~((bits & STATUS_WRITABLE_MASK) >> 8));
+    TRACE_END(TRACE_CLEAR_STATUS_BITS, register_block_channel(block), bits);
+}
+
 uint8_t read_address_8bit(uint16_t* address);
 uint16_t read_address_16bit(uint16_t* address);
 uint32_t read_address_32bit(uint16_t* address);
@@ -33,10 +228,42 @@ void write_address_8bit(uint16_t* address, uint8_t value);
 void write_address_16bit(uint16_t* address, uint16_t value);
 void write_address_32bit(uint16_t* address, uint32_t value);
 
-void display_register_status(void);
-void set_rx_not_empty(uint8_t value);
-void set_tx_not_full(uint8_t value);
-void set_rx_error(uint8_t value);
-void set_data_register(uint8_t value);
+void display_register_status(uint8_t channel);
+
+// Hardware FIFO depth of a channel, between 1 and UART_FIFO_MAX_DEPTH. This is a property of the
+// peripheral (i.e. which part is fitted) rather than something the driver sets.
+Status configure_uart_fifo(uint8_t channel, uint8_t depth);
+
+// Non zero if the channel's interrupt line is asserted, made up of the *_INTERRUPT_PENDING flags
+// for whichever sources are asserting it. The RX interrupt fires once the RX FIFO reaches the
+// trigger level (or on an RX timeout or error), the TX interrupt while the TX FIFO is at or below
+// the empty threshold and the TX interrupt enable bit is set. Neither fires unless the channel's
+// interrupt enable bit is set.
+#define RX_INTERRUPT_PENDING 0x1
+#define TX_INTERRUPT_PENDING 0x2
+uint8_t uart_interrupt_pending(uint8_t channel);
+
+// Interrupt vector table, one handler per channel. raise_pending_interrupt acts as the interrupt
+// controller, calling the channel's handler if its interrupt is asserted and global interrupts are
+// enabled. Returns 1 if the handler was called. Only one context may raise a given channel's
+// interrupt at a time, the same way a real ISR can't preempt itself.
+typedef void (*InterruptHandler)(void);
+void set_interrupt_handler(uint8_t channel, InterruptHandler handler);
+uint8_t raise_pending_interrupt(uint8_t channel);
+
+// These simulate the peripheral (line) side of the given channel
+// A byte arriving on the line, BUSY if the RX FIFO overran (which also raises the RX error bit)
+Status peripheral_receive_byte(uint8_t channel, uint8_t value);
+// The line taking the next byte out of the TX FIFO, EMPTY if there's nothing to send and BUSY if
+// auto CTS is holding it back
+Status peripheral_transmit_byte(uint8_t channel, uint8_t* value);
+// The far end driving the channel's CTS input, non zero when it's ready for more
+void peripheral_set_cts(uint8_t channel, uint8_t asserted);
+// The channel's RTS output as the far end sees it, 1 while the channel is ready for more
+uint8_t peripheral_rts_asserted(uint8_t channel);
+// The line has gone idle with bytes still sitting below the RX trigger level
+void signal_rx_timeout(uint8_t channel);
+// A corrupted byte arrived. The error bit is cleared by reading the status register
+void set_rx_error(uint8_t channel, uint8_t value);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,67 @@
+#ifndef PTY_BRIDGE_H
+#define PTY_BRIDGE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "macros.h"
+
+/* pty_bridge.h and pty_bridge.c put a channel's line on a Linux pseudo terminal, so real host
+tooling (screen, protocol stacks, test rigs) can talk to the driver without any hardware. Like the
+peripheral emulator it's the far end of the line and the interrupt controller for the channel,
+running on its own thread:
+ - Bytes written to the pty's slave side are read off the master in blocks of up to
+ PTY_BRIDGE_BUFFER_SIZE and go into the RX FIFO as fast as the ISR takes them, so they arrive
+ through the RX interrupt path. While the RX FIFO is full (or the channel has RTS clear, with
+ hardware flow control) the bridge stops reading the master, so the host's writes back up instead
+ of bytes being lost.
+ - Whatever the channel sends is taken out of the TX FIFO into a buffer and written to the master
+ in blocks, so it comes out of the slave side. If the host isn't reading, the TX FIFO and then the
+ transmit queue fill up the same as they would with a slow line.
+ - The slave is put in raw mode so the terminal layer passes every byte through untouched. The
+ bridge keeps the slave open itself, so tools can come and go without the master seeing a hang up.
+ - There's no baud rate, bytes move as fast as both sides can take them. With nothing moving the
+ thread sleeps in poll() on the master, waking every PTY_BRIDGE_IDLE_POLL_MS to look for anything
+ queued to transmit, so an idle bridge doesn't spin.
+*/
+
+#define PTY_BRIDGE_BUFFER_SIZE 4096
+#define PTY_BRIDGE_WRITE_BATCH 1024 // Least written to the pty at once while the host is still sending
+#define PTY_BRIDGE_IDLE_POLL_MS 1
+
+typedef struct {
+    uint8_t channel;
+    // The host's flow control. Hardware holds bytes back while the channel has RTS clear (and keeps
+    // its CTS set, the pty takes everything), software takes XON/XOFF out of what the channel sends
+    // and holds bytes back between them.
+    uint8_t hardware_flow_control;
+    uint8_t software_flow_control;
+} PtyBridgeConfig;
+
+typedef struct {
+    uint64_t rx_bytes; // Read from the pty and put into the RX FIFO
+    uint64_t tx_bytes; // Taken out of the TX FIFO and written to the pty, not counting XON/XOFF
+    uint64_t pty_reads; // read() calls that got something, so rx_bytes / pty_reads is the batch size
+    uint64_t pty_writes;
+    uint64_t interrupts_raised;
+    uint64_t elapsed_ns; // Since the bridge started
+    double rx_bytes_per_sec; // Averaged over elapsed_ns
+    double tx_bytes_per_sec;
+} PtyBridgeStats;
+
+typedef struct PtyBridge PtyBridge;
+
+// Opens the pty and starts the bridge thread. The channel has to be initialised already, and its
+// ISR must not be called from anywhere else until the bridge has been stopped. Anything left in the
+// channel's FIFOs is thrown away first. FAILURE if the pty can't be set up.
+Status pty_bridge_start(const PtyBridgeConfig* config, PtyBridge** bridge);
+
+// Stops and joins the bridge thread, closes the pty and frees it
+void pty_bridge_stop(PtyBridge* bridge);
+
+// Path of the slave side, e.g. /dev/pts/3, for the host tooling to open
+const char* pty_bridge_slave_path(const PtyBridge* bridge);
+
+// Safe to call while the bridge is running
+void pty_bridge_get_stats(PtyBridge* bridge, PtyBridgeStats* stats);
+
+#endif
@@ -1,35 +1,212 @@
 #ifndef QUEUE_H
 #define QUEUE_H
 
+#include <stddef.h>
 #include <stdint.h>
-// Asked Generative AI for a good library for mutexes
-// On real embedded hardware, you wouldn’t use queues like this as they block inside the ISR, 
-// so instead you’d use the freertos queues (e.g. FreeRTOS xQueueSendFromISR) 
-// which do atomic reads and writes.
-#include <pthread.h> 
+#include <stdatomic.h>
 #include "macros.h"
 
-typedef struct { 
+// Lock-free single-producer/single-consumer ring buffer.
+// Exactly one context may call the producer functions (enqueue) and exactly one context may call
+// the consumer functions (dequeue) at a time, e.g. the ISR on one side and a task on the other.
+// Nothing here ever blocks, so it is safe to use from inside the ISR. This plays the same role as
+// the FreeRTOS xQueueSendFromISR style queues would on real hardware.
+//
+// front and rear are free running indices that are masked on access, so the capacity must be a
+// power of two. The producer and consumer indices sit on separate cache lines so that the ISR and
+// the task side don't keep stealing the same line off each other. Each side also keeps a cached
+// copy of the other side's index so that most operations don't have to touch the other line at all.
+
+// In the static build the indices only need to be wide enough for the biggest queue. A free running
+// index can tell 2^bits different lengths apart, so it covers capacities up to half its range.
+#if defined(UART_STATIC_QUEUES) && UART_STATIC_QUEUE_MAX_CAPACITY <= 128
+typedef uint8_t queue_index_t;
+typedef uint8_t queue_count_t;
+#define QUEUE_MAX_CAPACITY 128
+#elif defined(UART_STATIC_QUEUES) && UART_STATIC_QUEUE_MAX_CAPACITY <= 32768
+typedef uint16_t queue_index_t;
+typedef uint16_t queue_count_t;
+#define QUEUE_MAX_CAPACITY 32768
+#else
+typedef uint32_t queue_index_t;
+typedef uint16_t queue_count_t; // A length within a queue, which is never more than the capacity
+#define QUEUE_MAX_CAPACITY 32768 // Biggest power of two initialise_queue can be asked for
+#endif
+
+// If every queue has the same capacity, defining QUEUE_FIXED_CAPACITY to it makes the capacity and
+// mask compile time constants so the wrap around is an and with an immediate
+#ifdef QUEUE_FIXED_CAPACITY
+_Static_assert(QUEUE_FIXED_CAPACITY != 0 && (QUEUE_FIXED_CAPACITY & (QUEUE_FIXED_CAPACITY - 1)) == 0,
+    "QUEUE_FIXED_CAPACITY must be a power of two");
+#define QUEUE_CAPACITY(queue) ((void)(queue), (queue_index_t)QUEUE_FIXED_CAPACITY)
+#define QUEUE_MASK(queue) ((void)(queue), (queue_index_t)(QUEUE_FIXED_CAPACITY - 1))
+#else
+#define QUEUE_CAPACITY(queue) ((queue)->array_length)
+#define QUEUE_MASK(queue) ((queue)->mask)
+#endif
+
+// A contiguous piece of the queue's storage. Because the storage wraps around, a region of the
+// queue is described by up to two of these, the second one being empty if there's no wrap.
+typedef struct {
     uint8_t* data;
-    uint16_t front;
-    uint16_t rear;
-    uint16_t size;
-    uint16_t array_length;
-    pthread_mutex_t mutex;
+    size_t size;
+} QueueSpan;
+
+typedef struct {
+    // Consumer side
+    _Alignas(CACHE_LINE_SIZE) _Atomic queue_index_t front;
+    queue_index_t cached_rear;
+    // Elastic queues only (see queue_set_elastic), the chained bytes taken so far and the segment
+    // the next one is in along with the chained byte count its first byte has
+    _Atomic uint32_t spill_consumed;
+    uint32_t spill_head;
+    uint32_t spill_head_start;
+
+    // Producer side
+    _Alignas(CACHE_LINE_SIZE) _Atomic queue_index_t rear;
+    queue_index_t cached_front;
+    _Atomic queue_index_t reserved; // Shared producers only, the end of the last reservation
+    // Elastic queues only. spill_state is the count of bytes ever chained plus the SPILL_ flags
+    // below, spill_first is the first segment of the chain for the consumer to pick up.
+    _Atomic uint32_t spill_state;
+    _Atomic uint32_t spill_first;
+    uint32_t spill_tail;
+    uint16_t spill_tail_used;
+    uint8_t spilling;
+
+    // Read only after initialisation
+    _Alignas(CACHE_LINE_SIZE) uint8_t* data;
+    _Atomic queue_count_t* commits; // Shared producers only, one per byte of storage
+    _Atomic uint8_t* message_ends; // Shared producers only, a bit per byte set on the last byte of each message
+    uint32_t spill_limit; // Most bytes an elastic queue can have chained at once, 0 if it isn't elastic
+    queue_index_t mask;
+    queue_index_t array_length;
 } Queue;
 
+#define SPILL_CLOSED (1UL << 31) // No chain, the producer is using the queue's own storage
+#define SPILL_BUSY (1UL << 30) // The producer is adding to the chain so it can't be closed
+#define SPILL_COUNT_MASK (SPILL_BUSY - 1)
+
+// max_queue_size must be a non zero power of two, otherwise NULL is returned
 Queue* initialise_queue(uint16_t max_queue_size);
 
 void delete_queue(Queue* queue);
 
+// Sets up a queue the caller has allocated (e.g. statically) over storage of capacity bytes. Never
+// allocates, it only resets the indices. FAILURE if the capacity isn't a power of two that the
+// index type can hold.
+Status initialise_static_queue(Queue* queue, uint8_t* storage, uint16_t capacity);
+
+// The same again for a queue with any number of producers (see queue_reserve_shared). The static
+// version also needs a commits array of capacity entries and a message_ends array of
+// QUEUE_MESSAGE_ENDS_SIZE(capacity) bytes.
+Queue* initialise_shared_queue(uint16_t max_queue_size);
+
+Status initialise_static_shared_queue(Queue* queue, uint8_t* storage, _Atomic queue_count_t* commits,
+    _Atomic uint8_t* message_ends, uint16_t capacity);
+
+#define QUEUE_MESSAGE_ENDS_SIZE(capacity) (((capacity) + 7U) / 8U)
+
+static inline size_t queue_capacity(const Queue* queue) {
+    return QUEUE_CAPACITY(queue);
+}
+
+// Elastic queues. Once an elastic queue's own storage is full, enqueue carries on into a chain of
+// QUEUE_SEGMENT_SIZE byte segments borrowed from a pool of QUEUE_SEGMENT_COUNT shared by every queue,
+// so a burst on one channel can use memory an idle one isn't, and the total is still fixed at build
+// time. Nothing is allocated, borrowing a segment is a pop off a lock-free free list so it's fine
+// from inside the ISR. The producer doesn't go back to its own storage until the consumer has
+// drained the chain, so the bytes still come out in order. The consumer gives each segment back as
+// it finishes with it and the last one as soon as the chain is empty.
+// burst_size is the most the queue can have chained at once, a multiple of QUEUE_SEGMENT_SIZE (0
+// turns it off). Only enqueue and enqueue_bulk chain, queue_reserve sticks to the queue's own
+// storage. Set up before either side starts, FAILURE for a shared queue.
+Status queue_set_elastic(Queue* queue, size_t burst_size);
+
+// Gives back any segments a queue has borrowed, for when it's finished with. Neither side can be
+// active. delete_queue does this itself.
+void queue_release_segments(Queue* queue);
+
+// Segments left in the pool, only a snapshot if any elastic queues are active
+size_t queue_segments_free(void);
+
+// Consumer side
 Status dequeue(Queue* queue, uint8_t* data);
 
+// Producer side
 Status enqueue(Queue* queue, uint8_t data);
 
+// Bulk versions of the above. Move as many bytes as currently fit (up to size) using at most two
+// memcpys, one either side of the wrap around, and a single index update. The number of bytes
+// actually moved is written to bytes_written/bytes_read. BUSY/EMPTY are only returned if no bytes
+// could be moved at all.
+Status enqueue_bulk(Queue* queue, const uint8_t* data, size_t size, size_t* bytes_written);
+
+Status dequeue_bulk(Queue* queue, uint8_t* data, size_t size, size_t* bytes_read);
+
+// Zero copy producer side. queue_reserve hands back the next size bytes of free storage (BUSY if
+// there isn't that much space right now, FAILURE if size is more than the queue's capacity) which
+// the caller fills in place and then publishes with queue_commit. Committing less than was
+// reserved is fine, nothing is visible to the consumer until it's committed.
+Status queue_reserve(Queue* queue, size_t size, QueueSpan* first, QueueSpan* second);
+
+Status queue_commit(Queue* queue, size_t size);
+
+// Zero copy consumer side. queue_peek exposes everything currently readable (EMPTY if nothing is)
+// without removing it, the caller then releases however much it has finished with using
+// queue_consume. The spans stay valid until they're consumed. For an elastic queue that has
+// chained, it's the queue's own storage first and then the chain two segments at a time, so there
+// can be more after the spans.
+Status queue_peek(Queue* queue, QueueSpan* first, QueueSpan* second);
+
+Status queue_consume(Queue* queue, size_t size);
+
+// The contiguous run of readable bytes starting offset bytes from the front, EMPTY if there aren't
+// any that far in. queue_peek can't show a chain (see queue_set_elastic) at the same time as the
+// queue's own storage, this lets the consumer walk all of it a span at a time.
+Status queue_peek_at(Queue* queue, size_t offset, QueueSpan* span);
+
+// Multi-producer side, for queues set up with initialise_shared_queue. These must be the only
+// producer functions used on such a queue, the consumer side is the same as above.
+// A producer claims a contiguous region for a whole message with a single compare and swap on
+// reserved, fills it in at its own pace and then commits it. The consumer sees messages in the
+// order they were reserved and never sees part of one. Committing doesn't wait for earlier
+// reservations: a message that finishes ahead of one reserved before it is marked as done in
+// commits and whoever publishes the earlier one carries on and publishes it too.
+typedef struct {
+    QueueSpan spans[2]; // The second is where the region wraps around
+    queue_index_t start;
+    queue_index_t size;
+} QueueReservation;
+
+// BUSY if there isn't size bytes free, FAILURE if size is 0 or more than the capacity
+Status queue_reserve_shared(Queue* queue, size_t size, QueueReservation* reservation);
+
+// The whole reservation is committed, it can't be shrunk as there may be others after it
+Status queue_commit_shared(Queue* queue, const QueueReservation* reservation);
+
+// Bytes a producer could reserve right now, only a snapshot if anything else is active
+size_t queue_free_space(Queue* queue);
+
+// Consumer side of a shared queue, the same as dequeue but *message_end is set to 1 if the byte
+// was the last one of a message. The other consumer functions work too but only this one keeps
+// track of where messages end, so it has to be the only one used if that's wanted.
+Status dequeue_shared(Queue* queue, uint8_t* data, uint8_t* message_end);
+
+// Consumer side. The free running index of the next byte to be dequeued, so once a message has
+// been dequeued it's its reservation's start + size.
+static inline queue_index_t queue_consumed_index(Queue* queue) {
+    return atomic_load_explicit(&queue->front, memory_order_relaxed);
+}
+
 // Return 0 if not full, 1 if full and 2 if there's an error
 uint8_t is_queue_full(Queue* queue);
 
 // Return 0 if not empty, 1 if empty and 2 if there's an error
 uint8_t is_queue_empty(Queue* queue);
 
-#endif
\ No newline at end of file
+// Number of bytes currently in the queue. Safe to call from either side (or a third party) but
+// is only a snapshot if the other side is active.
+size_t queue_length(Queue* queue);
+
+#endif
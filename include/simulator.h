@@ -0,0 +1,106 @@
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "macros.h"
+#include "uart.h"
+
+/* simulator.h and simulator.c run channels against a virtual clock instead of the peripheral
+emulator's threads, so hours of traffic at a real baud rate take as long as the CPU needs rather than
+hours of wall clock time. It's a discrete event simulation on the calling thread:
+ - Everything that happens is an event at a time in simulated nanoseconds. Events wait in a binary
+ heap and run in time order, with ties run in the order they were scheduled
+ - A channel's character time comes from its baud rate and bits per character. Each byte takes the
+ line for one character time in its direction and the line sits idle between messages
+ - The far end sends messages of random length with random gaps between them, and can corrupt bytes
+ as they arrive (set_rx_error). With flow control on it holds off the same way the emulator does.
+ - The task side reads the receive queue at a fixed interval and writes random messages with
+ random gaps between them, neither of them blocking
+ - uart_isr runs isr_latency_ns after the channel's interrupt is asserted, through the vector table
+ the same as it would with the emulator. The RX timeout is raised after 4 idle character times.
+ - All of the randomness comes from one generator seeded from the config, so the same seed and
+ config give the same run every time. The digests in the results make two runs easy to compare.
+
+Channels can be routed to each other (or looped back) the same as a serial multiplexer would be,
+in which case the far end of one channel ends up talking to the far end of another through the
+driver.
+
+The channels in the config are initialised for the run and stopped again afterwards, so none of them
+can be in use and nothing else may touch their registers while it runs. The timing the driver keeps
+itself (the transmit latency stats and the receive idle callbacks) is still wall clock, so isn't part
+of the results.
+*/
+
+#define SIMULATOR_DEFAULT_BITS_PER_CHARACTER 10 // Start bit, 8 data bits and a stop bit
+#define SIMULATOR_DEFAULT_ISR_LATENCY_NS 2000
+#define SIMULATOR_READ_MAX 1024 // Most the task side takes out of the receive queue in one read
+
+typedef struct {
+    uint8_t channel;
+    const UartConfig* uart_config; // NULL for UART_DEFAULT_CONFIG
+    uint32_t baud_rate; // Has to be non zero
+    uint8_t bits_per_character; // Start, data, parity and stop bits, 0 for the default
+    uint32_t isr_latency_ns; // From the interrupt being asserted to uart_isr running, 0 for the default
+
+    // The far end. Message lengths are uniform between min and max (a max of 0 sends nothing) and
+    // so are the idle gaps between messages, from 0 to rx_gap_max_ns.
+    uint16_t rx_message_min;
+    uint16_t rx_message_max;
+    uint64_t rx_gap_max_ns;
+    uint32_t rx_error_ppm; // Chance of each byte arriving corrupted, in parts per million
+
+    // The task side. Reads of up to read_size bytes every read_interval_ns (0 for no reading) and
+    // messages written on the normal lane the same way as the far end's (a max of 0 writes nothing).
+    uint64_t read_interval_ns;
+    uint32_t read_size;
+    uint16_t tx_message_min;
+    uint16_t tx_message_max;
+    uint64_t tx_gap_max_ns;
+
+    // Sends everything received out of route_channel (see uart_route), which has to be in the
+    // config too. A routed channel can't be read so read_interval_ns has to be 0.
+    uint8_t route;
+    uint8_t route_channel;
+} SimulatorChannelConfig;
+
+typedef struct {
+    uint64_t seed;
+    uint64_t duration_ns; // Simulated
+    const SimulatorChannelConfig* channels;
+    size_t channel_count; // Up to UART_CHANNEL_COUNT, each channel at most once
+} SimulatorConfig;
+
+typedef struct {
+    uint64_t rx_bytes_offered; // Bytes the far end put on the line
+    uint64_t rx_overruns; // Lost because the RX FIFO was full
+    uint64_t rx_errors_injected;
+    uint64_t rx_flow_holds; // Character times the far end was held back by flow control
+    uint64_t rx_bytes_read; // Taken out of the receive queue by the task side
+    uint64_t rx_digest; // FNV-1a of everything read
+    uint64_t tx_bytes_written; // Queued by the task side
+    uint64_t tx_writes_refused; // Messages that didn't fit in the transmit queue when written
+    uint64_t tx_bytes_sent; // Bytes that went out on the line, not counting XON/XOFF
+    uint64_t tx_digest; // FNV-1a of everything sent
+    uint64_t routed_bytes; // Forwarded to route_channel
+    double rx_wire_utilisation; // Fraction of the run the line towards the channel was busy
+    double tx_wire_utilisation;
+    // From the channel's own stats at the end of the run
+    uint64_t rx_dropped;
+    uint64_t rx_errors;
+    uint64_t isr_count;
+    uint32_t rx_queue_max_depth;
+    uint32_t tx_queue_max_depth;
+} SimulatorChannelResult;
+
+typedef struct {
+    uint64_t simulated_ns;
+    uint64_t events;
+    uint64_t elapsed_ns; // Wall clock
+    SimulatorChannelResult channels[UART_CHANNEL_COUNT]; // In the same order as SimulatorConfig.channels
+} SimulatorResult;
+
+// FAILURE if the config is invalid or a channel can't be initialised
+Status simulator_run(const SimulatorConfig* config, SimulatorResult* result);
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "macros.h"
+
+/* trace.h and trace.c record everything that happens at the register level into a binary file and
+replay it back through uart_isr, so that a capture of a misbehaving unit can be turned into a
+regression test (or a benchmark).
+
+Recording is only compiled in with make TRACE=1 (which defines UART_TRACE), so a normal build has
+no hooks at all. In a trace build every register access in processor_interface.h/.c, every line
+side event (bytes arriving and leaving, RX timeouts and errors) and every uart_isr entry and exit
+becomes one event while recording is on. With recording off the hook is one relaxed load.
+
+ - Events go into a memory mapped file, so recording is an append into memory and the kernel
+ writes it out in the background. No system calls on the hot path.
+ - Each event is a byte of type and channel then LEB128 varints of the cycles since the previous
+ event and the value (shifted up to make room for a flag saying whether it came from inside
+ uart_isr), so most events are 3 or 4 bytes
+ - While recording, each access and its event happen under one spin lock so the order in the file
+ is the order things actually happened in, even with the peripheral emulator running on another
+ thread. This does slow recording down, it's meant for chasing bugs rather than for always on.
+ - The file starts with a snapshot of every channel's registers and FIFOs so a replay starts from
+ the same state. Recording should be started before the traffic of interest, anything already
+ part way through an access when it starts isn't captured.
+
+Replaying puts the line side events and the task side register writes back in order and calls
+uart_isr wherever the original one ran, putting the queue lengths back to what they were first.
+The channels are replayed without flow control or routes, so a trace of a channel using either
+will mismatch.
+Bytes the ISR is going to transmit come from the data register writes later in the trace. In
+TRACE_REPLAY_COMPARE mode every register access the ISR makes is checked against the recording,
+which needs a trace build. TRACE_REPLAY_BENCHMARK mode just runs it all as fast as it can.
+*/
+
+typedef enum {
+    // Register accesses, the value is what was read or written
+    TRACE_READ_STATUS_LOW,
+    TRACE_READ_STATUS_HIGH,
+    TRACE_READ_STATUS,
+    TRACE_READ_DATA,
+    TRACE_READ_STATUS_AND_DATA,
+    TRACE_WRITE_STATUS,
+    TRACE_WRITE_DATA,
+    TRACE_WRITE_FIFO_CONTROL, // Which byte in bit 8, the value written in bits 0-7
+    TRACE_SET_STATUS_BITS,
+    TRACE_CLEAR_STATUS_BITS,
+    TRACE_FIFO_DEPTH,
+    // The ISR, the value at entry is the receive queue length with the transmit queue length in
+    // bits 16-31
+    TRACE_ISR_ENTER,
+    TRACE_ISR_EXIT,
+    // The line side
+    TRACE_LINE_RECEIVE,
+    TRACE_LINE_TRANSMIT,
+    TRACE_RX_TIMEOUT,
+    TRACE_RX_ERROR,
+    TRACE_LINE_CTS,
+    TRACE_EVENT_TYPE_COUNT
+} TraceEventType;
+
+// Up to 32 types with 3 bits left for the channel
+_Static_assert(TRACE_EVENT_TYPE_COUNT <= 32 && UART_CHANNEL_COUNT <= 8, "Trace events don't fit their header byte");
+
+typedef struct {
+    uint64_t timestamp; // Cycles (see read_cycle_counter) since recording started
+    TraceEventType type;
+    uint8_t channel;
+    uint8_t in_isr; // Made by uart_isr rather than a task or the line
+    uint32_t value;
+} TraceEvent;
+
+// Recording. max_size is how big the file can get, once it's full the rest of the events are
+// dropped and counted. FAILURE if this isn't a trace build or the file can't be created.
+Status trace_start(const char* path, size_t max_size);
+
+// Stops recording and cuts the file down to what was used. Either count may be NULL.
+Status trace_stop(size_t* events_recorded, size_t* events_dropped);
+
+// Reading a trace back one event at a time
+typedef struct {
+    const uint8_t* mapping; // The whole file, starting with the snapshot
+    size_t mapping_size;
+    const uint8_t* data; // The events after the snapshot
+    size_t size;
+    size_t position;
+    uint64_t timestamp;
+    size_t events; // Read so far
+} TraceReader;
+
+Status trace_reader_open(TraceReader* reader, const char* path);
+
+// EMPTY at the end of the trace, FAILURE if it's been cut off part way through an event
+Status trace_reader_next(TraceReader* reader, TraceEvent* event);
+
+void trace_reader_close(TraceReader* reader);
+
+typedef enum {
+    TRACE_REPLAY_COMPARE,
+    TRACE_REPLAY_BENCHMARK
+} TraceReplayMode;
+
+typedef struct {
+    size_t events;
+    size_t isrs;
+    size_t mismatches; // Always 0 in benchmark mode
+    size_t first_mismatch; // Index of the first event that didn't match, SIZE_MAX if none did
+    uint64_t elapsed_ns;
+} TraceReplayResult;
+
+// Replays a trace through uart_isr. Every channel is initialised for the replay and stopped again
+// afterwards, so none can be in use when this is called. The queues get the default (or static)
+// sizes, which only matters if the trace had more waiting in one than that.
+// Channels serviced from different threads at the same time can't be put back in the same order by
+// a single threaded replay, so their ISRs will show up as mismatches.
+Status trace_replay(const char* path, TraceReplayMode mode, TraceReplayResult* result);
+
+// Hooks called by processor_interface and uart_isr. trace_begin returns 1 if the access about to
+// be made should be recorded (or checked) and if so it has to be followed by trace_end once it has
+// been made.
+extern _Atomic uint8_t trace_mode;
+uint8_t trace_lock(void);
+void trace_end(TraceEventType type, uint8_t channel, uint32_t value);
+
+static inline uint8_t trace_begin(void) {
+    if (atomic_load_explicit(&trace_mode, memory_order_relaxed) == 0) return 0;
+    return trace_lock();
+}
+
+#ifdef UART_TRACE
+#define TRACE_BEGIN() uint8_t trace_active = trace_begin()
+#define TRACE_END(type, channel, value) do { if (trace_active) trace_end((type), (channel), (value)); } while (0)
+#else
+#define TRACE_BEGIN() do { } while (0)
+#define TRACE_END(type, channel, value) do { } while (0)
+#endif
+// For when it turns out there's nothing worth recording after TRACE_BEGIN
+#define TRACE_CANCEL() TRACE_END(TRACE_EVENT_TYPE_COUNT, 0, 0)
+
+#endif
@@ -4,31 +4,296 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include "macros.h"
+#include "queue.h"
 
+// Each UART channel is accessed through a handle returned by initialise_uart. All of a channel's
+// state lives in its own cache line aligned block, so different channels can be serviced from
+// different threads (or ISRs) at the same time without sharing anything.
+typedef struct Uart* UartHandle;
+
+// Transmit priority lanes, each with its own queue. The ISR sends a whole message at a time from
+// the highest priority lane that has one waiting, so an urgent control message only ever waits for
+// the message already going out rather than everything queued ahead of it. So that a steady stream
+// of high priority messages can't hold the normal lane up forever, once UART_TX_STARVATION_BYTES
+// have gone out from higher lanes while a lane had a message waiting, that lane's message goes next.
+typedef enum {
+    UART_PRIORITY_NORMAL,
+    UART_PRIORITY_HIGH,
+    UART_PRIORITY_COUNT
+} UartPriority;
+
+// Flow control, so that the far end is told to stop sending once the receive queue gets to its high
+// watermark and to carry on once the reader has taken it back down to the low watermark, rather
+// than bytes being dropped when the queue fills.
+//  - UART_FLOW_RTS_CTS drives the RTS line from the ISR and the reader, and turns on auto CTS so
+//  the transmitter holds off by itself while the far end has CTS clear.
+//  - UART_FLOW_XON_XOFF sends XOFF/XON ahead of anything queued to transmit, and stops the TX
+//  interrupt taking anything more from the transmit lanes between an XOFF and an XON from the far
+//  end. XON and XOFF received are taken out of the data, so this is only for text (or otherwise
+//  escaped) data.
+// The far end doesn't stop straight away, bytes already in the FIFOs (and for XON/XOFF anything
+// ahead of the XOFF in the TX FIFO) still arrive, so the high watermark needs to leave room for
+// them.
+typedef enum {
+    UART_FLOW_NONE,
+    UART_FLOW_RTS_CTS,
+    UART_FLOW_XON_XOFF
+} UartFlowControl;
+
+// Per channel configuration, queue sizes must be powers of two (and are ignored in the static
+// queue build, see UART_STATIC_QUEUE_CAPACITIES). transmit_queue_size is the normal lane and
+// priority_queue_size the high priority one. The RX trigger level and TX empty
+// threshold set how full/empty the hardware FIFOs get before they interrupt, higher trigger levels
+// mean fewer interrupts. The flow control watermarks are in bytes of the receive queue, 0 picks
+// three quarters and a quarter of it. receive_burst_size lets the receive queue borrow up to that
+// many more bytes from the shared segment pool while a burst would otherwise overflow it (see
+// queue_set_elastic), it has to be a multiple of QUEUE_SEGMENT_SIZE and 0 turns it off. This applies
+// to the static queue build too, so busy channels can get by with a small receive queue of their own.
+typedef struct {
+    uint16_t receive_queue_size;
+    uint16_t receive_burst_size;
+    uint16_t transmit_queue_size;
+    uint16_t priority_queue_size;
+    uint8_t rx_trigger_level;
+    uint8_t tx_empty_threshold;
+    UartFlowControl flow_control;
+    uint16_t flow_high_watermark;
+    uint16_t flow_low_watermark;
+} UartConfig;
+
+#define UART_DEFAULT_CONFIG { .receive_queue_size = QUEUE_SIZE, .transmit_queue_size = QUEUE_SIZE, \
+    .priority_queue_size = PRIORITY_QUEUE_SIZE, .rx_trigger_level = UART_DEFAULT_RX_TRIGGER_LEVEL, \
+    .tx_empty_threshold = UART_DEFAULT_TX_EMPTY_THRESHOLD }
+
+// Snapshot of a channel's counters, see uart_get_stats
+#define UART_ISR_HISTOGRAM_BUCKETS 24
+typedef struct {
+    uint64_t rx_bytes; // Bytes put into the receive queue
+    uint64_t tx_bytes; // Bytes written to the TX FIFO
+    uint64_t rx_dropped; // Bytes received while the receive queue was full
+    uint64_t rx_errors; // RX error bits seen
+    uint64_t rx_flow_stops; // Times the far end was told to stop sending
+    uint64_t tx_flow_stops; // XOFFs from the far end that paused transmitting
+    uint64_t isr_count; // ISR invocations
+    uint64_t isr_spurious; // ISR invocations that found nothing to do, i.e. wasted
+    uint32_t rx_queue_high_watermark; // Most bytes ever waiting in the receive queue
+    uint32_t tx_queue_high_watermark; // Most bytes ever waiting in the transmit lanes put together
+    // Bucket n counts ISRs that took [2^(n-1), 2^n) cycles (bucket 0 is 0 cycles), the last
+    // bucket also counts anything longer
+    uint64_t isr_cycles_histogram[UART_ISR_HISTOGRAM_BUCKETS];
+    // Per transmit lane, indexed by UartPriority. Latency is from a message being committed to its
+    // last byte going into the TX FIFO. It's measured on one message per lane at a time, so with a
+    // lot of writers only some of the messages are timed.
+    uint64_t tx_messages[UART_PRIORITY_COUNT];
+    uint64_t tx_latency_samples[UART_PRIORITY_COUNT];
+    uint64_t tx_latency_average_ns[UART_PRIORITY_COUNT];
+    uint64_t tx_latency_max_ns[UART_PRIORITY_COUNT]; // Like the watermarks this is only zeroed by a reset
+} UartStats;
+
+// One buffer of a scatter/gather read or write
+typedef QueueSpan UartBuffer;
+
+// Why a notification callback was called, see uart_set_receive_callback/uart_set_transmit_callback
+typedef enum {
+    UART_EVENT_RX_WATERMARK,
+    UART_EVENT_RX_IDLE,
+    UART_EVENT_TX_SPACE
+} UartEvent;
+
+typedef void (*UartCallback)(UartHandle uart, UartEvent event, void* context);
+
+// Services the given channel's interrupt, emptying the RX FIFO and filling the TX FIFO
+void uart_isr(UartHandle uart);
+
+// One ISR entry per channel, these are what would go in the vector table.
 // If this was running on a true processor would use:
-// void __attribute__((interrupt)) uart_isr(void);
-void uart_isr(void);
+// void __attribute__((interrupt)) uart0_isr(void);
+void uart0_isr(void);
+void uart1_isr(void);
+void uart2_isr(void);
+void uart3_isr(void);
+void uart4_isr(void);
+void uart5_isr(void);
+void uart6_isr(void);
+void uart7_isr(void);
+
+// config may be NULL to use UART_DEFAULT_CONFIG. FAILURE if the flow control watermarks don't fit
+// in the receive queue (the low one has to be below the high one) or the burst size isn't a whole
+// number of segments.
+Status initialise_uart(uint8_t channel, const UartConfig* config, UartHandle* handle);
+
+// Waits for an ISR call that's already running on another thread to finish before freeing the
+// queues, and the ISR does nothing for the channel once it's been stopped
+void stop_uart(UartHandle uart);
+
+// Any number of tasks may write to a channel at once. Each write is queued as one message on the
+// priority's lane that other writers' bytes can't get into the middle of, messages in a lane go
+// out in the order their space was reserved. A write longer than the lane's queue goes in queue
+// sized pieces, which can have other messages in between. Only one task may be reading a given
+// channel at any time. The ISR is the other side of all the queues.
+Status uart_write_bytes_to_transmit_queue(UartHandle uart, UartPriority priority, uint8_t* data, size_t size);
+
+// The blocking calls sleep while the queue is full/empty and are woken by the ISR once there is
+// enough space/data for the rest of the call, rather than spinning.
+Status uart_read_bytes_from_receive_queue_blocking(UartHandle uart, uint8_t* data, size_t size);
+
+// Same as the blocking calls but give up after timeout_ms, returning BUSY. The number of bytes
+// that did make it is written to bytes_written/bytes_read either way. Writes only go in whole
+// messages (or pieces), so it's 0 unless the write was longer than the transmit queue.
+Status uart_write_bytes_to_transmit_queue_timeout(UartHandle uart, UartPriority priority, uint8_t* data, size_t size,
+    uint32_t timeout_ms, size_t* bytes_written);
+
+Status uart_read_bytes_from_receive_queue_timeout(UartHandle uart, uint8_t* data, size_t size, uint32_t timeout_ms, size_t* bytes_read);
+
+Status uart_read_bytes_from_receive_queue_nonblocking(UartHandle uart, uint8_t* data, size_t size, size_t* bytes_read);
+
+// Scatter/gather versions of the above. uart_writev blocks until every buffer has been queued, in
+// order, as a single message. uart_readv is nonblocking, filling each buffer in turn until the
+// receive queue runs dry.
+Status uart_writev(UartHandle uart, UartPriority priority, const UartBuffer* buffers, size_t buffer_count);
+
+Status uart_readv(UartHandle uart, const UartBuffer* buffers, size_t buffer_count, size_t* bytes_read);
+
+// Zero copy access to the queues. Formatters can reserve space in the transmit queue, build the
+// message in place and commit it. Parsers can peek at the received bytes where they sit and consume
+// them once they're done. Both spans must be looked at, the second one is where the data wraps.
+// While a receive burst is using borrowed segments there can be more after the two spans, which
+// the next peek shows once these have been consumed.
+// A reservation is for exactly size bytes (BUSY if there isn't room right now) and all of it has to
+// be committed, as other writers may already have reserved the space after it.
+typedef struct {
+    QueueReservation space;
+    UartPriority priority;
+} UartReservation;
+
+Status uart_transmit_reserve(UartHandle uart, UartPriority priority, size_t size, UartReservation* reservation);
+
+Status uart_transmit_commit(UartHandle uart, const UartReservation* reservation);
+
+Status uart_receive_peek(UartHandle uart, UartBuffer* first, UartBuffer* second);
+
+Status uart_receive_consume(UartHandle uart, size_t size);
+
+// Line reads. Take everything up to and including the delimiter once it has arrived, or max bytes
+// (capped at the receive queue size, or the high watermark with flow control) if that many arrive
+// without one, in which case the line carries on in the next read. The receive queue is searched
+// where it sits and nothing is copied until a whole line is there. Where the search got to is
+// remembered, so calling again as more bytes arrive only looks at the new ones.
+// The nonblocking version returns EMPTY and the timeout version BUSY if there's no line yet, with
+// *length 0 and anything already received left in the queue. max can be smaller than the last
+// call's, but not 0 (FAILURE).
+Status uart_read_until(UartHandle uart, uint8_t delimiter, uint8_t* data, size_t max, size_t* length);
+
+Status uart_read_until_nonblocking(UartHandle uart, uint8_t delimiter, uint8_t* data, size_t max, size_t* length);
+
+Status uart_read_until_timeout(UartHandle uart, uint8_t delimiter, uint8_t* data, size_t max, uint32_t timeout_ms, size_t* length);
+
+// Routing, for serial multiplexers. uart_route sends everything source receives out of
+// destination, or loops a channel back to itself if they're the same. There's no task or copy in
+// between: destination's ISR writes the bytes into its TX FIFO from source's receive queue where they
+// sit (borrowed segments and all) and consumes them once they're sent. They go out between
+// destination's own messages, whenever its transmit lanes have nothing waiting, and anything
+// already in source's receive queue goes first.
+// Backpressure is the receive queue itself. While destination can't keep up (or its far end has it
+// paused) the bytes wait in source's receive queue, so source's flow control tells its far end to
+// stop at the high watermark, or without flow control source drops them once the queue is full.
+// While routed source's receive queue belongs to the route and mustn't be read. A channel can be
+// the source of one route and the destination of one. BUSY if either end is already taken,
+// FAILURE if either isn't initialised. Routes are set up and taken down from one task at a time,
+// stop_uart takes down any the channel is part of.
+Status uart_route(UartHandle source, UartHandle destination);
+
+// Once this returns destination's ISR is done with source's receive queue, and whatever is left in
+// it can be read again. EMPTY if source isn't routed.
+Status uart_unroute(UartHandle source);
+
+typedef struct {
+    uint64_t bytes; // Forwarded since the route was set up
+    uint64_t source_dropped; // Received by source with its receive queue full since then
+    uint64_t source_flow_stops; // Times source's far end was told to stop since then
+    uint32_t queued; // Waiting in source's receive queue to be forwarded
+} UartRouteStats;
+
+// EMPTY if source isn't routed
+Status uart_get_route_stats(UartHandle source, UartRouteStats* stats);
+
+// Readiness, so one thread can service every channel (along with sockets or anything else with a
+// file descriptor) rather than having a thread per port or polling the queue lengths. Channels go
+// into a poll set with the events wanted from each and uart_poll reports whichever are ready. A
+// set's eventfd (uart_poll_fd) can go into the caller's own poll/epoll loop, it becomes readable
+// when something in the set may have become ready, after which uart_poll with a 0 timeout says what.
+// The reporting is level triggered, every call reports everything ready at the time. The ISR only
+// signals on edges though: a channel is armed when uart_poll finds it not ready, and the ISR writes
+// the eventfd once when it makes an armed channel ready, so an idle or already reported channel
+// costs the ISR a fence and a load. Nothing spins, waiting is poll() on the eventfd.
+// As with the reading side of a channel, a set is only polled and changed from one task at a time.
+typedef struct UartPollSet UartPollSet;
+
+#define UART_POLL_READABLE 0x1 // Something in the receive queue
+#define UART_POLL_WRITABLE 0x2 // At least the write space given to uart_poll_add free in the normal transmit lane
+
+typedef struct {
+    UartHandle uart;
+    uint8_t events;
+} UartPollEvent;
+
+// There are as many sets as channels, BUSY if they're all in use
+Status uart_poll_create(UartPollSet** set);
+
+// Takes every channel out of the set first
+void uart_poll_destroy(UartPollSet* set);
+
+// Adds the channel, or changes the events wanted if it's already in the set. write_space is how much
+// has to be free for UART_POLL_WRITABLE, 0 for any. A channel can be in one set at a time, BUSY if
+// it's in another. stop_uart takes the channel out of its set.
+Status uart_poll_add(UartPollSet* set, UartHandle uart, uint8_t events, size_t write_space);
+
+// EMPTY if the channel isn't in the set
+Status uart_poll_remove(UartPollSet* set, UartHandle uart);
+
+// The set's eventfd, for waiting on with POLLIN/EPOLLIN. Only uart_poll reads it.
+int uart_poll_fd(const UartPollSet* set);
 
-Status initialise_uart(void);
+// Waits up to timeout_ms (0 to just look, negative for no limit) for channels in the set to be
+// ready, filling in up to max_events of them and *count. BUSY if none were by the timeout. With
+// more channels ready than max_events, the next call carries on from the channel after the last
+// one reported, so every ready channel gets its turn.
+Status uart_poll(UartPollSet* set, int32_t timeout_ms, UartPollEvent* events, size_t max_events, size_t* count);
 
-void stop_uart(void);
+// For trace_replay. Takes bytes off the front of the receive queue until there are receive_length
+// left and queues transmit_data without touching the TX interrupt enable, since in a trace the
+// writer's own register accesses are already events of their own.
+Status uart_replay_queues(UartHandle uart, size_t receive_length, const uint8_t* transmit_data, size_t transmit_size);
 
-Status uart_write_bytes_to_transmit_queue(uint8_t* data, size_t size);
+size_t uart_receive_queue_length(UartHandle uart);
 
-Status uart_read_bytes_from_receive_queue_blocking(uint8_t* data, size_t size);
+size_t uart_transmit_queue_length(UartHandle uart);
 
-Status uart_read_bytes_from_receive_queue_nonblocking(uint8_t* data, size_t size, size_t* bytes_read);
+uint32_t uart_total_bytes_received(UartHandle uart);
 
-size_t uart_receive_queue_length(void);
+// Notification callbacks, so a consumer can be told about data (or space) rather than polling for
+// it. They aren't called from uart_isr, the ISR just flags the channel and a notification worker
+// thread (shared by every channel, started by the first registration) makes the calls. Callbacks
+// can read and write their channel but must not stop it. Passing a NULL callback turns it off.
+// The receive callback is called once the receive queue fills up to watermark bytes
+// (UART_EVENT_RX_WATERMARK), and once the line has been quiet for idle_timeout_us with bytes that
+// arrived since the last callback (UART_EVENT_RX_IDLE), so a burst of bytes gives one or two
+// callbacks rather than one per byte. Either condition can be 0 to leave it out.
+Status uart_set_receive_callback(UartHandle uart, size_t watermark, uint32_t idle_timeout_us, UartCallback callback, void* context);
 
-size_t uart_transmit_queue_length(void);
+// Called (UART_EVENT_TX_SPACE) when the ISR takes the free space in the normal transmit lane from
+// below space_watermark to at least space_watermark
+Status uart_set_transmit_callback(UartHandle uart, size_t space_watermark, UartCallback callback, void* context);
 
-uint32_t uart_total_bytes_received(void);
+// Takes a snapshot of the channel's counters without stopping it, the ISR never takes a lock for
+// them. If reset is set the counters (and watermarks) are zeroed as of the snapshot, so the next
+// call reports what happened since this one. Resetting should only be done from one context.
+Status uart_get_stats(UartHandle uart, UartStats* stats, uint8_t reset);
 
-Status uart_receive_error(void);
+Status uart_receive_error(UartHandle uart);
 
-Status uart_transmit_error(void);
+Status uart_transmit_error(UartHandle uart);
 
-void display_uart_status(void);
+void display_uart_status(UartHandle uart);
 
-#endif
\ No newline at end of file
+#endif
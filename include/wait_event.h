@@ -0,0 +1,51 @@
+#ifndef WAIT_EVENT_H
+#define WAIT_EVENT_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "macros.h"
+
+/* A wait/notify primitive that is safe to signal from the ISR. It's a futex on a sequence number
+plus a count of waiters, so signalling when nobody is waiting is just a fence and a load, and
+nothing the signalling side does ever blocks. The equivalent on FreeRTOS would be a task
+notification given with vTaskNotifyGiveFromISR.
+
+Waiting goes:
+    uint32_t sequence = wait_event_prepare(&event);
+    if (!condition) status = wait_event_wait(&event, sequence, deadline);
+    wait_event_finish(&event);
+and signalling goes:
+    make condition true
+    if (wait_event_has_waiters(&event)) wait_event_signal(&event);
+Checking the condition after prepare means a signal can't be missed in between.
+*/
+
+typedef struct {
+    _Atomic uint32_t sequence;
+    _Atomic uint32_t waiters;
+} WaitEvent;
+
+void wait_event_init(WaitEvent* event);
+
+// Registers the caller as a waiter and returns the sequence number to wait on
+uint32_t wait_event_prepare(WaitEvent* event);
+
+// Sleeps until signalled or the deadline (CLOCK_MONOTONIC, NULL for no deadline) passes. Returns
+// SUCCESS when woken, which may be spurious so the condition must be checked again, or BUSY if the
+// deadline passed.
+Status wait_event_wait(WaitEvent* event, uint32_t sequence, const struct timespec* deadline);
+
+// Unregisters the caller as a waiter
+void wait_event_finish(WaitEvent* event);
+
+// 1 if anything is (or is about to be) waiting. Orders the caller's earlier writes before the check.
+uint8_t wait_event_has_waiters(WaitEvent* event);
+
+// Wakes everything waiting on the event
+void wait_event_signal(WaitEvent* event);
+
+// Works out the deadline timeout_ms from now
+void wait_event_deadline(uint32_t timeout_ms, struct timespec* deadline);
+
+#endif
@@ -0,0 +1,206 @@
+#define _POSIX_C_SOURCE 200809L
+#include "crc.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC_HARDWARE_NAME "sse4.2"
+#elif defined(__aarch64__) && defined(__GNUC__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#pragma GCC push_options
+#pragma GCC target("+crc")
+#include <arm_acle.h>
+#pragma GCC pop_options
+#define CRC_HARDWARE_NAME "armv8"
+#endif
+
+typedef uint32_t (*CrcUpdateFunction)(CrcType type, uint32_t crc, const uint8_t* data, size_t size);
+
+typedef struct {
+    uint32_t polynomial; // Reflected
+    uint32_t initial;
+    uint32_t final_xor;
+    uint8_t size;
+} CrcParameters;
+
+static const CrcParameters parameters[CRC_TYPE_COUNT] = {
+    [CRC_NONE] = { 0, 0, 0, 0 },
+    [CRC_16] = { 0x8408, 0xFFFF, 0xFFFF, 2 },
+    [CRC_32] = { 0xEDB88320, 0xFFFFFFFF, 0xFFFFFFFF, 4 },
+    [CRC_32C] = { 0x82F63B78, 0xFFFFFFFF, 0xFFFFFFFF, 4 },
+};
+
+// tables[type][n][byte] is the effect of byte when it's n bytes further back than the last one in
+// an 8 byte step. Filled in once by crc_setup.
+static uint32_t tables[CRC_TYPE_COUNT][8][256];
+static uint32_t residues[CRC_TYPE_COUNT];
+static _Atomic CrcUpdateFunction update_functions[CRC_TYPE_COUNT];
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+
+static inline uint32_t load_32bit_le(const uint8_t* data) {
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static uint32_t update_none(CrcType type, uint32_t crc, const uint8_t* data, size_t size) {
+    (void)type;
+    (void)data;
+    (void)size;
+    return crc;
+}
+
+static uint32_t update_slice_by_8(CrcType type, uint32_t crc, const uint8_t* data, size_t size) {
+    uint32_t (*table)[256] = tables[type];
+    while (size >= 8) {
+        uint32_t low = crc ^ load_32bit_le(data);
+        uint32_t high = load_32bit_le(data + 4);
+        crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^ table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24]
+            ^ table[3][high & 0xFF] ^ table[2][(high >> 8) & 0xFF] ^ table[1][(high >> 16) & 0xFF] ^ table[0][high >> 24];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- != 0) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t update_crc32c_hardware(CrcType type, uint32_t crc, const uint8_t* data, size_t size) {
+    (void)type;
+    uint64_t wide = crc;
+    while (size >= 8) {
+        uint64_t value = (uint64_t)load_32bit_le(data) | ((uint64_t)load_32bit_le(data + 4) << 32);
+        wide = _mm_crc32_u64(wide, value);
+        data += 8;
+        size -= 8;
+    }
+    crc = (uint32_t)wide;
+    while (size-- != 0) crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+
+static uint8_t has_crc32c_hardware(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2") != 0;
+}
+#elif defined(__aarch64__) && defined(__GNUC__)
+__attribute__((target("+crc")))
+static uint32_t update_crc32c_hardware(CrcType type, uint32_t crc, const uint8_t* data, size_t size) {
+    (void)type;
+    while (size >= 8) {
+        uint64_t value = (uint64_t)load_32bit_le(data) | ((uint64_t)load_32bit_le(data + 4) << 32);
+        crc = __crc32cd(crc, value);
+        data += 8;
+        size -= 8;
+    }
+    while (size-- != 0) crc = __crc32cb(crc, *data++);
+    return crc;
+}
+
+static uint8_t has_crc32c_hardware(void) {
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+// Builds the slice-by-8 tables, picks each type's implementation and works out the residues
+static void crc_setup(void) {
+    for (int type = CRC_16; type < CRC_TYPE_COUNT; type++) {
+        uint32_t polynomial = parameters[type].polynomial;
+        for (uint32_t byte = 0; byte < 256; byte++) {
+            uint32_t crc = byte;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (polynomial & (0U - (crc & 1)));
+            }
+            tables[type][0][byte] = crc;
+        }
+        for (int slice = 1; slice < 8; slice++) {
+            for (uint32_t byte = 0; byte < 256; byte++) {
+                uint32_t previous = tables[type][slice - 1][byte];
+                tables[type][slice][byte] = (previous >> 8) ^ tables[type][0][previous & 0xFF];
+            }
+        }
+        atomic_store(&update_functions[type], update_slice_by_8);
+    }
+    atomic_store(&update_functions[CRC_NONE], update_none);
+#ifdef CRC_HARDWARE_NAME
+    if (has_crc32c_hardware()) atomic_store(&update_functions[CRC_32C], update_crc32c_hardware);
+#endif
+
+    // The residue is the same for every message, so the empty one will do
+    for (int type = CRC_16; type < CRC_TYPE_COUNT; type++) {
+        Crc crc;
+        crc.type = (CrcType)type;
+        crc.value = parameters[type].initial;
+        uint8_t bytes[CRC_MAX_SIZE];
+        size_t size = crc_write(&crc, bytes);
+        crc.value = update_slice_by_8(crc.type, crc.value, bytes, size);
+        residues[type] = crc.value;
+    }
+}
+
+void crc_init(Crc* crc, CrcType type) {
+    if (crc == NULL) return;
+    pthread_once(&setup_once, crc_setup);
+    if ((unsigned)type >= CRC_TYPE_COUNT) type = CRC_NONE;
+    crc->type = type;
+    crc->value = parameters[type].initial;
+}
+
+void crc_update(Crc* crc, const uint8_t* data, size_t size) {
+    if (crc == NULL || data == NULL || size == 0) return;
+    CrcUpdateFunction update = atomic_load_explicit(&update_functions[crc->type], memory_order_relaxed);
+    crc->value = update(crc->type, crc->value, data, size);
+}
+
+uint32_t crc_value(const Crc* crc) {
+    if (crc == NULL) return 0;
+    return crc->value ^ parameters[crc->type].final_xor;
+}
+
+uint8_t crc_check(const Crc* crc) {
+    if (crc == NULL) return 0;
+    return crc->type == CRC_NONE || crc->value == residues[crc->type];
+}
+
+size_t crc_write(const Crc* crc, uint8_t* bytes) {
+    if (crc == NULL || bytes == NULL) return 0;
+    uint32_t value = crc_value(crc);
+    size_t size = parameters[crc->type].size;
+    for (size_t i = 0; i < size; i++) {
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    }
+    return size;
+}
+
+size_t crc_size(CrcType type) {
+    if ((unsigned)type >= CRC_TYPE_COUNT) return 0;
+    return parameters[type].size;
+}
+
+Status crc_select_implementation(CrcType type, uint8_t hardware) {
+    if (type == CRC_NONE || (unsigned)type >= CRC_TYPE_COUNT) return FAILURE;
+    pthread_once(&setup_once, crc_setup);
+    if (!hardware) {
+        atomic_store(&update_functions[type], update_slice_by_8);
+        return SUCCESS;
+    }
+#ifdef CRC_HARDWARE_NAME
+    if (type == CRC_32C && has_crc32c_hardware()) {
+        atomic_store(&update_functions[type], update_crc32c_hardware);
+        return SUCCESS;
+    }
+#endif
+    return FAILURE;
+}
+
+const char* crc_implementation_name(CrcType type) {
+    if (type == CRC_NONE || (unsigned)type >= CRC_TYPE_COUNT) return "none";
+    pthread_once(&setup_once, crc_setup);
+#ifdef CRC_HARDWARE_NAME
+    if (atomic_load(&update_functions[type]) == update_crc32c_hardware) return CRC_HARDWARE_NAME;
+#endif
+    return "slice-by-8";
+}
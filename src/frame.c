@@ -0,0 +1,308 @@
+#include "frame.h"
+#include <string.h>
+
+#define POOL_EMPTY UINT32_MAX
+#define COBS_MAX_BLOCK 254 // Data bytes in a full block, which has code 0xFF
+
+static inline uint64_t pool_head(uint64_t tag, uint32_t index) {
+    return (tag << 32) | index;
+}
+
+void frame_pool_init(FramePool* pool) {
+    if (pool == NULL) return;
+    for (uint32_t i = 0; i < FRAME_POOL_BLOCKS; i++) {
+        atomic_init(&pool->blocks[i].next, i + 1 < FRAME_POOL_BLOCKS ? i + 1 : POOL_EMPTY);
+        pool->blocks[i].length = 0;
+    }
+    atomic_init(&pool->head, pool_head(0, FRAME_POOL_BLOCKS > 0 ? 0 : POOL_EMPTY));
+}
+
+Frame* frame_pool_acquire(FramePool* pool) {
+    if (pool == NULL) return NULL;
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_acquire);
+    uint64_t new_head;
+    do {
+        uint32_t index = (uint32_t)head;
+        if (index == POOL_EMPTY) return NULL;
+        // If another context takes this block first then next may be stale, but then the tag has
+        // moved on and the compare and swap fails
+        uint32_t next = atomic_load_explicit(&pool->blocks[index].next, memory_order_relaxed);
+        new_head = pool_head((head >> 32) + 1, next);
+    } while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, new_head, memory_order_acquire, memory_order_acquire));
+    Frame* frame = &pool->blocks[(uint32_t)head];
+    frame->length = 0;
+    return frame;
+}
+
+void frame_release(FramePool* pool, Frame* frame) {
+    if (pool == NULL || frame == NULL) return;
+    if (frame < pool->blocks || frame >= pool->blocks + FRAME_POOL_BLOCKS) return; // Not one of ours
+    uint32_t index = (uint32_t)(frame - pool->blocks);
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+    uint64_t new_head;
+    do {
+        atomic_store_explicit(&frame->next, (uint32_t)head, memory_order_relaxed);
+        new_head = pool_head((head >> 32) + 1, index);
+    } while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, new_head, memory_order_release, memory_order_relaxed));
+}
+
+size_t frame_pool_available(FramePool* pool) {
+    if (pool == NULL) return 0;
+    size_t count = 0;
+    uint32_t index = (uint32_t)atomic_load_explicit(&pool->head, memory_order_acquire);
+    while (index != POOL_EMPTY && count < FRAME_POOL_BLOCKS) {
+        count++;
+        index = atomic_load_explicit(&pool->blocks[index].next, memory_order_relaxed);
+    }
+    return count;
+}
+
+void frame_receiver_init(FrameReceiver* receiver, UartHandle uart, FramePool* pool) {
+    if (receiver == NULL) return;
+    memset(receiver, 0, sizeof(*receiver));
+    receiver->uart = uart;
+    receiver->pool = pool;
+    receiver->crc_type = CRC_NONE;
+}
+
+void frame_receiver_set_crc(FrameReceiver* receiver, CrcType crc_type) {
+    if (receiver == NULL) return;
+    receiver->crc_type = crc_type;
+}
+
+// Gives up on the frame being decoded, the rest of it up to the delimiter is skipped
+static void drop_frame(FrameReceiver* receiver) {
+    frame_release(receiver->pool, receiver->current);
+    receiver->current = NULL;
+    receiver->discarding = 1;
+    receiver->frames_dropped++;
+}
+
+// Decodes bytes that are known not to contain a delimiter. Block data is copied with one memcpy
+// per block (or per span if the block wraps), only the code bytes are looked at individually.
+static void decode_segment(FrameReceiver* receiver, const uint8_t* data, size_t size) {
+    size_t index = 0;
+    while (index < size && !receiver->discarding) {
+        Frame* frame = receiver->current;
+        if (receiver->remaining == 0) {
+            // A code byte. The block before it ended with a 0, unless it was a full block or
+            // this is the first one
+            if (receiver->code != 0 && receiver->code != 0xFF) {
+                if (frame->length == FRAME_MAX_SIZE) {
+                    drop_frame(receiver);
+                    break;
+                }
+                frame->data[frame->length++] = 0;
+                crc_update(&receiver->crc, &frame->data[frame->length - 1], 1);
+            }
+            receiver->code = data[index];
+            receiver->remaining = data[index] - 1;
+            index++;
+        } else {
+            size_t chunk = size - index < receiver->remaining ? size - index : receiver->remaining;
+            if (frame->length + chunk > FRAME_MAX_SIZE) {
+                drop_frame(receiver);
+                break;
+            }
+            memcpy(&frame->data[frame->length], &data[index], chunk);
+            // Checked straight after the copy while the bytes are still in cache
+            crc_update(&receiver->crc, &frame->data[frame->length], chunk);
+            frame->length += (uint16_t)chunk;
+            receiver->remaining -= (uint8_t)chunk;
+            index += chunk;
+        }
+    }
+}
+
+// A delimiter has arrived. Returns the finished frame, or NULL if there wasn't a good one.
+static Frame* end_frame(FrameReceiver* receiver) {
+    Frame* frame = receiver->current;
+    uint8_t complete = !receiver->discarding && receiver->code != 0 && receiver->remaining == 0;
+    if (!receiver->discarding && receiver->code != 0 && receiver->remaining != 0) {
+        // Cut short, the last block said there was more to come
+        receiver->frames_dropped++;
+    }
+    receiver->current = NULL;
+    receiver->code = 0;
+    receiver->remaining = 0;
+    receiver->discarding = 0;
+    if (complete && receiver->crc_type != CRC_NONE) {
+        // The CRC went through with the data so it's just a residue check, then it's stripped off
+        if (frame->length < crc_size(receiver->crc_type) || !crc_check(&receiver->crc)) {
+            receiver->crc_errors++;
+            complete = 0;
+        } else {
+            frame->length -= (uint16_t)crc_size(receiver->crc_type);
+        }
+    }
+    if (complete) {
+        receiver->frames_received++;
+        return frame;
+    }
+    // Back to back delimiters (an empty frame) end up here too
+    frame_release(receiver->pool, frame);
+    return NULL;
+}
+
+Status frame_receive(FrameReceiver* receiver, Frame** frame) {
+    if (frame != NULL) *frame = NULL;
+    if (receiver == NULL || frame == NULL) return FAILURE;
+    // A burst in the receive queue's borrowed segments can't all be peeked at once, so it goes round
+    // again for as long as it gets through everything it was shown without finishing a frame
+    Status result = EMPTY;
+    size_t shown;
+    size_t consumed;
+    do {
+        UartBuffer spans[2];
+        Status status = uart_receive_peek(receiver->uart, &spans[0], &spans[1]);
+        if (status != SUCCESS) return status;
+
+        // Work through what's there one delimiter to the next, consuming it all in one go at the end
+        shown = spans[0].size + spans[1].size;
+        consumed = 0;
+        for (int i = 0; i < 2 && result == EMPTY; i++) {
+            const uint8_t* data = spans[i].data;
+            size_t size = spans[i].size;
+            while (size != 0) {
+                const uint8_t* delimiter = (const uint8_t*)memchr(data, FRAME_DELIMITER, size);
+                size_t segment = delimiter != NULL ? (size_t)(delimiter - data) : size;
+                if (segment != 0 && receiver->current == NULL && !receiver->discarding) {
+                    receiver->current = frame_pool_acquire(receiver->pool);
+                    if (receiver->current == NULL) {
+                        result = BUSY;
+                        break;
+                    }
+                    crc_init(&receiver->crc, receiver->crc_type);
+                }
+                decode_segment(receiver, data, segment);
+                data += segment;
+                size -= segment;
+                consumed += segment;
+                if (delimiter == NULL) continue;
+
+                data++;
+                size--;
+                consumed++;
+                *frame = end_frame(receiver);
+                if (*frame != NULL) {
+                    result = SUCCESS;
+                    break;
+                }
+            }
+        }
+        if (consumed != 0) uart_receive_consume(receiver->uart, consumed);
+    } while (result == EMPTY && consumed == shown);
+    return result;
+}
+
+// Writes into the reserved region as if it were one buffer, splitting at the wrap around. With no
+// spans nothing is written, that's the encoder just working out the size.
+static void write_spans(const UartBuffer* spans, size_t offset, const uint8_t* data, size_t size) {
+    if (spans == NULL) return;
+    if (offset < spans[0].size) {
+        size_t first = spans[0].size - offset < size ? spans[0].size - offset : size;
+        memcpy(&spans[0].data[offset], data, first);
+        data += first;
+        size -= first;
+        offset = spans[0].size;
+    }
+    if (size != 0) memcpy(&spans[1].data[offset - spans[0].size], data, size);
+}
+
+static void write_span_byte(const UartBuffer* spans, size_t offset, uint8_t value) {
+    write_spans(spans, offset, &value, 1);
+}
+
+// COBS encoder writing into reserved transmit queue space, fed a piece at a time so that the CRC
+// can go through it after the data
+typedef struct {
+    const UartBuffer* spans; // NULL to only count the encoded size
+    size_t out; // Bytes written so far
+    size_t code_position; // Where the open block's code byte goes
+    size_t run; // Data bytes in the open block
+    uint8_t block_open;
+} CobsEncoder;
+
+static void open_block(CobsEncoder* encoder) {
+    encoder->code_position = encoder->out++;
+    encoder->run = 0;
+    encoder->block_open = 1;
+}
+
+static void close_block(CobsEncoder* encoder) {
+    write_span_byte(encoder->spans, encoder->code_position, (uint8_t)(encoder->run + 1));
+    encoder->block_open = 0;
+}
+
+// Each block is a code byte followed by the run of non zero bytes up to the next 0 (which the code
+// stands in for) or COBS_MAX_BLOCK bytes, whichever comes first. Runs are found with memchr and
+// copied in one go, the code byte is filled in once the run's length is known. crc (if not NULL) is
+// run over each piece as it goes.
+static void encode_bytes(CobsEncoder* encoder, Crc* crc, const uint8_t* data, size_t size) {
+    while (size != 0) {
+        if (!encoder->block_open) open_block(encoder);
+        size_t limit = size < COBS_MAX_BLOCK - encoder->run ? size : COBS_MAX_BLOCK - encoder->run;
+        const uint8_t* zero = (const uint8_t*)memchr(data, 0, limit);
+        size_t chunk = zero != NULL ? (size_t)(zero - data) : limit;
+        write_spans(encoder->spans, encoder->out, data, chunk);
+        crc_update(crc, data, chunk);
+        encoder->out += chunk;
+        encoder->run += chunk;
+        data += chunk;
+        size -= chunk;
+        if (zero != NULL) {
+            // The 0 itself is implied by the code, and there's always a block after it
+            crc_update(crc, zero, 1);
+            close_block(encoder);
+            open_block(encoder);
+            data++;
+            size--;
+        } else if (encoder->run == COBS_MAX_BLOCK) {
+            // A full block has no implied 0, only start another if there's more to come
+            close_block(encoder);
+        }
+    }
+}
+
+static size_t encode_finish(CobsEncoder* encoder) {
+    if (encoder->block_open) close_block(encoder);
+    write_span_byte(encoder->spans, encoder->out++, FRAME_DELIMITER);
+    return encoder->out;
+}
+
+Status frame_send(UartHandle uart, const uint8_t* data, size_t size) {
+    return frame_send_with_crc(uart, CRC_NONE, data, size);
+}
+
+Status frame_send_with_crc(UartHandle uart, CrcType crc_type, const uint8_t* data, size_t size) {
+    return frame_send_with_priority(uart, UART_PRIORITY_NORMAL, crc_type, data, size);
+}
+
+Status frame_send_with_priority(UartHandle uart, UartPriority priority, CrcType crc_type, const uint8_t* data, size_t size) {
+    if (uart == NULL || (data == NULL && size != 0) || size + crc_size(crc_type) > FRAME_MAX_SIZE) return FAILURE;
+
+    // Other tasks may be writing to the channel too, so the frame has to be reserved at exactly its
+    // encoded size. A first pass over the data without writing anything works that out, the CRC
+    // goes through it at the same time since its bytes get encoded as well.
+    Crc crc;
+    crc_init(&crc, crc_type);
+    uint8_t crc_bytes[CRC_MAX_SIZE];
+    size_t crc_length = 0;
+    CobsEncoder counter = { .spans = NULL };
+    open_block(&counter); // Even an empty frame has one block
+    encode_bytes(&counter, &crc, data, size);
+    if (crc_type != CRC_NONE) {
+        crc_length = crc_write(&crc, crc_bytes);
+        encode_bytes(&counter, NULL, crc_bytes, crc_length);
+    }
+
+    UartReservation reservation;
+    Status status = uart_transmit_reserve(uart, priority, encode_finish(&counter), &reservation);
+    if (status != SUCCESS) return status;
+    CobsEncoder encoder = { .spans = reservation.space.spans };
+    open_block(&encoder);
+    encode_bytes(&encoder, NULL, data, size);
+    encode_bytes(&encoder, NULL, crc_bytes, crc_length);
+    encode_finish(&encoder);
+    return uart_transmit_commit(uart, &reservation);
+}
@@ -1,76 +1,144 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include "uart.h"
 #include "processor_interface.h"
+#include "peripheral_emulator.h"
+#include "frame.h"
+#include "trace.h"
+#include "simulator.h"
+#include "pty_bridge.h"
+#include "wait_event.h"
+
+#define DEMO_TRACE_PATH "output/demo.trace"
+
+// Wires the channel's TX line straight back into its RX line, servicing its interrupt as the bytes
+// go round, until everything queued to transmit has come back in. If corrupt_index isn't negative
+// then that byte gets a bit flipped on the way.
+static void loop_back(uint8_t channel, int corrupt_index) {
+    uint8_t moved = 1;
+    int index = 0;
+    while (moved) {
+        moved = 0;
+        raise_pending_interrupt(channel);
+        uint8_t data;
+        while (peripheral_transmit_byte(channel, &data) == SUCCESS) {
+            if (index++ == corrupt_index) data ^= 0x04;
+            peripheral_receive_byte(channel, data);
+            raise_pending_interrupt(channel);
+            moved = 1;
+        }
+        signal_rx_timeout(channel);
+        raise_pending_interrupt(channel);
+    }
+}
+
+// What the notification callbacks saw, for the main thread to print once they've happened
+typedef struct {
+    WaitEvent event;
+    _Atomic uint32_t calls;
+    UartEvent last_event;
+    size_t last_bytes;
+} CallbackRecord;
+
+// Runs on the notification worker. Reads everything waiting on a receive event.
+static void record_callback(UartHandle uart, UartEvent event, void* context) {
+    CallbackRecord* record = (CallbackRecord*)context;
+    size_t bytes = 0;
+    if (event != UART_EVENT_TX_SPACE) {
+        uint8_t buffer[64];
+        uart_read_bytes_from_receive_queue_nonblocking(uart, buffer, sizeof(buffer), &bytes);
+    }
+    record->last_event = event;
+    record->last_bytes = bytes;
+    atomic_fetch_add(&record->calls, 1);
+    if (wait_event_has_waiters(&record->event)) wait_event_signal(&record->event);
+}
+
+static void wait_for_callbacks(CallbackRecord* record, uint32_t calls) {
+    while (atomic_load(&record->calls) < calls) {
+        uint32_t sequence = wait_event_prepare(&record->event);
+        if (atomic_load(&record->calls) < calls) wait_event_wait(&record->event, sequence, NULL);
+        wait_event_finish(&record->event);
+    }
+}
 
 int main(void) {
     printf("Beginning UART tests...\n\n\n");
     printf("Initial Register values:\n\n");
-    display_register_status();
+    display_register_status(0);
 
-    printf("\nInitialising UART...\n");
-    Status return_status = initialise_uart();
+    printf("\nInitialising UART channel 0...\n");
+    UartHandle uart;
+    Status return_status = initialise_uart(0, NULL, &uart);
     if (return_status != SUCCESS) {
         printf("Initialising UART failed!\n");
         return 0;
     }
 
     printf("Register values after UART initilisation:\n\n");
-    display_register_status();
+    display_register_status(0);
 
     printf("Initial UART status:\n\n");
-    display_uart_status();
+    display_uart_status(uart);
 
     printf("\n\nSimulating sending data via transmit\n\n");
 
     printf("Adding \'H\', \'i\' to the transmit queue\n");
     char test_message[] = {'H', 'i'};
     size_t message_len = 2;
-    uart_write_bytes_to_transmit_queue((uint8_t*)test_message, message_len);
+    uart_write_bytes_to_transmit_queue(uart, UART_PRIORITY_NORMAL, (uint8_t*)test_message, message_len);
     printf("Message added!\n\n");
 
     printf("UART status after adding to transmit queue:\n");
-    display_uart_status();
+    display_uart_status(uart);
 
-    printf("Simulating UART peripheral setting TX Register Not Full to high\n");
-    set_tx_not_full(1);
-    display_register_status();
+    printf("\nTX FIFO is empty so the TX interrupt is pending: %d\n", (uart_interrupt_pending(0) & TX_INTERRUPT_PENDING) != 0);
 
-    printf("\nTriggering 3 interrupts (should only be 2 but to demonstrate no errors)\n");
-    for (int i = 0; i < 3; i++) {
-        uart_isr();
+    printf("\nTriggering 2 interrupts (should only be 1 as both bytes fit in the TX FIFO but to demonstrate no errors)\n");
+    for (int i = 0; i < 2; i++) {
+        uart0_isr();
         printf("\nRegister Values after %d interrupts:\n", i+1);
-        display_register_status();
+        display_register_status(0);
         printf("\nUART status after %d interrupts:\n", i+1);
-        display_uart_status();
+        display_uart_status(uart);
+        if (i == 0) {
+            printf("\nTransmit queue has drained so the ISR masked the TX interrupt, pending: %d\n",
+                (uart_interrupt_pending(0) & TX_INTERRUPT_PENDING) != 0);
+            printf("The second interrupt is forced, it is counted as one with nothing to do\n");
+        }
+    }
+
+    printf("\nSimulating the UART peripheral sending the TX FIFO out on the line: ");
+    uint8_t sent;
+    while (peripheral_transmit_byte(0, &sent) == SUCCESS) {
+        printf("%c, ", sent);
     }
 
-    printf("\n\nSimulating receiving data\n\n");
-    printf("Setting Tx not full back to 0\n");
-    set_tx_not_full(0);
-    printf("Setting Rx not empty to 1\n");
-    set_rx_not_empty(1);
+    printf("\n\n\nSimulating receiving data\n\n");
+    printf("Putting \'H\', \'i\' into the RX FIFO\n");
+    peripheral_receive_byte(0, (uint8_t)('H'));
+    peripheral_receive_byte(0, (uint8_t)('i'));
     printf("New register values:\n");
-    display_register_status();
+    display_register_status(0);
 
-    printf("\nTriggering 2 interrupts and putting \'H\', \'i\' through receive \n");
+    printf("\nBelow the RX trigger level so no RX interrupt until the line goes idle: %d\n", (uart_interrupt_pending(0) & RX_INTERRUPT_PENDING) != 0);
+    signal_rx_timeout(0);
+    printf("RX interrupt pending after RX timeout: %d\n", (uart_interrupt_pending(0) & RX_INTERRUPT_PENDING) != 0);
 
-    set_data_register((uint8_t)('H'));
-    uart_isr();
+    printf("\nTriggering 1 interrupt to drain the RX FIFO\n");
+    uart0_isr();
     printf("\nRegister Values after 1 interrupt:\n");
-    display_register_status();
-    printf("\nUART status after 1 interrupts:\n");
-    display_uart_status();
-
-    set_data_register((uint8_t)('i'));
-    uart_isr();
-    printf("\nRegister Values after 2 interrupts:\n");
-    display_register_status();
-    printf("\nUART status after 2 interrupts:\n");
-    display_uart_status();
+    display_register_status(0);
+    printf("\nUART status after 1 interrupt:\n");
+    display_uart_status(uart);
 
     uint8_t returning[5];
     size_t bytes_read;
-    uart_read_bytes_from_receive_queue_nonblocking(returning, 5, &bytes_read);
+    uart_read_bytes_from_receive_queue_nonblocking(uart, returning, 5, &bytes_read);
     printf("Read %ld bytes from the buffer:", bytes_read);
     for (size_t i=0; i<bytes_read; i++) {
         printf("%c, ", returning[i]);
@@ -78,14 +146,496 @@ int main(void) {
 
 
     printf("\n\nFilling queue with 257 messages:\n");
+    int interrupts = 0;
     for (int i = 0; i<257; i++) {
-        uart_isr();
+        peripheral_receive_byte(0, (uint8_t)('i'));
+        if (uart_interrupt_pending(0) & RX_INTERRUPT_PENDING) {
+            uart0_isr();
+            interrupts++;
+        }
+    }
+    signal_rx_timeout(0);
+    if (uart_interrupt_pending(0) & RX_INTERRUPT_PENDING) {
+        uart0_isr();
+        interrupts++;
+    }
+    printf("\nUART status after 257 messages (%d interrupts):\n", interrupts);
+    display_uart_status(uart);
+
+    printf("\n\nSimulating a second channel with its own queue sizes\n\n");
+    UartHandle second_uart;
+    UartConfig second_config = { .receive_queue_size = 64, .transmit_queue_size = 32, .priority_queue_size = 16,
+        .rx_trigger_level = 1, .tx_empty_threshold = 0 };
+    return_status = initialise_uart(1, &second_config, &second_uart);
+    if (return_status != SUCCESS) {
+        printf("Initialising UART channel 1 failed!\n");
+        return 0;
+    }
+    printf("Receiving \'!\' on channel 1\n");
+    peripheral_receive_byte(1, (uint8_t)('!'));
+    uart1_isr();
+    printf("\nChannel 1 status:\n");
+    display_uart_status(second_uart);
+    printf("\nChannel 0 status is unaffected:\n");
+    display_uart_status(uart);
+
+    printf("\nReading 4 bytes from channel 1 with a 10ms timeout when only 1 is there\n");
+    uint8_t timeout_buffer[4];
+    size_t timeout_bytes_read;
+    return_status = uart_read_bytes_from_receive_queue_timeout(second_uart, timeout_buffer, 4, 10, &timeout_bytes_read);
+    printf("Timed out: %d, read %zu bytes\n", return_status == BUSY, timeout_bytes_read);
+
+    printf("\n\nRunning channel 2 against the peripheral emulator at 115200 baud\n\n");
+    UartHandle emulated_uart;
+    return_status = initialise_uart(2, NULL, &emulated_uart);
+    if (return_status != SUCCESS) {
+        printf("Initialising UART channel 2 failed!\n");
+        return 0;
+    }
+    const char line_message[] = "Hello from the line!";
+    uint8_t line_output[32] = {0};
+    PeripheralEmulatorConfig emulator_config = {
+        .channel = 2, .baud_rate = 115200,
+        .rx_source = (const uint8_t*)line_message, .rx_source_length = sizeof(line_message) - 1,
+        .tx_sink = line_output, .tx_sink_size = sizeof(line_output) - 1
+    };
+    PeripheralEmulator* emulator;
+    if (peripheral_emulator_start(&emulator_config, &emulator) != SUCCESS) {
+        printf("Starting the peripheral emulator failed!\n");
+        return 0;
+    }
+
+    uint8_t line_input[sizeof(line_message)] = {0};
+    uart_read_bytes_from_receive_queue_blocking(emulated_uart, line_input, sizeof(line_message) - 1);
+    printf("Read from the line: %s\n", (char*)line_input);
+
+    char reply[] = "Hi line";
+    uart_write_bytes_to_transmit_queue(emulated_uart, UART_PRIORITY_NORMAL, (uint8_t*)reply, sizeof(reply) - 1);
+    PeripheralEmulatorStats emulator_stats;
+    do {
+        peripheral_emulator_get_stats(emulator, &emulator_stats);
+    } while (emulator_stats.tx_bytes_sent < sizeof(reply) - 1);
+    peripheral_emulator_stop(emulator);
+    printf("Sent on the line: %s\n", (char*)line_output);
+    printf("Emulator delivered %zu bytes (%zu overruns), sent %zu bytes\n", emulator_stats.rx_bytes_delivered,
+        emulator_stats.rx_overruns, emulator_stats.tx_bytes_sent);
+
+    UartStats uart_stats;
+    uart_get_stats(emulated_uart, &uart_stats, 1);
+    printf("Channel 2 stats: %llu bytes received, %llu sent, %llu ISRs (%llu spurious), RX queue high watermark %u\n",
+        (unsigned long long)uart_stats.rx_bytes, (unsigned long long)uart_stats.tx_bytes,
+        (unsigned long long)uart_stats.isr_count, (unsigned long long)uart_stats.isr_spurious,
+        uart_stats.rx_queue_high_watermark);
+    uart_get_stats(emulated_uart, &uart_stats, 0);
+    printf("After resetting: %llu bytes received, %llu ISRs\n", (unsigned long long)uart_stats.rx_bytes,
+        (unsigned long long)uart_stats.isr_count);
+
+    printf("\n\nSending COBS frames on channel 3 with its TX looped back to its RX\n\n");
+    UartHandle framed_uart;
+    return_status = initialise_uart(3, NULL, &framed_uart);
+    if (return_status != SUCCESS) {
+        printf("Initialising UART channel 3 failed!\n");
+        return 0;
+    }
+    static FramePool frame_pool;
+    frame_pool_init(&frame_pool);
+    FrameReceiver receiver;
+    frame_receiver_init(&receiver, framed_uart, &frame_pool);
+
+    const uint8_t first_packet[] = { 'a', 0x00, 'b', 0x00, 0x00, 'c' };
+    const char second_packet[] = "no zeros here";
+    frame_send(framed_uart, first_packet, sizeof(first_packet));
+    frame_send(framed_uart, (const uint8_t*)second_packet, sizeof(second_packet) - 1);
+    printf("Queued 2 packets as %zu bytes on the line\n", uart_transmit_queue_length(framed_uart));
+    loop_back(3, -1);
+
+    Frame* frame;
+    while (frame_receive(&receiver, &frame) == SUCCESS) {
+        printf("Received a %d byte frame:", frame->length);
+        for (int i = 0; i < frame->length; i++) {
+            printf(" %02X", frame->data[i]);
+        }
+        printf("\n");
+        frame_release(&frame_pool, frame);
+    }
+    printf("Frames received: %u, dropped: %u, pool frames free: %zu/%d\n", receiver.frames_received,
+        receiver.frames_dropped, frame_pool_available(&frame_pool), FRAME_POOL_BLOCKS);
+
+    printf("\nSending a frame with a CRC-32C appended (%s), then one corrupted on the line\n", crc_implementation_name(CRC_32C));
+    frame_receiver_set_crc(&receiver, CRC_32C);
+    frame_send_with_crc(framed_uart, CRC_32C, (const uint8_t*)second_packet, sizeof(second_packet) - 1);
+    loop_back(3, -1);
+    if (frame_receive(&receiver, &frame) == SUCCESS) {
+        printf("Received a %d byte frame with a good CRC: %.*s\n", frame->length, frame->length, (char*)frame->data);
+        frame_release(&frame_pool, frame);
     }
-    printf("\nUART status after 257 messages:\n");
-    display_uart_status();
+    frame_send_with_crc(framed_uart, CRC_32C, (const uint8_t*)second_packet, sizeof(second_packet) - 1);
+    loop_back(3, 5);
+    return_status = frame_receive(&receiver, &frame);
+    printf("Corrupted frame received: %d, CRC errors: %u\n", return_status == SUCCESS, receiver.crc_errors);
 
-    printf("\nStopping UART\n");
-    stop_uart();
+    printf("\n\nReading lines on channel 4 with its TX looped back to its RX\n\n");
+#ifdef UART_TRACE
+    uint8_t tracing = trace_start(DEMO_TRACE_PATH, 1 << 20) == SUCCESS;
+    printf("Recording a trace to %s: %d\n", DEMO_TRACE_PATH, tracing);
+#endif
+    UartHandle line_uart;
+    return_status = initialise_uart(4, NULL, &line_uart);
+    if (return_status != SUCCESS) {
+        printf("Initialising UART channel 4 failed!\n");
+        return 0;
+    }
+    char first_lines[] = "first line\nsecond";
+    uart_write_bytes_to_transmit_queue(line_uart, UART_PRIORITY_NORMAL, (uint8_t*)first_lines, sizeof(first_lines) - 1);
+    loop_back(4, -1);
+    char line[32];
+    size_t line_length;
+    uart_read_until_nonblocking(line_uart, '\n', (uint8_t*)line, sizeof(line), &line_length);
+    printf("Read a %zu byte line: %.*s", line_length, (int)line_length, line);
+    return_status = uart_read_until_nonblocking(line_uart, '\n', (uint8_t*)line, sizeof(line), &line_length);
+    printf("Second line isn't finished yet: %d, %zu bytes left waiting\n", return_status == EMPTY,
+        uart_receive_queue_length(line_uart));
+    char rest_of_line[] = " line\n";
+    uart_write_bytes_to_transmit_queue(line_uart, UART_PRIORITY_NORMAL, (uint8_t*)rest_of_line, sizeof(rest_of_line) - 1);
+    loop_back(4, -1);
+    return_status = uart_read_until_timeout(line_uart, '\n', (uint8_t*)line, sizeof(line), 10, &line_length);
+    printf("Read a %zu byte line once the rest arrived: %.*s", line_length, (int)line_length, line);
+    char unfinished_line[] = "no end in sight";
+    uart_write_bytes_to_transmit_queue(line_uart, UART_PRIORITY_NORMAL, (uint8_t*)unfinished_line, sizeof(unfinished_line) - 1);
+    loop_back(4, -1);
+    return_status = uart_read_until_nonblocking(line_uart, '\n', (uint8_t*)line, sizeof(line), &line_length);
+    printf("No delimiter yet: %d, ", return_status == EMPTY);
+    // A smaller max than last time still gets the bytes already looked through
+    return_status = uart_read_until_nonblocking(line_uart, '\n', (uint8_t*)line, 8, &line_length);
+    printf("so taking at most 8 bytes instead: %d, got %.*s\n", return_status == SUCCESS, (int)line_length, line);
+    uart_read_until_nonblocking(line_uart, '\n', (uint8_t*)line, uart_receive_queue_length(line_uart), &line_length);
+    printf("And the other %zu: %.*s\n", line_length, (int)line_length, line);
+#ifdef UART_TRACE
+    size_t events_recorded = 0;
+    if (tracing) trace_stop(&events_recorded, NULL);
+    printf("Recorded %zu events\n", events_recorded);
+#endif
+
+    printf("\n\nGetting told about data on channel 5 (looped back) instead of polling for it\n\n");
+    static const char* event_names[] = { "RX watermark", "RX idle", "TX space" };
+    UartHandle notified_uart;
+    return_status = initialise_uart(5, NULL, &notified_uart);
+    if (return_status != SUCCESS) {
+        printf("Initialising UART channel 5 failed!\n");
+        return 0;
+    }
+    static CallbackRecord receive_record;
+    wait_event_init(&receive_record.event);
+    uart_set_receive_callback(notified_uart, 16, 20000, record_callback, &receive_record);
+    printf("Receive callback at 16 bytes or 20ms idle\n");
+    char burst[] = "0123456789abcdef";
+    uart_write_bytes_to_transmit_queue(notified_uart, UART_PRIORITY_NORMAL, (uint8_t*)burst, sizeof(burst) - 1);
+    loop_back(5, -1);
+    wait_for_callbacks(&receive_record, 1);
+    printf("Callback 1 (%s) read %zu bytes\n", event_names[receive_record.last_event], receive_record.last_bytes);
+    char tail[] = "ghijk";
+    uart_write_bytes_to_transmit_queue(notified_uart, UART_PRIORITY_NORMAL, (uint8_t*)tail, sizeof(tail) - 1);
+    loop_back(5, -1);
+    wait_for_callbacks(&receive_record, 2);
+    printf("Callback 2 (%s) read %zu bytes\n", event_names[receive_record.last_event], receive_record.last_bytes);
+
+    static CallbackRecord transmit_record;
+    wait_event_init(&transmit_record.event);
+    uart_set_transmit_callback(second_uart, 16, record_callback, &transmit_record);
+    char fill[24] = {0};
+    uart_write_bytes_to_transmit_queue(second_uart, UART_PRIORITY_NORMAL, (uint8_t*)fill, sizeof(fill));
+    printf("Queued 24 bytes on channel 1, transmit space callback at 16 of its 32 bytes free\n");
+    uint8_t drained;
+    do {
+        while (peripheral_transmit_byte(1, &drained) == SUCCESS) {
+        }
+    } while (raise_pending_interrupt(1));
+    wait_for_callbacks(&transmit_record, 1);
+    printf("Transmit queue drained with %u callback (%s)\n", atomic_load(&transmit_record.calls),
+        event_names[transmit_record.last_event]);
+
+    printf("\n\nSending a control message on channel 6's priority lane while bulk messages are queued\n\n");
+    UartHandle priority_uart;
+    return_status = initialise_uart(6, NULL, &priority_uart);
+    if (return_status != SUCCESS) {
+        printf("Initialising UART channel 6 failed!\n");
+        return 0;
+    }
+    char bulk[] = "<bulk message no. 0>";
+    for (char number = '1'; number <= '3'; number++) {
+        bulk[sizeof(bulk) - 3] = number;
+        uart_write_bytes_to_transmit_queue(priority_uart, UART_PRIORITY_NORMAL, (uint8_t*)bulk, sizeof(bulk) - 1);
+    }
+    // The first bulk message is part way out by the time the control message turns up, it isn't
+    // split but the control message goes straight after it
+    raise_pending_interrupt(6);
+    char control[] = "[STOP]";
+    uart_write_bytes_to_transmit_queue(priority_uart, UART_PRIORITY_HIGH, (uint8_t*)control, sizeof(control) - 1);
+    char line_sent[4 * sizeof(bulk)] = {0};
+    size_t sent_length = 0;
+    uint8_t sent_byte;
+    do {
+        while (peripheral_transmit_byte(6, &sent_byte) == SUCCESS && sent_length < sizeof(line_sent) - 1) {
+            line_sent[sent_length++] = (char)sent_byte;
+        }
+    } while (raise_pending_interrupt(6));
+    printf("Sent on the line: %s\n", line_sent);
+    UartStats priority_stats;
+    uart_get_stats(priority_uart, &priority_stats, 0);
+    printf("Normal lane %llu messages, high lane %llu messages, %llu + %llu latency samples\n",
+        (unsigned long long)priority_stats.tx_messages[UART_PRIORITY_NORMAL],
+        (unsigned long long)priority_stats.tx_messages[UART_PRIORITY_HIGH],
+        (unsigned long long)priority_stats.tx_latency_samples[UART_PRIORITY_NORMAL],
+        (unsigned long long)priority_stats.tx_latency_samples[UART_PRIORITY_HIGH]);
+
+    printf("\n\nFlow control on channel 7, the far end is stopped at 48 bytes and let go again at 16\n\n");
+    UartConfig flow_config = { .receive_queue_size = 64, .transmit_queue_size = 64, .priority_queue_size = 32,
+        .rx_trigger_level = UART_DEFAULT_RX_TRIGGER_LEVEL, .tx_empty_threshold = UART_DEFAULT_TX_EMPTY_THRESHOLD,
+        .flow_control = UART_FLOW_RTS_CTS, .flow_high_watermark = 48, .flow_low_watermark = 16 };
+    UartHandle flow_uart;
+    return_status = initialise_uart(7, &flow_config, &flow_uart);
+    if (return_status != SUCCESS) {
+        printf("Initialising UART channel 7 failed!\n");
+        return 0;
+    }
+    uint32_t far_end_sent = 0;
+    while (peripheral_rts_asserted(7) && far_end_sent < 100) {
+        peripheral_receive_byte(7, (uint8_t)('a' + far_end_sent % 26));
+        far_end_sent++;
+        raise_pending_interrupt(7);
+    }
+    printf("RTS dropped after the far end sent %u bytes, receive queue has %zu\n", far_end_sent,
+        uart_receive_queue_length(flow_uart));
+    uint8_t flow_buffer[64];
+    uart_read_bytes_from_receive_queue_nonblocking(flow_uart, flow_buffer, 40, &bytes_read);
+    printf("Read %zu bytes, RTS is back: %d\n", bytes_read, peripheral_rts_asserted(7));
+    peripheral_set_cts(7, 0);
+    char held[] = "held";
+    uart_write_bytes_to_transmit_queue(flow_uart, UART_PRIORITY_NORMAL, (uint8_t*)held, sizeof(held) - 1);
+    raise_pending_interrupt(7);
+    printf("With CTS clear the transmitter holds on: %d\n", peripheral_transmit_byte(7, &sent_byte) == BUSY);
+    peripheral_set_cts(7, 1);
+    sent_length = 0;
+    while (peripheral_transmit_byte(7, &sent_byte) == SUCCESS) sent_length++;
+    printf("With CTS set again %zu bytes went out\n", sent_length);
+    stop_uart(flow_uart);
+
+    flow_config.flow_control = UART_FLOW_XON_XOFF;
+    initialise_uart(7, &flow_config, &flow_uart);
+    for (int i = 0; i < 48; i++) {
+        peripheral_receive_byte(7, (uint8_t)'x');
+        raise_pending_interrupt(7);
+    }
+    printf("With XON/XOFF instead, 48 bytes in the channel sends 0x%02X", peripheral_transmit_byte(7, &sent_byte) == SUCCESS ? sent_byte : 0);
+    uart_read_bytes_from_receive_queue_nonblocking(flow_uart, flow_buffer, 40, &bytes_read);
+    raise_pending_interrupt(7);
+    printf(" and reading it back down sends 0x%02X\n", peripheral_transmit_byte(7, &sent_byte) == SUCCESS ? sent_byte : 0);
+    // A lone byte is below the RX trigger level so the timeout is what gets it picked up
+    peripheral_receive_byte(7, UART_XOFF);
+    signal_rx_timeout(7);
+    raise_pending_interrupt(7);
+    uart_write_bytes_to_transmit_queue(flow_uart, UART_PRIORITY_NORMAL, (uint8_t*)held, sizeof(held) - 1);
+    printf("After an XOFF from the far end %zu bytes wait in the transmit queue (TX interrupt pending: %d)",
+        uart_transmit_queue_length(flow_uart), (uart_interrupt_pending(7) & TX_INTERRUPT_PENDING) != 0);
+    peripheral_receive_byte(7, UART_XON);
+    signal_rx_timeout(7);
+    raise_pending_interrupt(7);
+    printf(", after an XON %zu do\n", uart_transmit_queue_length(flow_uart));
+    UartStats flow_stats;
+    uart_get_stats(flow_uart, &flow_stats, 0);
+    printf("Far end stopped %llu times, this end paused %llu times, %llu bytes dropped\n",
+        (unsigned long long)flow_stats.rx_flow_stops, (unsigned long long)flow_stats.tx_flow_stops,
+        (unsigned long long)flow_stats.rx_dropped);
+    stop_uart(flow_uart);
+
+    printf("\n\nElastic receive queue on channel 7, 64 bytes of its own and up to 256 borrowed during a burst\n\n");
+    UartConfig burst_config = flow_config;
+    burst_config.flow_control = UART_FLOW_NONE;
+    burst_config.receive_burst_size = 256;
+    initialise_uart(7, &burst_config, &flow_uart);
+    size_t free_segments = queue_segments_free();
+    for (int i = 0; i < 200; i++) {
+        peripheral_receive_byte(7, (uint8_t)('a' + i % 26));
+        raise_pending_interrupt(7);
+    }
+    signal_rx_timeout(7);
+    raise_pending_interrupt(7);
+    printf("A 200 byte burst is all waiting in the receive queue: %zu bytes, %zu segments borrowed\n",
+        uart_receive_queue_length(flow_uart), free_segments - queue_segments_free());
+    uint8_t burst_buffer[200];
+    uart_read_bytes_from_receive_queue_nonblocking(flow_uart, burst_buffer, sizeof(burst_buffer), &bytes_read);
+    uint8_t burst_in_order = 1;
+    for (size_t i = 0; i < bytes_read; i++) burst_in_order &= burst_buffer[i] == (uint8_t)('a' + i % 26);
+    uart_get_stats(flow_uart, &flow_stats, 0);
+    printf("Read %zu bytes back in order: %d, %llu dropped, %zu segments still borrowed\n", bytes_read, burst_in_order,
+        (unsigned long long)flow_stats.rx_dropped, free_segments - queue_segments_free());
+
+    printf("\n\nLooping channel 7 back to itself with a route\n\n");
+    // Clear out what's left in the TX FIFO from before
+    while (peripheral_transmit_byte(7, &sent_byte) == SUCCESS) {
+    }
+    uart_route(flow_uart, flow_uart);
+    char echoed[] = "echo";
+    for (size_t i = 0; i < sizeof(echoed) - 1; i++) peripheral_receive_byte(7, (uint8_t)echoed[i]);
+    signal_rx_timeout(7);
+    raise_pending_interrupt(7);
+    // The receive interrupt unmasks the TX one, which sends them back
+    raise_pending_interrupt(7);
+    printf("The far end sent \"%s\" and got back \"", echoed);
+    while (peripheral_transmit_byte(7, &sent_byte) == SUCCESS) printf("%c", sent_byte);
+    UartRouteStats route_stats;
+    uart_get_route_stats(flow_uart, &route_stats);
+    printf("\", %llu bytes forwarded, %u left in the receive queue\n", (unsigned long long)route_stats.bytes, route_stats.queued);
+    uart_unroute(flow_uart);
+
+    printf("\n\nWaiting for channel 7 with a poll set\n\n");
+    UartPollSet* poll_set;
+    uart_poll_create(&poll_set);
+    uart_poll_add(poll_set, flow_uart, UART_POLL_READABLE, 0);
+    UartPollEvent poll_events[UART_CHANNEL_COUNT];
+    size_t ready_count = 0;
+    printf("Nothing received yet, uart_poll times out: %d\n",
+        uart_poll(poll_set, 10, poll_events, UART_CHANNEL_COUNT, &ready_count) == BUSY);
+    struct pollfd poll_descriptor = { .fd = uart_poll_fd(poll_set), .events = POLLIN };
+    printf("The set's eventfd isn't readable: %d", poll(&poll_descriptor, 1, 0) == 0);
+    peripheral_receive_byte(7, (uint8_t)'!');
+    signal_rx_timeout(7);
+    raise_pending_interrupt(7);
+    printf(", after a byte arrives it is: %d\n", poll(&poll_descriptor, 1, 0) == 1);
+    uart_poll_add(poll_set, flow_uart, UART_POLL_READABLE | UART_POLL_WRITABLE, 16);
+    uart_poll(poll_set, 0, poll_events, UART_CHANNEL_COUNT, &ready_count);
+    printf("uart_poll reports %zu channel, channel 7 readable: %d, writable: %d\n", ready_count,
+        ready_count == 1 && (poll_events[0].events & UART_POLL_READABLE) != 0,
+        ready_count == 1 && (poll_events[0].events & UART_POLL_WRITABLE) != 0);
+    uart_read_bytes_from_receive_queue_nonblocking(flow_uart, flow_buffer, sizeof(flow_buffer), &bytes_read);
+    uart_poll_destroy(poll_set);
+
+    printf("\nStopping UARTs\n");
+    stop_uart(flow_uart);
+    stop_uart(priority_uart);
+    stop_uart(notified_uart);
+    stop_uart(line_uart);
+    stop_uart(framed_uart);
+    stop_uart(emulated_uart);
+    stop_uart(second_uart);
+    stop_uart(uart);
+
+    printf("\nSimulating 10 seconds of traffic at 921600 baud on channels 0 and 1, channel 1 with RTS/CTS and a slow reader\n");
+    UartConfig simulated_flow_config = { .receive_queue_size = 64, .transmit_queue_size = 32, .priority_queue_size = 16,
+        .rx_trigger_level = UART_DEFAULT_RX_TRIGGER_LEVEL, .tx_empty_threshold = UART_DEFAULT_TX_EMPTY_THRESHOLD,
+        .flow_control = UART_FLOW_RTS_CTS };
+    SimulatorChannelConfig simulated_channels[] = {
+        { .channel = 0, .baud_rate = 921600, .rx_message_min = 1, .rx_message_max = 200, .rx_gap_max_ns = 2000000,
+            .rx_error_ppm = 50, .read_interval_ns = 1000000, .read_size = 256,
+            .tx_message_min = 1, .tx_message_max = 64, .tx_gap_max_ns = 1000000 },
+        { .channel = 1, .uart_config = &simulated_flow_config, .baud_rate = 921600, .rx_message_min = 16, .rx_message_max = 64,
+            .rx_gap_max_ns = 500000, .read_interval_ns = 5000000, .read_size = 64,
+            .tx_message_min = 1, .tx_message_max = 16, .tx_gap_max_ns = 200000 }
+    };
+    SimulatorConfig simulator_config = { .seed = 2024, .duration_ns = 10000000000ULL, .channels = simulated_channels,
+        .channel_count = sizeof(simulated_channels) / sizeof(simulated_channels[0]) };
+    static SimulatorResult simulated, simulated_again;
+    if (simulator_run(&simulator_config, &simulated) == SUCCESS && simulator_run(&simulator_config, &simulated_again) == SUCCESS) {
+        printf("%llu events in %.3f s of wall clock, %.0f times real time\n", (unsigned long long)simulated.events,
+            (double)simulated.elapsed_ns / 1e9, (double)simulated.simulated_ns / (double)simulated.elapsed_ns);
+        for (size_t i = 0; i < simulator_config.channel_count; i++) {
+            const SimulatorChannelResult* channel = &simulated.channels[i];
+            printf("Channel %u: wire %.1f%% in and %.1f%% out, worst queue depths %u RX and %u TX, %llu read, %llu sent,"
+                " %llu dropped, %llu overruns, %llu line errors, %llu flow holds\n", simulated_channels[i].channel,
+                channel->rx_wire_utilisation * 100, channel->tx_wire_utilisation * 100, channel->rx_queue_max_depth,
+                channel->tx_queue_max_depth, (unsigned long long)channel->rx_bytes_read, (unsigned long long)channel->tx_bytes_sent,
+                (unsigned long long)channel->rx_dropped, (unsigned long long)channel->rx_overruns,
+                (unsigned long long)channel->rx_errors, (unsigned long long)channel->rx_flow_holds);
+        }
+        uint8_t same = simulated.events == simulated_again.events;
+        for (size_t i = 0; i < simulator_config.channel_count; i++) {
+            same &= simulated.channels[i].rx_digest == simulated_again.channels[i].rx_digest
+                && simulated.channels[i].tx_digest == simulated_again.channels[i].tx_digest;
+        }
+        printf("Running it again with the same seed gives the same digests: %d\n", same);
+    } else {
+        printf("Simulation failed!\n");
+    }
+
+    printf("\nSimulating 1 second of an 8 port multiplexer at 921600 baud, each port routed to its neighbour with RTS/CTS\n");
+    UartConfig routed_config = simulated_flow_config;
+    routed_config.receive_queue_size = QUEUE_SIZE;
+    SimulatorChannelConfig routed_channels[UART_CHANNEL_COUNT];
+    for (uint8_t i = 0; i < UART_CHANNEL_COUNT; i++) {
+        routed_channels[i] = (SimulatorChannelConfig){ .channel = i, .uart_config = &routed_config, .baud_rate = 921600,
+            .rx_message_min = 1, .rx_message_max = 256, .route = 1, .route_channel = i ^ 1 };
+    }
+    SimulatorConfig routed_simulation = { .seed = 2024, .duration_ns = 1000000000ULL, .channels = routed_channels,
+        .channel_count = UART_CHANNEL_COUNT };
+    if (simulator_run(&routed_simulation, &simulated) == SUCCESS) {
+        double slowest = 1.0;
+        uint64_t routed = 0;
+        uint64_t lost = 0;
+        for (uint8_t i = 0; i < UART_CHANNEL_COUNT; i++) {
+            const SimulatorChannelResult* channel = &simulated.channels[i];
+            if (channel->tx_wire_utilisation < slowest) slowest = channel->tx_wire_utilisation;
+            routed += channel->routed_bytes;
+            lost += channel->rx_dropped + channel->rx_overruns;
+        }
+        printf("%llu bytes forwarded, %llu lost, the least busy port was sending %.1f%% of the time\n",
+            (unsigned long long)routed, (unsigned long long)lost, slowest * 100);
+    } else {
+        printf("Simulation failed!\n");
+    }
+
+    printf("\nPutting channel 0 on a pseudo terminal, looped back to itself\n");
+    UartHandle bridged_uart;
+    PtyBridge* bridge = NULL;
+    initialise_uart(0, NULL, &bridged_uart);
+    PtyBridgeConfig bridge_config = { .channel = 0 };
+    int host = -1;
+    if (pty_bridge_start(&bridge_config, &bridge) == SUCCESS) host = open(pty_bridge_slave_path(bridge), O_RDWR | O_NOCTTY);
+    if (host >= 0) {
+        uart_route(bridged_uart, bridged_uart);
+        // Standing in for the host tooling, which would open the slave the same way
+        static uint8_t host_sent[16384];
+        static uint8_t host_received[sizeof(host_sent)];
+        for (size_t i = 0; i < sizeof(host_sent); i++) host_sent[i] = (uint8_t)(i * 7);
+        size_t host_written = 0;
+        size_t host_read = 0;
+        struct pollfd host_descriptor = { .fd = host };
+        while (host_read < sizeof(host_received)) {
+            host_descriptor.events = (short)(POLLIN | (host_written < sizeof(host_sent) ? POLLOUT : 0));
+            if (poll(&host_descriptor, 1, 1000) <= 0) break;
+            if ((host_descriptor.revents & POLLOUT) != 0) {
+                ssize_t count = write(host, &host_sent[host_written], sizeof(host_sent) - host_written);
+                if (count > 0) host_written += (size_t)count;
+            }
+            if ((host_descriptor.revents & POLLIN) != 0) {
+                ssize_t count = read(host, &host_received[host_read], sizeof(host_received) - host_read);
+                if (count > 0) host_read += (size_t)count;
+            }
+        }
+        PtyBridgeStats bridge_stats;
+        pty_bridge_get_stats(bridge, &bridge_stats);
+        printf("Wrote %zu bytes to the pty and read back %zu, the same: %d, in %.1f byte pty reads and %.1f byte writes\n",
+            host_written, host_read, host_read == sizeof(host_sent) && memcmp(host_sent, host_received, host_read) == 0,
+            bridge_stats.pty_reads != 0 ? (double)bridge_stats.rx_bytes / (double)bridge_stats.pty_reads : 0.0,
+            bridge_stats.pty_writes != 0 ? (double)bridge_stats.tx_bytes / (double)bridge_stats.pty_writes : 0.0);
+        close(host);
+    } else {
+        printf("Couldn't open a pseudo terminal\n");
+    }
+    pty_bridge_stop(bridge);
+    stop_uart(bridged_uart);
+
+#ifdef UART_TRACE
+    // Every channel is stopped, so the trace can be played back through fresh ones
+    if (tracing) {
+        printf("\nReplaying the channel 4 trace\n");
+        TraceReplayResult replay_result;
+        trace_replay(DEMO_TRACE_PATH, TRACE_REPLAY_COMPARE, &replay_result);
+        printf("Compared %zu events over %zu ISRs, mismatches: %zu\n", replay_result.events, replay_result.isrs,
+            replay_result.mismatches);
+        trace_replay(DEMO_TRACE_PATH, TRACE_REPLAY_BENCHMARK, &replay_result);
+        printf("Replayed %zu events in %llu ns\n", replay_result.events, (unsigned long long)replay_result.elapsed_ns);
+    }
+#endif
 
     return 0;
-}
\ No newline at end of file
+}
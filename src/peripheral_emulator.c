@@ -0,0 +1,156 @@
+#define _POSIX_C_SOURCE 200809L
+#include "peripheral_emulator.h"
+#include "processor_interface.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define BITS_PER_CHARACTER 10 // Start bit, 8 data bits and a stop bit
+#define RX_TIMEOUT_CHARACTERS 4 // Idle character times before an RX timeout, same as a 16550
+
+struct PeripheralEmulator {
+    PeripheralEmulatorConfig config;
+    pthread_t thread;
+    _Atomic uint8_t running;
+    uint32_t idle_characters; // Only touched by the emulator thread
+    uint8_t xoff_received; // Same
+
+    // Written by the emulator thread, read by anyone
+    _Atomic size_t rx_position;
+    _Atomic size_t rx_bytes_delivered;
+    _Atomic size_t rx_overruns;
+    _Atomic size_t tx_bytes_sent;
+    _Atomic size_t rx_flow_holds;
+    _Atomic size_t interrupts_raised;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ULL + (uint64_t)time.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline) {
+    struct timespec time = { .tv_sec = deadline / 1000000000ULL, .tv_nsec = deadline % 1000000000ULL };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, NULL);
+}
+
+// One character time on the line, a byte can move in each direction. Returns 1 if anything moved.
+static uint8_t step_line(PeripheralEmulator* emulator) {
+    PeripheralEmulatorConfig* config = &emulator->config;
+    uint8_t moved = 0;
+
+    size_t position = atomic_load_explicit(&emulator->rx_position, memory_order_relaxed);
+    uint8_t has_data = config->rx_source != NULL && position < config->rx_source_length;
+    uint8_t held = (config->hardware_flow_control && !peripheral_rts_asserted(config->channel)) || emulator->xoff_received;
+    if (has_data && held) {
+        // While it is held back the line is idle, so the RX timeout still picks up what is in the FIFO
+        atomic_fetch_add_explicit(&emulator->rx_flow_holds, 1, memory_order_relaxed);
+        has_data = 0;
+    }
+    if (has_data) {
+        if (peripheral_receive_byte(config->channel, config->rx_source[position]) == SUCCESS) {
+            atomic_fetch_add_explicit(&emulator->rx_bytes_delivered, 1, memory_order_relaxed);
+        } else {
+            atomic_fetch_add_explicit(&emulator->rx_overruns, 1, memory_order_relaxed);
+        }
+        atomic_store_explicit(&emulator->rx_position, position + 1, memory_order_release);
+        emulator->idle_characters = 0;
+        moved = 1;
+    } else if (emulator->idle_characters < RX_TIMEOUT_CHARACTERS) {
+        emulator->idle_characters++;
+    } else {
+        // Anything left below the trigger level needs the timeout to get it picked up
+        signal_rx_timeout(config->channel);
+    }
+
+    uint8_t data;
+    if (peripheral_transmit_byte(config->channel, &data) == SUCCESS) {
+        if (config->software_flow_control && (data == UART_XON || data == UART_XOFF)) {
+            emulator->xoff_received = data == UART_XOFF;
+            return 1;
+        }
+        size_t sent = atomic_load_explicit(&emulator->tx_bytes_sent, memory_order_relaxed);
+        if (config->tx_sink != NULL && sent < config->tx_sink_size) {
+            config->tx_sink[sent] = data;
+        }
+        atomic_store_explicit(&emulator->tx_bytes_sent, sent + 1, memory_order_release);
+        moved = 1;
+    }
+    return moved;
+}
+
+static void raise_interrupt(PeripheralEmulator* emulator) {
+    if (raise_pending_interrupt(emulator->config.channel)) {
+        atomic_fetch_add_explicit(&emulator->interrupts_raised, 1, memory_order_relaxed);
+    }
+}
+
+static void* emulator_thread(void* argument) {
+    PeripheralEmulator* emulator = (PeripheralEmulator*)argument;
+
+    if (emulator->config.baud_rate == 0) {
+        // As fast as possible, only backing off when the line has nothing to do
+        while (atomic_load_explicit(&emulator->running, memory_order_acquire)) {
+            uint8_t moved = step_line(emulator);
+            raise_interrupt(emulator);
+            if (!moved) sched_yield();
+        }
+        return NULL;
+    }
+
+    // Work out how many character times are due since the start and catch up to that, so that
+    // the average rate holds even though the sleeps aren't exact
+    uint64_t character_time_ns = (1000000000ULL * BITS_PER_CHARACTER) / emulator->config.baud_rate;
+    if (character_time_ns == 0) character_time_ns = 1;
+    uint64_t start = now_ns();
+    uint64_t characters_done = 0;
+    while (atomic_load_explicit(&emulator->running, memory_order_acquire)) {
+        uint64_t characters_due = (now_ns() - start) / character_time_ns;
+        while (characters_done < characters_due) {
+            step_line(emulator);
+            raise_interrupt(emulator);
+            characters_done++;
+        }
+        sleep_until_ns(start + (characters_done + 1) * character_time_ns);
+    }
+    return NULL;
+}
+
+Status peripheral_emulator_start(const PeripheralEmulatorConfig* config, PeripheralEmulator** emulator) {
+    if (config == NULL || emulator == NULL || config->channel >= UART_CHANNEL_COUNT) return FAILURE;
+    PeripheralEmulator* new_emulator = (PeripheralEmulator*)calloc(1, sizeof(PeripheralEmulator));
+    if (new_emulator == NULL) return FAILURE;
+    new_emulator->config = *config;
+    atomic_init(&new_emulator->running, 1);
+    if (config->hardware_flow_control) peripheral_set_cts(config->channel, 1);
+    if (pthread_create(&new_emulator->thread, NULL, emulator_thread, new_emulator) != 0) {
+        free(new_emulator);
+        return FAILURE;
+    }
+    *emulator = new_emulator;
+    return SUCCESS;
+}
+
+void peripheral_emulator_stop(PeripheralEmulator* emulator) {
+    if (emulator == NULL) return;
+    atomic_store_explicit(&emulator->running, 0, memory_order_release);
+    pthread_join(emulator->thread, NULL);
+    free(emulator);
+}
+
+void peripheral_emulator_get_stats(PeripheralEmulator* emulator, PeripheralEmulatorStats* stats) {
+    if (emulator == NULL || stats == NULL) return;
+    stats->rx_bytes_delivered = atomic_load_explicit(&emulator->rx_bytes_delivered, memory_order_relaxed);
+    stats->rx_overruns = atomic_load_explicit(&emulator->rx_overruns, memory_order_relaxed);
+    stats->tx_bytes_sent = atomic_load_explicit(&emulator->tx_bytes_sent, memory_order_acquire);
+    stats->rx_flow_holds = atomic_load_explicit(&emulator->rx_flow_holds, memory_order_relaxed);
+    stats->interrupts_raised = atomic_load_explicit(&emulator->interrupts_raised, memory_order_relaxed);
+}
+
+uint8_t peripheral_emulator_rx_complete(PeripheralEmulator* emulator) {
+    if (emulator == NULL) return 1;
+    if (emulator->config.rx_source == NULL) return 1;
+    return atomic_load_explicit(&emulator->rx_position, memory_order_acquire) >= emulator->config.rx_source_length;
+}
@@ -1,116 +1,139 @@
 #include "processor_interface.h"
 #include <stdio.h>
-// UART status register information
-#define STATUS_REGISTER_ADDRESS 0x80000120
-#define RX_NOT_EMPTY_BIT 0
-#define TX_NOT_FULL_BIT 1
-#define RX_ERROR_BIT 2
-#define TX_ENABLE_BIT 13
-#define RX_ENABLE_BIT 14
-#define INTERRUPT_ENABLE_BIT 15
-
-// UART data register information
-#define DATA_REGISTER_ADDRESS 0x80000122 // Access most recently received byte here
-#define STATUS_WRITABLE_MASK    ((1U << 13) | (1U << 14) | (1U << 15))
-// Byte 0 - First byte of status register
-// Byte 1 - Second byte of status register
-// Byte 2 - First Byte of data register
-// Byte 3 - Second Byte of data register
-static volatile uint8_t register_values[4] = {0, 0, 0, 0};
+#include <stdatomic.h>
+#include "macros.h"
 
-uint8_t read_address_8bit(uint16_t* address) {
-    switch ((uintptr_t)address) {
-        case STATUS_REGISTER_ADDRESS:
-            return (uint8_t)(register_values[0]);
-            break;
-        case STATUS_REGISTER_ADDRESS + 1:
-            return (uint8_t)(register_values[1]);
-            break;
-        case DATA_REGISTER_ADDRESS:
-            return (uint8_t)(register_values[2]);
-            break;
-        case DATA_REGISTER_ADDRESS + 1:
-            return (uint8_t)(register_values[3]);
-            break;
-        default:
-            return 0x00U;
+_Static_assert(REGISTER_BLOCK_BYTES <= UART_CHANNEL_STRIDE, "Register block overlaps the next channel's");
+
+#define REGISTER_BLOCK_INITIALISER { \
+    .values = { 1U << CTS_BIT, 0, 0, 0, UART_DEFAULT_RX_TRIGGER_LEVEL, UART_DEFAULT_TX_EMPTY_THRESHOLD }, \
+    .fifo_depth = UART_FIFO_DEFAULT_DEPTH }
+
+RegisterBlock register_blocks[UART_CHANNEL_COUNT] = {
+    REGISTER_BLOCK_INITIALISER, REGISTER_BLOCK_INITIALISER, REGISTER_BLOCK_INITIALISER, REGISTER_BLOCK_INITIALISER,
+    REGISTER_BLOCK_INITIALISER, REGISTER_BLOCK_INITIALISER, REGISTER_BLOCK_INITIALISER, REGISTER_BLOCK_INITIALISER
+};
+_Static_assert(UART_CHANNEL_COUNT <= 8, "Add more register block initialisers for the extra channels");
+
+_Atomic uint8_t are_interrupts_enabled = 0;
+
+static _Atomic InterruptHandler interrupt_vector_table[UART_CHANNEL_COUNT];
+
+// Works out which channel's register block an address falls in and where in the block it is.
+// Returns NULL if the address isn't in any channel's block.
+static RegisterBlock* decode_address(uintptr_t address, uintptr_t* offset) {
+    if (address < UART_BASE_ADDRESS) return NULL;
+    uintptr_t relative = address - UART_BASE_ADDRESS;
+    uintptr_t channel = relative / UART_CHANNEL_STRIDE;
+    if (channel >= UART_CHANNEL_COUNT) return NULL;
+    *offset = relative % UART_CHANNEL_STRIDE;
+    return &register_blocks[channel];
+}
+
+// Trigger levels are kept within what the FIFO can actually hold
+static void write_fifo_control(RegisterBlock* block, uintptr_t offset, uint8_t value) {
+    if (offset == FIFO_CONTROL_REGISTER_OFFSET) {
+        if (value == 0) value = 1;
+        if (value > block->fifo_depth) value = block->fifo_depth;
+        block->values[4] = value;
+    } else {
+        if (value >= block->fifo_depth) value = block->fifo_depth - 1;
+        block->values[5] = value;
     }
 }
 
-uint16_t read_address_16bit(uint16_t* address) {
-    switch ((uintptr_t)address) {
-        case STATUS_REGISTER_ADDRESS-1:
-            return (uint16_t)(register_values[0]<<8);
-            break;
-        case STATUS_REGISTER_ADDRESS:
-            return (uint16_t)((register_values[1]<<8) | (register_values[0]));
-            break;
-        case STATUS_REGISTER_ADDRESS + 1:
-            return (uint16_t)((register_values[2]<<8) | (register_values[1]));
-            break;
-        case DATA_REGISTER_ADDRESS:
-            return (uint16_t)((register_values[3]<<8) | (register_values[2]));
-            break;
-        case DATA_REGISTER_ADDRESS + 1:
-            return (uint16_t)(register_values[3]);
-            break;
+// Anything outside of the register bytes reads as 0
+static uint8_t read_register_byte(uintptr_t address) {
+    uintptr_t offset;
+    RegisterBlock* block = decode_address(address, &offset);
+    if (block == NULL) return 0x00U;
+    switch (offset) {
+        case STATUS_REGISTER_OFFSET:
+            return read_uart_status_low(block);
+        case DATA_REGISTER_OFFSET:
+            return read_uart_data(block);
+        case STATUS_REGISTER_OFFSET + 1:
+        case DATA_REGISTER_OFFSET + 1:
+        case FIFO_CONTROL_REGISTER_OFFSET:
+        case FIFO_CONTROL_REGISTER_OFFSET + 1:
+            return block->values[offset];
         default:
             return 0x00U;
     }
 }
 
+// Multi byte reads are little endian and may straddle registers (or run off the end of them)
+uint8_t read_address_8bit(uint16_t* address) {
+    return read_register_byte((uintptr_t)address);
+}
+
+uint16_t read_address_16bit(uint16_t* address) {
+    uintptr_t base = (uintptr_t)address;
+    uint16_t low = read_register_byte(base);
+    return (uint16_t)((read_register_byte(base + 1) << 8) | low);
+}
+
 uint32_t read_address_32bit(uint16_t* address) {
-    switch ((uintptr_t)address) {
-        case STATUS_REGISTER_ADDRESS-3:
-            return (uint32_t)(register_values[0]<<24);
-            break;
-        case STATUS_REGISTER_ADDRESS-2:
-            return (uint32_t)((register_values[1]<<24) | (register_values[0]<<16));
-            break;
-        case STATUS_REGISTER_ADDRESS-1:
-            return (uint32_t)((register_values[2]<<24) | (register_values[1]<<16) | (register_values[0]<<8));
-            break;
-        case STATUS_REGISTER_ADDRESS:
-            return (uint32_t)((register_values[3]<<24) | (register_values[2]<<16) | (register_values[1]<<8) | (register_values[0]));
-            break;
-        case STATUS_REGISTER_ADDRESS + 1:
-            return (uint32_t)((register_values[3]<<16) | (register_values[2]<<8) | (register_values[1]));
-            break;
-        case DATA_REGISTER_ADDRESS:
-            return (uint32_t)((register_values[3]<<8) | (register_values[2]));
-            break;
-        case DATA_REGISTER_ADDRESS + 1:
-            return (uint32_t)(register_values[3]);
-            break;
-        default:
-            return 0x00U;
-    }
+    uintptr_t base = (uintptr_t)address;
+    uintptr_t offset;
+    RegisterBlock* block = decode_address(base, &offset);
+    // A read at the status register is the combined status/data snapshot
+    if (block != NULL && offset == STATUS_REGISTER_OFFSET) return read_uart_status_and_data(block);
+    // Read lowest address first so that a combined status/data read sees the status before the pop
+    uint32_t value = read_register_byte(base);
+    value |= (uint32_t)read_register_byte(base + 1) << 8;
+    value |= (uint32_t)read_register_byte(base + 2) << 16;
+    value |= (uint32_t)read_register_byte(base + 3) << 24;
+    return value;
 }
 
 // Used generative AI to fill these out but had some slight adjustments
 // But I can explain that this is essentially acting to mask so that only writable bits are written to
 // And read only bits are left as is
-static void apply_status_write(uint16_t value) {
-    uint16_t current = (register_values[1] << 8) | register_values[0];
+static void apply_status_write(RegisterBlock* block, uint16_t value) {
+    TRACE_BEGIN();
+    uint16_t current = block->values[1] << 8;
     uint16_t new_val = (current & ~STATUS_WRITABLE_MASK) | (value & STATUS_WRITABLE_MASK);
-    register_values[0] = new_val & 0xFF;
-    register_values[1] = (new_val >> 8) & 0xFF;
+    block->values[1] = (new_val >> 8) & 0xFF;
+    TRACE_END(TRACE_WRITE_STATUS, register_block_channel(block), value);
+}
+
+// A write to the FIFO control register from the processor side, traced unlike the internal ones
+// configure_uart_fifo makes
+static void write_fifo_control_register(RegisterBlock* block, uintptr_t offset, uint8_t value) {
+    TRACE_BEGIN();
+    write_fifo_control(block, offset, value);
+    TRACE_END(TRACE_WRITE_FIFO_CONTROL, register_block_channel(block),
+        ((uint32_t)(offset - FIFO_CONTROL_REGISTER_OFFSET) << 8) | value);
 }
 
 void write_address_8bit(uint16_t* address, uint8_t value) {
-    switch ((uintptr_t)address) {
-        case STATUS_REGISTER_ADDRESS:
-            apply_status_write((register_values[1] << 8) | value);
+    uintptr_t offset;
+    RegisterBlock* block = decode_address((uintptr_t)address, &offset);
+    if (block == NULL) return;
+    switch (offset) {
+        case STATUS_REGISTER_OFFSET:
+            apply_status_write(block, (block->values[1] << 8) | value);
             break;
-        case STATUS_REGISTER_ADDRESS + 1:
-            apply_status_write((value << 8) | register_values[0]);
+        case STATUS_REGISTER_OFFSET + 1:
+            apply_status_write(block, value << 8);
             break;
-        case DATA_REGISTER_ADDRESS:
-            register_values[2] = value;
+        case DATA_REGISTER_OFFSET:
+            write_uart_data(block, value);
             break;
-        case DATA_REGISTER_ADDRESS + 1:
+        case DATA_REGISTER_OFFSET + 1:
             // register_values[3] = value;
-            register_values[3] = 0x00; 
+            block->values[3] = 0x00;
+            break;
+        case FIFO_CONTROL_REGISTER_OFFSET:
+        case FIFO_CONTROL_REGISTER_OFFSET + 1:
+            write_fifo_control_register(block, offset, value);
+            break;
+        case STATUS_SET_REGISTER_OFFSET + 1:
+            set_uart_status_bits(block, value << 8);
+            break;
+        case STATUS_CLEAR_REGISTER_OFFSET + 1:
+            clear_uart_status_bits(block, value << 8);
             break;
         default:
             // ignore invalid writes
@@ -119,14 +142,27 @@ void write_address_8bit(uint16_t* address, uint8_t value) {
 }
 
 void write_address_16bit(uint16_t* address, uint16_t value) {
-    switch ((uintptr_t)address) {
-        case STATUS_REGISTER_ADDRESS:
-            apply_status_write(value);
+    uintptr_t offset;
+    RegisterBlock* block = decode_address((uintptr_t)address, &offset);
+    if (block == NULL) return;
+    switch (offset) {
+        case STATUS_REGISTER_OFFSET:
+            apply_status_write(block, value);
             break;
-        case DATA_REGISTER_ADDRESS:
-            register_values[2] = value & 0xFF;
+        case DATA_REGISTER_OFFSET:
+            write_uart_data(block, value & 0xFF);
             // register_values[3] = (value >> 8) & 0xFF;
-            register_values[3] = 0x00; 
+            block->values[3] = 0x00;
+            break;
+        case FIFO_CONTROL_REGISTER_OFFSET:
+            write_fifo_control_register(block, FIFO_CONTROL_REGISTER_OFFSET, value & 0xFF);
+            write_fifo_control_register(block, FIFO_CONTROL_REGISTER_OFFSET + 1, (value >> 8) & 0xFF);
+            break;
+        case STATUS_SET_REGISTER_OFFSET:
+            set_uart_status_bits(block, value);
+            break;
+        case STATUS_CLEAR_REGISTER_OFFSET:
+            clear_uart_status_bits(block, value);
             break;
         default:
             // ignore invalid writes
@@ -135,13 +171,16 @@ void write_address_16bit(uint16_t* address, uint16_t value) {
 }
 
 void write_address_32bit(uint16_t* address, uint32_t value) {
-    switch ((uintptr_t)address) {
-        case STATUS_REGISTER_ADDRESS:
-            apply_status_write(value & 0xFFFF);
+    uintptr_t offset;
+    RegisterBlock* block = decode_address((uintptr_t)address, &offset);
+    if (block == NULL) return;
+    switch (offset) {
+        case STATUS_REGISTER_OFFSET:
+            apply_status_write(block, value & 0xFFFF);
             // Ignore writing to data register
             break;
-        case DATA_REGISTER_ADDRESS:
-            register_values[2] = value & 0xFF;
+        case DATA_REGISTER_OFFSET:
+            write_uart_data(block, value & 0xFF);
             break;
         default:
             // ignore invalid writes
@@ -149,42 +188,135 @@ void write_address_32bit(uint16_t* address, uint32_t value) {
     }
 }
 
-void display_register_status(void) {
-    printf("RX Register Not Empty: %d\n", register_values[0]&0x1);
-    printf("TX Register Not Full : %d\n", (register_values[0]>>1)&0x1);
-    printf("RX Error : %d\n", (register_values[0]>>2)&0x1);
-    printf("TX Enable : %d\n", (register_values[1]>>5)&0x1);
-    printf("RX Enable : %d\n", (register_values[1]>>6)&0x1);
-    printf("UART Interrupt Enable : %d\n", (register_values[1]>>7)&0x1);
+void display_register_status(uint8_t channel) {
+    if (channel >= UART_CHANNEL_COUNT) return;
+    RegisterBlock* block = &register_blocks[channel];
+    _Atomic uint8_t* register_values = block->values;
+    printf("RX Register Not Empty: %d\n", hardware_fifo_level(&block->rx_fifo) != 0);
+    printf("TX Register Not Full : %d\n", hardware_fifo_level(&block->tx_fifo) < block->fifo_depth);
+    printf("RX Error : %d\n", (register_values[0]>>RX_ERROR_BIT)&0x1);
+    printf("TX Interrupt Enable : %d\n", (register_values[1]>>(TX_INTERRUPT_ENABLE_BIT - 8))&0x1);
+    printf("TX Enable : %d\n", (register_values[1]>>(TX_ENABLE_BIT - 8))&0x1);
+    printf("RX Enable : %d\n", (register_values[1]>>(RX_ENABLE_BIT - 8))&0x1);
+    printf("UART Interrupt Enable : %d\n", (register_values[1]>>(INTERRUPT_ENABLE_BIT - 8))&0x1);
+    printf("RTS : %d, CTS : %d, Auto CTS : %d\n", (register_values[1]>>(RTS_BIT - 8))&0x1, (register_values[0]>>CTS_BIT)&0x1,
+        (register_values[1]>>(AUTO_CTS_ENABLE_BIT - 8))&0x1);
     printf("Global Interrupt Enable : %d\n", IS_INTERRUPT_ENABLED());
     printf("Data Register Data : Hex: %X, ascii: %c\n", register_values[2], register_values[2]);
+    printf("RX FIFO : %d/%d bytes, trigger level %d\n", hardware_fifo_level(&block->rx_fifo), block->fifo_depth, register_values[4]);
+    printf("TX FIFO : %d/%d bytes, empty threshold %d\n", hardware_fifo_level(&block->tx_fifo), block->fifo_depth, register_values[5]);
 }
 
-void set_rx_not_empty(uint8_t value) {
-    if (value == 0) {
-        register_values[0] &= ~(1U << RX_NOT_EMPTY_BIT);
+Status configure_uart_fifo(uint8_t channel, uint8_t depth) {
+    if (channel >= UART_CHANNEL_COUNT || depth == 0 || depth > UART_FIFO_MAX_DEPTH) return FAILURE;
+    RegisterBlock* block = &register_blocks[channel];
+    TRACE_BEGIN();
+    block->fifo_depth = depth;
+    // Pull the trigger levels back inside the new depth
+    write_fifo_control(block, FIFO_CONTROL_REGISTER_OFFSET, block->values[4]);
+    write_fifo_control(block, FIFO_CONTROL_REGISTER_OFFSET + 1, block->values[5]);
+    TRACE_END(TRACE_FIFO_DEPTH, channel, depth);
+    return SUCCESS;
+}
+
+uint8_t uart_interrupt_pending(uint8_t channel) {
+    if (channel >= UART_CHANNEL_COUNT) return 0;
+    RegisterBlock* block = &register_blocks[channel];
+    uint8_t control = block->values[1];
+    uint8_t pending = 0;
+    if (!((control >> (INTERRUPT_ENABLE_BIT - 8)) & 0x1)) return 0;
+
+    if ((control >> (RX_ENABLE_BIT - 8)) & 0x1) {
+        uint8_t rx_level = hardware_fifo_level(&block->rx_fifo);
+        if (((block->values[0] >> RX_ERROR_BIT) & 0x1) || rx_level >= block->values[4]
+            || (rx_level != 0 && block->rx_timeout)) {
+            pending |= RX_INTERRUPT_PENDING;
+        }
+    }
+    if (((control >> (TX_ENABLE_BIT - 8)) & 0x1) && ((control >> (TX_INTERRUPT_ENABLE_BIT - 8)) & 0x1)) {
+        if (hardware_fifo_level(&block->tx_fifo) <= block->values[5]) pending |= TX_INTERRUPT_PENDING;
+    }
+    return pending;
+}
+
+void set_interrupt_handler(uint8_t channel, InterruptHandler handler) {
+    if (channel >= UART_CHANNEL_COUNT) return;
+    interrupt_vector_table[channel] = handler;
+}
+
+uint8_t raise_pending_interrupt(uint8_t channel) {
+    if (channel >= UART_CHANNEL_COUNT || !IS_INTERRUPT_ENABLED()) return 0;
+    InterruptHandler handler = interrupt_vector_table[channel];
+    if (handler == NULL || !uart_interrupt_pending(channel)) return 0;
+    handler();
+    return 1;
+}
+
+Status peripheral_receive_byte(uint8_t channel, uint8_t value) {
+    if (channel >= UART_CHANNEL_COUNT) return FAILURE;
+    RegisterBlock* block = &register_blocks[channel];
+    Status status = SUCCESS;
+    TRACE_BEGIN();
+    if (hardware_fifo_push(&block->rx_fifo, block->fifo_depth, value) != SUCCESS) {
+        // Overrun, the byte is lost
+        block->values[0] |= (1U << RX_ERROR_BIT);
+        status = BUSY;
+    }
+    TRACE_END(TRACE_LINE_RECEIVE, channel, value);
+    return status;
+}
+
+Status peripheral_transmit_byte(uint8_t channel, uint8_t* value) {
+    if (channel >= UART_CHANNEL_COUNT || value == NULL) return FAILURE;
+    RegisterBlock* block = &register_blocks[channel];
+    if (((block->values[1] >> (AUTO_CTS_ENABLE_BIT - 8)) & 0x1) && !((block->values[0] >> CTS_BIT) & 0x1)) return BUSY;
+    TRACE_BEGIN();
+    Status status = hardware_fifo_pop(&block->tx_fifo, value);
+    if (status == SUCCESS) {
+        TRACE_END(TRACE_LINE_TRANSMIT, channel, *value);
     } else {
-        register_values[0] |= (1U << RX_NOT_EMPTY_BIT);
+        TRACE_CANCEL(); // The line polling an empty FIFO isn't worth recording
     }
-    
+    return status;
 }
 
-void set_tx_not_full(uint8_t value) {
-    if (value == 0) {
-        register_values[0] &= ~(1U << TX_NOT_FULL_BIT);
+void signal_rx_timeout(uint8_t channel) {
+    if (channel >= UART_CHANNEL_COUNT) return;
+    RegisterBlock* block = &register_blocks[channel];
+    TRACE_BEGIN();
+    if (hardware_fifo_level(&block->rx_fifo) != 0) {
+        block->rx_timeout = 1;
+        TRACE_END(TRACE_RX_TIMEOUT, channel, 1);
+    } else {
+        TRACE_CANCEL();
+    }
+}
+
+void peripheral_set_cts(uint8_t channel, uint8_t asserted) {
+    if (channel >= UART_CHANNEL_COUNT) return;
+    _Atomic uint8_t* register_values = register_blocks[channel].values;
+    TRACE_BEGIN();
+    if (asserted) {
+        register_values[0] |= (1U << CTS_BIT);
     } else {
-        register_values[0] |= (1U << TX_NOT_FULL_BIT);
+        register_values[0] &= ~(1U << CTS_BIT);
     }
+    TRACE_END(TRACE_LINE_CTS, channel, asserted != 0);
+}
+
+uint8_t peripheral_rts_asserted(uint8_t channel) {
+    if (channel >= UART_CHANNEL_COUNT) return 0;
+    return (register_blocks[channel].values[1] >> (RTS_BIT - 8)) & 0x1;
 }
 
-void set_rx_error(uint8_t value) {
+void set_rx_error(uint8_t channel, uint8_t value) {
+    if (channel >= UART_CHANNEL_COUNT) return;
+    _Atomic uint8_t* register_values = register_blocks[channel].values;
+    TRACE_BEGIN();
     if (value == 0) {
         register_values[0] &= ~(1U << RX_ERROR_BIT);
     } else {
         register_values[0] |= (1U << RX_ERROR_BIT);
     }
+    TRACE_END(TRACE_RX_ERROR, channel, value != 0);
 }
-
-void set_data_register(uint8_t value) {
-    register_values[2] = value;
-}
\ No newline at end of file
@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+#include "pty_bridge.h"
+#include "processor_interface.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+struct PtyBridge {
+    PtyBridgeConfig config;
+    pthread_t thread;
+    _Atomic uint8_t running;
+    int master;
+    int slave; // Kept open so the master never sees a hang up
+    char slave_path[64];
+    uint64_t start_ns;
+
+    // Only touched by the bridge thread. rx_buffer holds what was last read from the pty, from
+    // rx_start to rx_end still to go into the RX FIFO. tx_buffer holds what's come out of the TX
+    // FIFO and not been written to the pty yet.
+    uint8_t rx_buffer[PTY_BRIDGE_BUFFER_SIZE];
+    size_t rx_start;
+    size_t rx_end;
+    uint8_t tx_buffer[PTY_BRIDGE_BUFFER_SIZE];
+    size_t tx_length;
+    uint8_t xoff_received;
+
+    // Written by the bridge thread, read by anyone
+    _Atomic uint64_t rx_bytes;
+    _Atomic uint64_t tx_bytes;
+    _Atomic uint64_t pty_reads;
+    _Atomic uint64_t pty_writes;
+    _Atomic uint64_t interrupts_raised;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ULL + (uint64_t)time.tv_nsec;
+}
+
+// Single writer so no read modify write needed
+static inline void counter_add(_Atomic uint64_t* counter, uint64_t amount) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+// Everything read from the pty that the RX FIFO has room for goes in. Nothing is pushed into a full
+// FIFO, the rest waits in rx_buffer (and the host's writes wait in the pty) until the ISR has made
+// room. Returns 1 if anything moved.
+static uint8_t receive_from_pty(PtyBridge* bridge) {
+    PtyBridgeConfig* config = &bridge->config;
+    RegisterBlock* registers = uart_registers(config->channel);
+    if (bridge->rx_start == bridge->rx_end) {
+        ssize_t count = read(bridge->master, bridge->rx_buffer, sizeof(bridge->rx_buffer));
+        if (count > 0) {
+            bridge->rx_start = 0;
+            bridge->rx_end = (size_t)count;
+            counter_add(&bridge->pty_reads, 1);
+        }
+    }
+    size_t delivered = 0;
+    while (bridge->rx_start < bridge->rx_end && hardware_fifo_level(&registers->rx_fifo) < registers->fifo_depth
+        && !(config->hardware_flow_control && !peripheral_rts_asserted(config->channel)) && !bridge->xoff_received) {
+        if (peripheral_receive_byte(config->channel, bridge->rx_buffer[bridge->rx_start]) != SUCCESS) break;
+        bridge->rx_start++;
+        delivered++;
+    }
+    if (delivered != 0) {
+        counter_add(&bridge->rx_bytes, delivered);
+        return 1;
+    }
+    // The host has stopped sending for now, anything left below the trigger level needs the
+    // timeout to get it picked up
+    if (bridge->rx_start == bridge->rx_end && hardware_fifo_level(&registers->rx_fifo) != 0) signal_rx_timeout(config->channel);
+    return 0;
+}
+
+static uint8_t raise_interrupt(PtyBridge* bridge) {
+    if (!raise_pending_interrupt(bridge->config.channel)) return 0;
+    counter_add(&bridge->interrupts_raised, 1);
+    return 1;
+}
+
+// Empties the TX FIFO into tx_buffer, servicing the interrupt each time so the ISR refills it, until
+// the buffer is full or there's nothing more to send. Then writes as much of it to the pty as it will
+// take, so the pty gets blocks rather than a FIFO's worth at a time. While bytes are still coming in
+// from the pty (receiving) more are likely to follow these out, an echo say, so the write waits for
+// PTY_BRIDGE_WRITE_BATCH of them unless the receive side has gone quiet. Returns 1 if anything moved.
+static uint8_t transmit_to_pty(PtyBridge* bridge, uint8_t receiving) {
+    PtyBridgeConfig* config = &bridge->config;
+    uint8_t moved = 0;
+    uint8_t data;
+    do {
+        while (bridge->tx_length < sizeof(bridge->tx_buffer) && peripheral_transmit_byte(config->channel, &data) == SUCCESS) {
+            moved = 1;
+            if (config->software_flow_control && (data == UART_XON || data == UART_XOFF)) {
+                bridge->xoff_received = data == UART_XOFF;
+                continue;
+            }
+            bridge->tx_buffer[bridge->tx_length++] = data;
+        }
+    } while (bridge->tx_length < sizeof(bridge->tx_buffer) && raise_interrupt(bridge));
+    if (bridge->tx_length != 0 && (!receiving || bridge->tx_length >= PTY_BRIDGE_WRITE_BATCH)) {
+        ssize_t count = write(bridge->master, bridge->tx_buffer, bridge->tx_length);
+        if (count > 0) {
+            bridge->tx_length -= (size_t)count;
+            memmove(bridge->tx_buffer, &bridge->tx_buffer[count], bridge->tx_length);
+            counter_add(&bridge->tx_bytes, (uint64_t)count);
+            counter_add(&bridge->pty_writes, 1);
+            moved = 1;
+        }
+    }
+    return moved;
+}
+
+static void* bridge_thread(void* argument) {
+    PtyBridge* bridge = (PtyBridge*)argument;
+    while (atomic_load_explicit(&bridge->running, memory_order_acquire)) {
+        uint8_t receiving = receive_from_pty(bridge);
+        uint8_t moved = raise_interrupt(bridge);
+        moved |= transmit_to_pty(bridge, receiving);
+        moved |= receiving;
+        if (moved) continue;
+        // Nothing to do. Sleep until the host writes something (if there's room for it) or the pty
+        // can take what's waiting, looking again every so often for anything queued to transmit.
+        struct pollfd descriptor = { .fd = bridge->master, .events = 0 };
+        if (bridge->rx_start == bridge->rx_end) descriptor.events |= POLLIN;
+        if (bridge->tx_length != 0) descriptor.events |= POLLOUT;
+        poll(&descriptor, 1, PTY_BRIDGE_IDLE_POLL_MS);
+    }
+    return NULL;
+}
+
+// Empties the FIFOs and clears the line state that initialise_uart doesn't, so nothing left from
+// whatever ran on the channel before ends up on the pty
+static void reset_line(uint8_t channel) {
+    RegisterBlock* registers = uart_registers(channel);
+    uint8_t data;
+    while (hardware_fifo_pop(&registers->rx_fifo, &data) == SUCCESS) {
+    }
+    while (hardware_fifo_pop(&registers->tx_fifo, &data) == SUCCESS) {
+    }
+    registers->rx_timeout = 0;
+    set_rx_error(channel, 0);
+}
+
+static void close_pty(PtyBridge* bridge) {
+    if (bridge->slave >= 0) close(bridge->slave);
+    if (bridge->master >= 0) close(bridge->master);
+}
+
+// Sets up the master and opens the slave in raw mode, so nothing the host sends is echoed, buffered
+// up into lines or has its line endings changed
+static Status open_pty(PtyBridge* bridge) {
+    bridge->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (bridge->master < 0) return FAILURE;
+    if (grantpt(bridge->master) != 0 || unlockpt(bridge->master) != 0
+        || ptsname_r(bridge->master, bridge->slave_path, sizeof(bridge->slave_path)) != 0) {
+        return FAILURE;
+    }
+    bridge->slave = open(bridge->slave_path, O_RDWR | O_NOCTTY);
+    if (bridge->slave < 0) return FAILURE;
+    struct termios attributes;
+    if (tcgetattr(bridge->slave, &attributes) != 0) return FAILURE;
+    cfmakeraw(&attributes);
+    if (tcsetattr(bridge->slave, TCSANOW, &attributes) != 0) return FAILURE;
+    int flags = fcntl(bridge->master, F_GETFL);
+    if (flags < 0 || fcntl(bridge->master, F_SETFL, flags | O_NONBLOCK) != 0) return FAILURE;
+    return SUCCESS;
+}
+
+Status pty_bridge_start(const PtyBridgeConfig* config, PtyBridge** bridge) {
+    if (config == NULL || bridge == NULL || config->channel >= UART_CHANNEL_COUNT) return FAILURE;
+    PtyBridge* new_bridge = (PtyBridge*)calloc(1, sizeof(PtyBridge));
+    if (new_bridge == NULL) return FAILURE;
+    new_bridge->config = *config;
+    new_bridge->master = -1;
+    new_bridge->slave = -1;
+    if (open_pty(new_bridge) != SUCCESS) {
+        close_pty(new_bridge);
+        free(new_bridge);
+        return FAILURE;
+    }
+    atomic_init(&new_bridge->running, 1);
+    reset_line(config->channel);
+    if (config->hardware_flow_control) peripheral_set_cts(config->channel, 1);
+    new_bridge->start_ns = now_ns();
+    if (pthread_create(&new_bridge->thread, NULL, bridge_thread, new_bridge) != 0) {
+        close_pty(new_bridge);
+        free(new_bridge);
+        return FAILURE;
+    }
+    *bridge = new_bridge;
+    return SUCCESS;
+}
+
+void pty_bridge_stop(PtyBridge* bridge) {
+    if (bridge == NULL) return;
+    atomic_store_explicit(&bridge->running, 0, memory_order_release);
+    pthread_join(bridge->thread, NULL);
+    close_pty(bridge);
+    free(bridge);
+}
+
+const char* pty_bridge_slave_path(const PtyBridge* bridge) {
+    return bridge != NULL ? bridge->slave_path : NULL;
+}
+
+void pty_bridge_get_stats(PtyBridge* bridge, PtyBridgeStats* stats) {
+    if (bridge == NULL || stats == NULL) return;
+    stats->rx_bytes = atomic_load_explicit(&bridge->rx_bytes, memory_order_relaxed);
+    stats->tx_bytes = atomic_load_explicit(&bridge->tx_bytes, memory_order_relaxed);
+    stats->pty_reads = atomic_load_explicit(&bridge->pty_reads, memory_order_relaxed);
+    stats->pty_writes = atomic_load_explicit(&bridge->pty_writes, memory_order_relaxed);
+    stats->interrupts_raised = atomic_load_explicit(&bridge->interrupts_raised, memory_order_relaxed);
+    stats->elapsed_ns = now_ns() - bridge->start_ns;
+    double seconds = (double)stats->elapsed_ns / 1e9;
+    stats->rx_bytes_per_sec = seconds > 0 ? (double)stats->rx_bytes / seconds : 0;
+    stats->tx_bytes_per_sec = seconds > 0 ? (double)stats->tx_bytes / seconds : 0;
+}
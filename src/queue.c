@@ -1,78 +1,580 @@
 #include "queue.h"
 #include <stdlib.h>
+#include <string.h>
 #include "macros.h"
 
-Queue* initialise_queue(uint16_t max_queue_size) {
-    Queue* queue = (Queue*)malloc(sizeof(Queue));
+// The segment pool for elastic queues. Free segments are a lock-free stack with a tag in the top half
+// of the head so a segment taken and put back between another context's load and compare and swap
+// can't fool it. Segments that have never been handed out are taken off the end of the array
+// instead, so the pool needs no setting up.
+#define SEGMENT_NONE UINT32_MAX
+_Static_assert(QUEUE_SEGMENT_SIZE != 0 && (QUEUE_SEGMENT_SIZE & (QUEUE_SEGMENT_SIZE - 1)) == 0 && QUEUE_SEGMENT_SIZE <= 32768,
+    "QUEUE_SEGMENT_SIZE must be a power of two no bigger than 32768");
+
+typedef struct {
+    _Atomic uint32_t next; // Next in the queue's chain, or in the free list while it's free
+    uint8_t data[QUEUE_SEGMENT_SIZE];
+} QueueSegment;
+
+static QueueSegment segments[QUEUE_SEGMENT_COUNT];
+static _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t segments_head = SEGMENT_NONE;
+static _Atomic uint32_t segments_unused = 0; // Index of the first segment never handed out
+static _Atomic uint32_t segments_in_use = 0;
+
+static uint32_t acquire_segment(void) {
+    uint64_t head = atomic_load_explicit(&segments_head, memory_order_acquire);
+    uint32_t index = (uint32_t)head;
+    while (index != SEGMENT_NONE) {
+        uint32_t next = atomic_load_explicit(&segments[index].next, memory_order_relaxed);
+        uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+        if (atomic_compare_exchange_weak_explicit(&segments_head, &head, new_head, memory_order_acquire, memory_order_acquire)) break;
+        index = (uint32_t)head;
+    }
+    if (index == SEGMENT_NONE) {
+        uint32_t unused = atomic_load_explicit(&segments_unused, memory_order_relaxed);
+        do {
+            if (unused == QUEUE_SEGMENT_COUNT) return SEGMENT_NONE;
+        } while (!atomic_compare_exchange_weak_explicit(&segments_unused, &unused, unused + 1, memory_order_relaxed, memory_order_relaxed));
+        index = unused;
+    }
+    atomic_fetch_add_explicit(&segments_in_use, 1, memory_order_relaxed);
+    atomic_store_explicit(&segments[index].next, SEGMENT_NONE, memory_order_relaxed);
+    return index;
+}
+
+static void release_segment(uint32_t index) {
+    atomic_fetch_sub_explicit(&segments_in_use, 1, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&segments_head, memory_order_relaxed);
+    uint64_t new_head;
+    do {
+        atomic_store_explicit(&segments[index].next, (uint32_t)head, memory_order_relaxed);
+        new_head = (((head >> 32) + 1) << 32) | index;
+    } while (!atomic_compare_exchange_weak_explicit(&segments_head, &head, new_head, memory_order_release, memory_order_relaxed));
+}
+
+// Gives back a segment and everything chained after it
+static void release_chain(uint32_t segment) {
+    while (segment != SEGMENT_NONE) {
+        uint32_t next = atomic_load_explicit(&segments[segment].next, memory_order_relaxed);
+        release_segment(segment);
+        segment = next;
+    }
+}
+
+size_t queue_segments_free(void) {
+    return QUEUE_SEGMENT_COUNT - atomic_load_explicit(&segments_in_use, memory_order_relaxed);
+}
+
+// Power of two so that wrapping is a mask rather than a divide, and small enough that the free
+// running indices can still tell a full queue from an empty one
+static uint8_t is_valid_capacity(uint16_t capacity) {
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0) return 0;
+    if (capacity > QUEUE_MAX_CAPACITY) return 0;
+#ifdef QUEUE_FIXED_CAPACITY
+    if (capacity != QUEUE_FIXED_CAPACITY) return 0;
+#endif
+    return 1;
+}
+
+// Resets everything but the storage
+static void reset_queue(Queue* queue, uint8_t* storage, _Atomic queue_count_t* commits, _Atomic uint8_t* message_ends,
+    uint16_t capacity) {
+    queue->data = storage;
+    queue->commits = commits;
+    queue->message_ends = message_ends;
+    atomic_init(&queue->front, 0);
+    atomic_init(&queue->rear, 0);
+    atomic_init(&queue->reserved, 0);
+    queue->cached_front = 0;
+    queue->cached_rear = 0;
+    queue->array_length = capacity;
+    queue->mask = capacity - 1;
+    queue->spill_limit = 0;
+    atomic_init(&queue->spill_state, SPILL_CLOSED);
+    atomic_init(&queue->spill_first, SEGMENT_NONE);
+    atomic_init(&queue->spill_consumed, 0);
+    queue->spill_head = SEGMENT_NONE;
+    queue->spill_head_start = 0;
+    queue->spill_tail = SEGMENT_NONE;
+    queue->spill_tail_used = 0;
+    queue->spilling = 0;
+    if (commits != NULL) {
+        for (size_t i = 0; i < capacity; i++) atomic_init(&commits[i], 0);
+        for (size_t i = 0; i < QUEUE_MESSAGE_ENDS_SIZE(capacity); i++) atomic_init(&message_ends[i], 0);
+    }
+}
+
+static Queue* allocate_queue(uint16_t max_queue_size, uint8_t shared) {
+    if (!is_valid_capacity(max_queue_size)) return NULL;
+
+    // The struct is cache line aligned so needs aligned_alloc rather than malloc
+    Queue* queue = (Queue*)aligned_alloc(CACHE_LINE_SIZE, sizeof(Queue));
     if (queue == NULL) return NULL;
     uint8_t* data = (uint8_t*)malloc(max_queue_size*sizeof(uint8_t));
-    if (data == NULL) {
+    _Atomic queue_count_t* commits = NULL;
+    _Atomic uint8_t* message_ends = NULL;
+    if (shared) {
+        commits = (_Atomic queue_count_t*)malloc(max_queue_size * sizeof(*commits));
+        message_ends = (_Atomic uint8_t*)malloc(QUEUE_MESSAGE_ENDS_SIZE(max_queue_size));
+    }
+    if (data == NULL || (shared && (commits == NULL || message_ends == NULL))) {
+        free((void*)message_ends);
+        free((void*)commits);
+        free(data);
         free(queue);
         return NULL;
     }
-    queue->data = data;
-    queue->front = 0;
-    queue->rear = 0;
-    queue->size = 0;
-    queue->array_length = max_queue_size;
-    pthread_mutex_init(&queue->mutex, NULL);
+    reset_queue(queue, data, commits, message_ends, max_queue_size);
     return queue;
 }
 
+Queue* initialise_queue(uint16_t max_queue_size) {
+    return allocate_queue(max_queue_size, 0);
+}
+
+Queue* initialise_shared_queue(uint16_t max_queue_size) {
+    return allocate_queue(max_queue_size, 1);
+}
+
+Status initialise_static_queue(Queue* queue, uint8_t* storage, uint16_t capacity) {
+    if (queue == NULL || storage == NULL || !is_valid_capacity(capacity)) return FAILURE;
+    reset_queue(queue, storage, NULL, NULL, capacity);
+    return SUCCESS;
+}
+
+Status initialise_static_shared_queue(Queue* queue, uint8_t* storage, _Atomic queue_count_t* commits,
+    _Atomic uint8_t* message_ends, uint16_t capacity) {
+    if (queue == NULL || storage == NULL || commits == NULL || message_ends == NULL || !is_valid_capacity(capacity)) return FAILURE;
+    reset_queue(queue, storage, commits, message_ends, capacity);
+    return SUCCESS;
+}
+
 void delete_queue(Queue* queue) {
-    pthread_mutex_destroy(&queue->mutex);
+    if (queue == NULL) return;
+    queue_release_segments(queue);
+    free((void*)queue->message_ends);
+    free((void*)queue->commits);
     free(queue->data);
     free(queue);
 }
 
+Status queue_set_elastic(Queue* queue, size_t burst_size) {
+    if (queue == NULL || queue->commits != NULL || burst_size % QUEUE_SEGMENT_SIZE != 0) return FAILURE;
+    if (burst_size > (size_t)QUEUE_SEGMENT_SIZE * QUEUE_SEGMENT_COUNT) return FAILURE;
+    queue->spill_limit = (uint32_t)burst_size;
+    return SUCCESS;
+}
+
+void queue_release_segments(Queue* queue) {
+    if (queue == NULL) return;
+    uint32_t state = atomic_load(&queue->spill_state);
+    if ((state & SPILL_CLOSED) == 0) {
+        // The consumer may not have picked the chain up yet
+        release_chain(queue->spill_head != SEGMENT_NONE ? queue->spill_head : atomic_load(&queue->spill_first));
+        atomic_store(&queue->spill_state, SPILL_CLOSED | (state & SPILL_COUNT_MASK));
+        atomic_store(&queue->spill_consumed, state & SPILL_COUNT_MASK);
+    }
+    queue->spill_head = SEGMENT_NONE;
+    queue->spilling = 0;
+}
+
+// Producer side of an elastic queue whose own storage was full, adds the byte to the chain. Until
+// the consumer closes the chain the producer marks it busy while adding to it, so the consumer can't
+// close it and give the tail back with a byte half written into it.
+static Status spill(Queue* queue, uint8_t data) {
+    if (!queue->spilling) {
+        // Start a chain, the consumer picks up the first segment when it sees it's open
+        uint32_t segment = acquire_segment();
+        if (segment == SEGMENT_NONE) return BUSY;
+        segments[segment].data[0] = data;
+        queue->spill_tail = segment;
+        queue->spill_tail_used = 1;
+        queue->spilling = 1;
+        uint32_t count = atomic_load_explicit(&queue->spill_state, memory_order_relaxed) & SPILL_COUNT_MASK;
+        atomic_store_explicit(&queue->spill_first, segment, memory_order_relaxed);
+        atomic_store_explicit(&queue->spill_state, (count + 1) & SPILL_COUNT_MASK, memory_order_release);
+        return SUCCESS;
+    }
+
+    uint32_t state = atomic_load_explicit(&queue->spill_state, memory_order_relaxed);
+    if ((state & SPILL_CLOSED) != 0
+        || !atomic_compare_exchange_strong_explicit(&queue->spill_state, &state, state | SPILL_BUSY, memory_order_acquire, memory_order_relaxed)) {
+        // Only the consumer changes it, to close it, so the chain has been drained and given back.
+        // Back to the queue's own storage, which is empty by now.
+        queue->spilling = 0;
+        return enqueue(queue, data);
+    }
+    uint32_t count = state & SPILL_COUNT_MASK;
+    if (queue->spill_tail_used == QUEUE_SEGMENT_SIZE) {
+        // The tail is full, chain on another segment if the queue is allowed one
+        uint32_t chained = (count - atomic_load_explicit(&queue->spill_consumed, memory_order_relaxed)) & SPILL_COUNT_MASK;
+        uint32_t segment = chained + QUEUE_SEGMENT_SIZE <= queue->spill_limit ? acquire_segment() : SEGMENT_NONE;
+        if (segment == SEGMENT_NONE) {
+            atomic_store_explicit(&queue->spill_state, state, memory_order_relaxed);
+            return BUSY;
+        }
+        atomic_store_explicit(&segments[queue->spill_tail].next, segment, memory_order_relaxed);
+        queue->spill_tail = segment;
+        queue->spill_tail_used = 0;
+    }
+    segments[queue->spill_tail].data[queue->spill_tail_used++] = data;
+    // Release so the consumer sees the byte and any new segment before the count
+    atomic_store_explicit(&queue->spill_state, (count + 1) & SPILL_COUNT_MASK, memory_order_release);
+    return SUCCESS;
+}
+
+// Consumer side of an elastic queue. The number of chained bytes that come after the first
+// ring_length bytes of the queue's own storage, 0 if there's no chain or the producer has gone back
+// to its own storage. A drained chain is closed and its last segment given back here.
+static uint32_t chain_available(Queue* queue, queue_index_t ring_length) {
+    if (queue->spill_limit == 0) return 0;
+    uint32_t state = atomic_load_explicit(&queue->spill_state, memory_order_acquire);
+    if ((state & SPILL_CLOSED) != 0) return 0;
+    if (queue->spill_head == SEGMENT_NONE) {
+        queue->spill_head = atomic_load_explicit(&queue->spill_first, memory_order_relaxed);
+        queue->spill_head_start = atomic_load_explicit(&queue->spill_consumed, memory_order_relaxed);
+    }
+    uint32_t consumed = atomic_load_explicit(&queue->spill_consumed, memory_order_relaxed);
+    uint32_t available = ((state & SPILL_COUNT_MASK) - consumed) & SPILL_COUNT_MASK;
+    if (available == 0) {
+        // Can't close while the producer is part way through adding a byte, the next look will
+        if ((state & SPILL_BUSY) == 0 && atomic_compare_exchange_strong_explicit(&queue->spill_state, &state,
+            state | SPILL_CLOSED, memory_order_relaxed, memory_order_relaxed)) {
+            release_chain(queue->spill_head);
+            queue->spill_head = SEGMENT_NONE;
+        }
+        return 0;
+    }
+    // The producer stopped using its own storage before it opened the chain, so once the chain's
+    // been seen the rear can't have moved past the bytes that come before it
+    queue_index_t front = atomic_load_explicit(&queue->front, memory_order_relaxed);
+    queue->cached_rear = atomic_load_explicit(&queue->rear, memory_order_acquire);
+    if ((queue_index_t)(queue->cached_rear - front) != ring_length) return 0;
+    return available;
+}
+
+// The contiguous run of chained bytes starting skip bytes into the chain, out of available
+static void chain_span(Queue* queue, uint32_t skip, uint32_t available, QueueSpan* span) {
+    uint32_t consumed = atomic_load_explicit(&queue->spill_consumed, memory_order_relaxed);
+    uint32_t position = (consumed + skip - queue->spill_head_start) & SPILL_COUNT_MASK;
+    uint32_t segment = queue->spill_head;
+    for (; position >= QUEUE_SEGMENT_SIZE; position -= QUEUE_SEGMENT_SIZE) {
+        segment = atomic_load_explicit(&segments[segment].next, memory_order_relaxed);
+    }
+    size_t size = QUEUE_SEGMENT_SIZE - position;
+    span->data = &segments[segment].data[position];
+    span->size = size < available - skip ? size : available - skip;
+}
+
+// Takes count bytes off the chain, giving back every segment that's been finished with and has one
+// after it. The last segment is the producer's until the chain is closed.
+static void chain_consume(Queue* queue, uint32_t count) {
+    uint32_t consumed = (atomic_load_explicit(&queue->spill_consumed, memory_order_relaxed) + count) & SPILL_COUNT_MASK;
+    while (((consumed - queue->spill_head_start) & SPILL_COUNT_MASK) >= QUEUE_SEGMENT_SIZE) {
+        uint32_t next = atomic_load_explicit(&segments[queue->spill_head].next, memory_order_relaxed);
+        if (next == SEGMENT_NONE) break;
+        release_segment(queue->spill_head);
+        queue->spill_head = next;
+        queue->spill_head_start = (queue->spill_head_start + QUEUE_SEGMENT_SIZE) & SPILL_COUNT_MASK;
+    }
+    atomic_store_explicit(&queue->spill_consumed, consumed, memory_order_release);
+    // Closes it straight away if that was the last of it
+    chain_available(queue, 0);
+}
+
+// Copies up to size chained bytes out, for when the queue's own storage is empty
+static size_t chain_read(Queue* queue, uint8_t* data, size_t size) {
+    uint32_t available = chain_available(queue, 0);
+    size_t count = size < available ? size : available;
+    size_t copied = 0;
+    while (copied < count) {
+        QueueSpan span;
+        chain_span(queue, (uint32_t)copied, (uint32_t)count, &span);
+        memcpy(data + copied, span.data, span.size);
+        copied += span.size;
+    }
+    if (count != 0) chain_consume(queue, (uint32_t)count);
+    return count;
+}
+
 Status dequeue(Queue* queue, uint8_t* data) {
     if (queue == NULL || data == NULL) return FAILURE;
-    pthread_mutex_lock(&queue->mutex);
-    if (queue->size == 0) {
-        pthread_mutex_unlock(&queue->mutex);
-        return EMPTY;
+    queue_index_t front = atomic_load_explicit(&queue->front, memory_order_relaxed);
+    if (front == queue->cached_rear) {
+        // Only go and look at the producer's cache line if we've run out of known data
+        queue->cached_rear = atomic_load_explicit(&queue->rear, memory_order_acquire);
+        if (front == queue->cached_rear) return chain_read(queue, data, 1) == 1 ? SUCCESS : EMPTY;
     }
-    *data = queue->data[queue->front]; 
-    queue->front = (queue->front + 1) % queue->array_length;
-    queue->size--;
-    pthread_mutex_unlock(&queue->mutex);
+    *data = queue->data[front & QUEUE_MASK(queue)];
+    // Release so that the producer can't overwrite the slot before we've read it
+    atomic_store_explicit(&queue->front, front + 1, memory_order_release);
     return SUCCESS;
 }
 
 Status enqueue(Queue* queue, uint8_t data) {
     if (queue == NULL) return FAILURE;
-    pthread_mutex_lock(&queue->mutex);
-    if (queue->size == queue->array_length) {
-        pthread_mutex_unlock(&queue->mutex);
-        return BUSY;
-    }
-    queue->data[queue->rear] = data;
-    queue->rear = (queue->rear + 1) % queue->array_length;
-    queue->size++;
-    pthread_mutex_unlock(&queue->mutex);
+    // Everything goes on the end of the chain until the consumer has drained it
+    if (queue->spilling) return spill(queue, data);
+    queue_index_t rear = atomic_load_explicit(&queue->rear, memory_order_relaxed);
+    if ((queue_index_t)(rear - queue->cached_front) == QUEUE_CAPACITY(queue)) {
+        // Only go and look at the consumer's cache line if we think the queue is full
+        queue->cached_front = atomic_load_explicit(&queue->front, memory_order_acquire);
+        if ((queue_index_t)(rear - queue->cached_front) == QUEUE_CAPACITY(queue)) {
+            return queue->spill_limit != 0 ? spill(queue, data) : BUSY;
+        }
+    }
+    queue->data[rear & QUEUE_MASK(queue)] = data;
+    // Release so that the consumer sees the data before it sees the new rear
+    atomic_store_explicit(&queue->rear, rear + 1, memory_order_release);
+    return SUCCESS;
+}
+
+// Free space as seen by the producer, only refreshing the cached front if there isn't enough
+static queue_index_t producer_space(Queue* queue, queue_index_t rear, size_t wanted) {
+    queue_index_t space = QUEUE_CAPACITY(queue) - (queue_index_t)(rear - queue->cached_front);
+    if (space < wanted) {
+        queue->cached_front = atomic_load_explicit(&queue->front, memory_order_acquire);
+        space = QUEUE_CAPACITY(queue) - (queue_index_t)(rear - queue->cached_front);
+    }
+    return space;
+}
+
+// Readable bytes as seen by the consumer, only refreshing the cached rear if there aren't enough
+static queue_index_t consumer_available(Queue* queue, queue_index_t front, size_t wanted) {
+    queue_index_t available = queue->cached_rear - front;
+    if (available < wanted) {
+        queue->cached_rear = atomic_load_explicit(&queue->rear, memory_order_acquire);
+        available = queue->cached_rear - front;
+    }
+    return available;
+}
+
+// Splits count bytes starting at index into the part before the end of the array and the part
+// that wraps around to the start
+static void split_spans(Queue* queue, queue_index_t index, size_t count, QueueSpan* first, QueueSpan* second) {
+    size_t offset = index & QUEUE_MASK(queue);
+    size_t first_size = QUEUE_CAPACITY(queue) - offset;
+    if (first_size > count) first_size = count;
+    first->data = &queue->data[offset];
+    first->size = first_size;
+    second->data = queue->data;
+    second->size = count - first_size;
+}
+
+Status enqueue_bulk(Queue* queue, const uint8_t* data, size_t size, size_t* bytes_written) {
+    if (bytes_written != NULL) *bytes_written = 0;
+    if (queue == NULL || (data == NULL && size != 0)) return FAILURE;
+    if (size == 0) return SUCCESS;
+    if (queue->spill_limit != 0) {
+        // Elastic queues go a byte at a time so that the bytes that don't fit carry on into the chain
+        size_t count = 0;
+        while (count < size && enqueue(queue, data[count]) == SUCCESS) count++;
+        if (bytes_written != NULL) *bytes_written = count;
+        return count == 0 ? BUSY : SUCCESS;
+    }
+    queue_index_t rear = atomic_load_explicit(&queue->rear, memory_order_relaxed);
+    queue_index_t space = producer_space(queue, rear, size);
+    if (space == 0) return BUSY;
+    size_t count = size < space ? size : space;
+
+    QueueSpan first, second;
+    split_spans(queue, rear, count, &first, &second);
+    memcpy(first.data, data, first.size);
+    memcpy(second.data, data + first.size, second.size);
+
+    atomic_store_explicit(&queue->rear, rear + (queue_index_t)count, memory_order_release);
+    if (bytes_written != NULL) *bytes_written = count;
+    return SUCCESS;
+}
+
+Status dequeue_bulk(Queue* queue, uint8_t* data, size_t size, size_t* bytes_read) {
+    if (bytes_read != NULL) *bytes_read = 0;
+    if (queue == NULL || (data == NULL && size != 0)) return FAILURE;
+    if (size == 0) return SUCCESS;
+    queue_index_t front = atomic_load_explicit(&queue->front, memory_order_relaxed);
+    queue_index_t available = consumer_available(queue, front, size);
+    size_t count = size < available ? size : available;
+    if (count != 0) {
+        QueueSpan first, second;
+        split_spans(queue, front, count, &first, &second);
+        memcpy(data, first.data, first.size);
+        memcpy(data + first.size, second.data, second.size);
+        atomic_store_explicit(&queue->front, front + (queue_index_t)count, memory_order_release);
+    }
+    // Anything chained comes after all of the queue's own storage
+    if (count < size && queue->spill_limit != 0) count += chain_read(queue, data + count, size - count);
+
+    if (bytes_read != NULL) *bytes_read = count;
+    return count == 0 ? EMPTY : SUCCESS;
+}
+
+Status queue_reserve(Queue* queue, size_t size, QueueSpan* first, QueueSpan* second) {
+    if (queue == NULL || first == NULL || second == NULL) return FAILURE;
+    if (size > QUEUE_CAPACITY(queue)) return FAILURE; // Would never fit, however long the caller waited
+    if (queue->spilling) return BUSY; // Can't go ahead of what's chained
+    queue_index_t rear = atomic_load_explicit(&queue->rear, memory_order_relaxed);
+    if (producer_space(queue, rear, size) < size) return BUSY;
+    split_spans(queue, rear, size, first, second);
+    return SUCCESS;
+}
+
+Status queue_commit(Queue* queue, size_t size) {
+    if (queue == NULL) return FAILURE;
+    queue_index_t rear = atomic_load_explicit(&queue->rear, memory_order_relaxed);
+    // Can't commit more than was (or could have been) reserved
+    if (producer_space(queue, rear, size) < size) return FAILURE;
+    atomic_store_explicit(&queue->rear, rear + (queue_index_t)size, memory_order_release);
+    return SUCCESS;
+}
+
+Status queue_peek(Queue* queue, QueueSpan* first, QueueSpan* second) {
+    if (queue == NULL || first == NULL || second == NULL) return FAILURE;
+    queue_index_t front = atomic_load_explicit(&queue->front, memory_order_relaxed);
+    // Always refresh here, the caller wants to see everything that's there
+    queue_index_t available = consumer_available(queue, front, QUEUE_CAPACITY(queue));
+    split_spans(queue, front, available, first, second);
+    if (available == 0 && queue->spill_limit != 0) {
+        // The queue's own storage is empty so show the chain instead
+        uint32_t chained = chain_available(queue, 0);
+        if (chained == 0) return EMPTY;
+        chain_span(queue, 0, chained, first);
+        second->size = 0;
+        if (first->size < chained) chain_span(queue, (uint32_t)first->size, chained, second);
+        return SUCCESS;
+    }
+    return available == 0 ? EMPTY : SUCCESS;
+}
+
+Status queue_consume(Queue* queue, size_t size) {
+    if (queue == NULL) return FAILURE;
+    queue_index_t front = atomic_load_explicit(&queue->front, memory_order_relaxed);
+    queue_index_t available = consumer_available(queue, front, size);
+    if (available >= size) {
+        atomic_store_explicit(&queue->front, front + (queue_index_t)size, memory_order_release);
+        return SUCCESS;
+    }
+    // The rest has to be chained
+    if (queue->spill_limit == 0 || chain_available(queue, available) < size - available) return FAILURE;
+    atomic_store_explicit(&queue->front, front + available, memory_order_release);
+    chain_consume(queue, (uint32_t)(size - available));
+    return SUCCESS;
+}
+
+Status queue_peek_at(Queue* queue, size_t offset, QueueSpan* span) {
+    if (queue == NULL || span == NULL) return FAILURE;
+    queue_index_t front = atomic_load_explicit(&queue->front, memory_order_relaxed);
+    queue_index_t available = consumer_available(queue, front, QUEUE_CAPACITY(queue));
+    if (offset < available) {
+        QueueSpan second;
+        split_spans(queue, front + (queue_index_t)offset, available - offset, span, &second);
+        return SUCCESS;
+    }
+    uint32_t chained = chain_available(queue, available);
+    if (offset - available >= chained) {
+        span->size = 0;
+        return EMPTY;
+    }
+    chain_span(queue, (uint32_t)(offset - available), chained, span);
+    return SUCCESS;
+}
+
+Status queue_reserve_shared(Queue* queue, size_t size, QueueReservation* reservation) {
+    if (queue == NULL || reservation == NULL || queue->commits == NULL) return FAILURE;
+    if (size == 0 || size > QUEUE_CAPACITY(queue)) return FAILURE;
+    queue_index_t start = atomic_load_explicit(&queue->reserved, memory_order_relaxed);
+    do {
+        // Acquire so the consumer has finished with the bytes before they're handed out again. A
+        // stale front only makes the space look smaller than it is.
+        queue_index_t front = atomic_load_explicit(&queue->front, memory_order_acquire);
+        if ((queue_index_t)(QUEUE_CAPACITY(queue) - (queue_index_t)(start - front)) < size) return BUSY;
+    } while (!atomic_compare_exchange_weak_explicit(&queue->reserved, &start, start + (queue_index_t)size,
+        memory_order_relaxed, memory_order_relaxed));
+    reservation->start = start;
+    reservation->size = (queue_index_t)size;
+    split_spans(queue, start, size, &reservation->spans[0], &reservation->spans[1]);
+    return SUCCESS;
+}
+
+Status queue_commit_shared(Queue* queue, const QueueReservation* reservation) {
+    if (queue == NULL || reservation == NULL || queue->commits == NULL || reservation->size == 0) return FAILURE;
+    // The consumer clears the bit before it lets go of the byte, so nothing else is using it
+    queue_index_t last = (reservation->start + reservation->size - 1) & QUEUE_MASK(queue);
+    atomic_fetch_or_explicit(&queue->message_ends[last >> 3], (uint8_t)(1U << (last & 7)), memory_order_relaxed);
+
+    // Mark this message as done. Everything from here on is seq_cst so that either this producer
+    // sees rear reach its message below, or whoever moves rear there sees the mark.
+    atomic_store(&queue->commits[reservation->start & QUEUE_MASK(queue)], (queue_count_t)reservation->size);
+
+    // Publish from rear for as long as the message there is done, which may be this one, ones
+    // reserved after it that finished first, or nothing if the one at rear is still being written
+    queue_index_t rear = atomic_load(&queue->rear);
+    for (;;) {
+        queue_count_t size = atomic_exchange(&queue->commits[rear & QUEUE_MASK(queue)], 0);
+        if (size == 0) break;
+        queue_index_t expected = rear;
+        if (atomic_compare_exchange_strong(&queue->rear, &expected, rear + (queue_index_t)size)) {
+            rear += (queue_index_t)size;
+            continue;
+        }
+        // rear was stale and had already been moved past this slot, so the mark belongs to a later
+        // message that's using the same slot. Put it back and start again from where rear really is.
+        atomic_store(&queue->commits[rear & QUEUE_MASK(queue)], size);
+        rear = atomic_load(&queue->rear);
+    }
+    return SUCCESS;
+}
+
+size_t queue_free_space(Queue* queue) {
+    if (queue == NULL) return 0;
+    queue_index_t front = atomic_load_explicit(&queue->front, memory_order_acquire);
+    queue_index_t end = queue->commits != NULL ? atomic_load_explicit(&queue->reserved, memory_order_acquire)
+        : atomic_load_explicit(&queue->rear, memory_order_acquire);
+    queue_index_t used = end - front;
+    return used > QUEUE_CAPACITY(queue) ? 0 : QUEUE_CAPACITY(queue) - used;
+}
+
+Status dequeue_shared(Queue* queue, uint8_t* data, uint8_t* message_end) {
+    if (queue == NULL || data == NULL || message_end == NULL || queue->message_ends == NULL) return FAILURE;
+    queue_index_t front = atomic_load_explicit(&queue->front, memory_order_relaxed);
+    if (front == queue->cached_rear) {
+        queue->cached_rear = atomic_load_explicit(&queue->rear, memory_order_acquire);
+        if (front == queue->cached_rear) return EMPTY;
+    }
+    queue_index_t slot = front & QUEUE_MASK(queue);
+    *data = queue->data[slot];
+    // The bit was set before the message was committed, so acquiring rear above makes it visible.
+    // Producers share the byte of bits so clearing one has to be atomic.
+    uint8_t bit = (uint8_t)(1U << (slot & 7));
+    *message_end = (atomic_load_explicit(&queue->message_ends[slot >> 3], memory_order_relaxed) & bit) != 0;
+    if (*message_end) atomic_fetch_and_explicit(&queue->message_ends[slot >> 3], (uint8_t)~bit, memory_order_relaxed);
+    atomic_store_explicit(&queue->front, front + 1, memory_order_release);
     return SUCCESS;
 }
 
 uint8_t is_queue_full(Queue* queue) {
     if (queue == NULL) return 2; // Error
-    pthread_mutex_lock(&queue->mutex);
-    if (queue->size == queue->array_length) { // Queue Full
-        pthread_mutex_unlock(&queue->mutex);
-        return 1;
-    } else { // Queue not full
-        pthread_mutex_unlock(&queue->mutex);
-        return 0;
-    }
+    return queue_length(queue) >= QUEUE_CAPACITY(queue) + (size_t)queue->spill_limit;
 }
 
 uint8_t is_queue_empty(Queue* queue) {
     if (queue == NULL) return 2; // Error
-    pthread_mutex_lock(&queue->mutex);
-    if (queue->size == 0) { // Queue Empty
-        pthread_mutex_unlock(&queue->mutex);
-        return 1;
-    } else { // Queue not full
-        pthread_mutex_unlock(&queue->mutex);
-        return 0;
+    return queue_length(queue) == 0;
+}
+
+size_t queue_length(Queue* queue) {
+    if (queue == NULL) return 0;
+    // Read front first, the rear can only move further away from it so this never underflows.
+    // Both sides may move between the two loads though, so clamp to the capacity
+    queue_index_t front = atomic_load_explicit(&queue->front, memory_order_acquire);
+    queue_index_t rear = atomic_load_explicit(&queue->rear, memory_order_acquire);
+    queue_index_t length = rear - front;
+    size_t total = length > QUEUE_CAPACITY(queue) ? QUEUE_CAPACITY(queue) : length;
+    if (queue->spill_limit != 0) {
+        // Plus whatever is chained, read the same way round
+        uint32_t consumed = atomic_load_explicit(&queue->spill_consumed, memory_order_acquire);
+        uint32_t state = atomic_load_explicit(&queue->spill_state, memory_order_acquire);
+        uint32_t chained = ((state & SPILL_COUNT_MASK) - consumed) & SPILL_COUNT_MASK;
+        if ((state & SPILL_CLOSED) == 0) total += chained > queue->spill_limit ? queue->spill_limit : chained;
     }
-}
\ No newline at end of file
+    return total;
+}
@@ -0,0 +1,378 @@
+#define _POSIX_C_SOURCE 200809L
+#include "simulator.h"
+#include <string.h>
+#include <time.h>
+#include "processor_interface.h"
+
+#define RX_TIMEOUT_CHARACTERS 4 // Idle character times before an RX timeout, same as a 16550
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+typedef enum {
+    EVENT_RX_CHARACTER, // The next byte from the far end finishes arriving
+    EVENT_RX_TIMEOUT, // Time to see if the line has been idle long enough
+    EVENT_TX_CHARACTER, // The transmitter takes the next byte out of the TX FIFO
+    EVENT_ISR,
+    EVENT_READ,
+    EVENT_WRITE,
+    EVENT_TYPE_COUNT
+} EventType;
+
+typedef struct {
+    uint64_t time;
+    uint64_t sequence; // Order it was scheduled in, so that ties always come out the same way
+    uint8_t type;
+    uint8_t channel; // Index into the config's channels
+} Event;
+
+typedef struct {
+    const SimulatorChannelConfig* config;
+    SimulatorChannelResult* result;
+    UartHandle uart;
+    uint64_t character_ns;
+    uint32_t isr_latency_ns;
+    uint8_t hardware_flow_control;
+    uint8_t software_flow_control;
+    uint8_t xoff_received;
+    uint32_t rx_message_left;
+    uint64_t last_receive_ns;
+    uint64_t rx_busy_ns;
+    uint64_t tx_busy_ns;
+    // Each of these events is only ever scheduled once at a time
+    uint8_t rx_timeout_scheduled;
+    uint8_t tx_scheduled;
+    uint8_t isr_scheduled;
+} Channel;
+
+// A channel has at most one of each type of event waiting, so the heap never needs to be bigger
+// than this and can live on the stack
+#define HEAP_SIZE (UART_CHANNEL_COUNT * EVENT_TYPE_COUNT)
+
+typedef struct {
+    Event heap[HEAP_SIZE];
+    size_t heap_length;
+    uint64_t next_sequence;
+    uint64_t now;
+    uint64_t random_state;
+    Channel channels[UART_CHANNEL_COUNT];
+} Simulation;
+
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ULL + (uint64_t)time.tv_nsec;
+}
+
+// splitmix64, small and fast with a full period, so any seed is a good one
+static uint64_t random_next(Simulation* simulation) {
+    uint64_t z = (simulation->random_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Uniform between minimum and maximum inclusive
+static uint64_t random_between(Simulation* simulation, uint64_t minimum, uint64_t maximum) {
+    if (maximum <= minimum) return minimum;
+    uint64_t range = maximum - minimum + 1;
+    return range == 0 ? random_next(simulation) : minimum + random_next(simulation) % range;
+}
+
+// Printable, so none of it is mistaken for XON/XOFF
+static uint8_t random_byte(Simulation* simulation) {
+    return (uint8_t)(' ' + random_next(simulation) % 95);
+}
+
+static uint64_t digest_add(uint64_t digest, uint8_t byte) {
+    return (digest ^ byte) * FNV_PRIME;
+}
+
+static uint8_t is_earlier(const Event* a, const Event* b) {
+    return a->time < b->time || (a->time == b->time && a->sequence < b->sequence);
+}
+
+static void schedule(Simulation* simulation, uint8_t channel, EventType type, uint64_t time) {
+    size_t index = simulation->heap_length++;
+    Event event = { time, simulation->next_sequence++, (uint8_t)type, channel };
+    // Sift up
+    while (index != 0) {
+        size_t parent = (index - 1) / 2;
+        if (!is_earlier(&event, &simulation->heap[parent])) break;
+        simulation->heap[index] = simulation->heap[parent];
+        index = parent;
+    }
+    simulation->heap[index] = event;
+}
+
+static Event next_event(Simulation* simulation) {
+    Event first = simulation->heap[0];
+    Event last = simulation->heap[--simulation->heap_length];
+    // Sift the last one down from the top
+    size_t index = 0;
+    size_t length = simulation->heap_length;
+    while (2 * index + 1 < length) {
+        size_t child = 2 * index + 1;
+        if (child + 1 < length && is_earlier(&simulation->heap[child + 1], &simulation->heap[child])) child++;
+        if (!is_earlier(&simulation->heap[child], &last)) break;
+        simulation->heap[index] = simulation->heap[child];
+        index = child;
+    }
+    if (length != 0) simulation->heap[index] = last;
+    return first;
+}
+
+// Anything that changes the registers can assert the interrupt or give the transmitter something to
+// send, so this is looked at after every event
+static void check_channel(Simulation* simulation, uint8_t index) {
+    Channel* channel = &simulation->channels[index];
+    uint8_t number = channel->config->channel;
+    if (!channel->isr_scheduled && uart_interrupt_pending(number)) {
+        channel->isr_scheduled = 1;
+        schedule(simulation, index, EVENT_ISR, simulation->now + channel->isr_latency_ns);
+    }
+    if (!channel->tx_scheduled && hardware_fifo_level(&uart_registers(number)->tx_fifo) != 0) {
+        channel->tx_scheduled = 1;
+        schedule(simulation, index, EVENT_TX_CHARACTER, simulation->now);
+    }
+}
+
+static void start_rx_message(Simulation* simulation, uint8_t index, uint64_t gap_ns) {
+    Channel* channel = &simulation->channels[index];
+    channel->rx_message_left = (uint32_t)random_between(simulation, channel->config->rx_message_min, channel->config->rx_message_max);
+    if (channel->rx_message_left == 0) channel->rx_message_left = 1;
+    schedule(simulation, index, EVENT_RX_CHARACTER, simulation->now + gap_ns + channel->character_ns);
+}
+
+static void receive_character(Simulation* simulation, uint8_t index) {
+    Channel* channel = &simulation->channels[index];
+    const SimulatorChannelConfig* config = channel->config;
+    if ((channel->hardware_flow_control && !peripheral_rts_asserted(config->channel)) || channel->xoff_received) {
+        // Held back, the byte goes as soon as it's let go. The line's idle meanwhile.
+        channel->result->rx_flow_holds++;
+        schedule(simulation, index, EVENT_RX_CHARACTER, simulation->now + channel->character_ns);
+        return;
+    }
+    channel->result->rx_bytes_offered++;
+    channel->rx_busy_ns += channel->character_ns;
+    if (config->rx_error_ppm != 0 && random_next(simulation) % 1000000 < config->rx_error_ppm) {
+        set_rx_error(config->channel, 1);
+        channel->result->rx_errors_injected++;
+    }
+    if (peripheral_receive_byte(config->channel, random_byte(simulation)) != SUCCESS) channel->result->rx_overruns++;
+
+    channel->last_receive_ns = simulation->now;
+    if (!channel->rx_timeout_scheduled) {
+        channel->rx_timeout_scheduled = 1;
+        schedule(simulation, index, EVENT_RX_TIMEOUT, simulation->now + RX_TIMEOUT_CHARACTERS * channel->character_ns);
+    }
+    if (--channel->rx_message_left != 0) {
+        schedule(simulation, index, EVENT_RX_CHARACTER, simulation->now + channel->character_ns);
+    } else {
+        start_rx_message(simulation, index, random_between(simulation, 0, config->rx_gap_max_ns));
+    }
+}
+
+static void receive_timeout(Simulation* simulation, uint8_t index) {
+    Channel* channel = &simulation->channels[index];
+    uint64_t idle_at = channel->last_receive_ns + RX_TIMEOUT_CHARACTERS * channel->character_ns;
+    if (simulation->now < idle_at) {
+        // More arrived since this was scheduled
+        schedule(simulation, index, EVENT_RX_TIMEOUT, idle_at);
+        return;
+    }
+    channel->rx_timeout_scheduled = 0;
+    signal_rx_timeout(channel->config->channel);
+}
+
+static void transmit_character(Simulation* simulation, uint8_t index) {
+    Channel* channel = &simulation->channels[index];
+    uint8_t data;
+    if (peripheral_transmit_byte(channel->config->channel, &data) != SUCCESS) {
+        // Nothing to send, the next write or ISR starts it again
+        channel->tx_scheduled = 0;
+        return;
+    }
+    channel->tx_busy_ns += channel->character_ns;
+    if (channel->software_flow_control && (data == UART_XON || data == UART_XOFF)) {
+        channel->xoff_received = data == UART_XOFF;
+    } else {
+        channel->result->tx_bytes_sent++;
+        channel->result->tx_digest = digest_add(channel->result->tx_digest, data);
+    }
+    schedule(simulation, index, EVENT_TX_CHARACTER, simulation->now + channel->character_ns);
+}
+
+static void task_read(Simulation* simulation, uint8_t index) {
+    Channel* channel = &simulation->channels[index];
+    uint8_t buffer[SIMULATOR_READ_MAX];
+    size_t size = channel->config->read_size < SIMULATOR_READ_MAX ? channel->config->read_size : SIMULATOR_READ_MAX;
+    size_t read = 0;
+    uart_read_bytes_from_receive_queue_nonblocking(channel->uart, buffer, size, &read);
+    channel->result->rx_bytes_read += read;
+    for (size_t i = 0; i < read; i++) channel->result->rx_digest = digest_add(channel->result->rx_digest, buffer[i]);
+    schedule(simulation, index, EVENT_READ, simulation->now + channel->config->read_interval_ns);
+}
+
+static void task_write(Simulation* simulation, uint8_t index) {
+    Channel* channel = &simulation->channels[index];
+    const SimulatorChannelConfig* config = channel->config;
+    size_t size = (size_t)random_between(simulation, config->tx_message_min, config->tx_message_max);
+    if (size == 0) size = 1;
+    UartReservation reservation;
+    if (uart_transmit_reserve(channel->uart, UART_PRIORITY_NORMAL, size, &reservation) == SUCCESS) {
+        for (int i = 0; i < 2; i++) {
+            for (size_t j = 0; j < reservation.space.spans[i].size; j++) reservation.space.spans[i].data[j] = random_byte(simulation);
+        }
+        uart_transmit_commit(channel->uart, &reservation);
+        channel->result->tx_bytes_written += size;
+    } else {
+        channel->result->tx_writes_refused++;
+    }
+    schedule(simulation, index, EVENT_WRITE, simulation->now + random_between(simulation, 0, config->tx_gap_max_ns));
+}
+
+// Empties the FIFOs and clears the line state that initialise_uart doesn't, so that whatever ran
+// on the channel before can't change the run
+static void reset_line(uint8_t number) {
+    RegisterBlock* block = uart_registers(number);
+    uint8_t data;
+    while (hardware_fifo_pop(&block->rx_fifo, &data) == SUCCESS) {
+    }
+    while (hardware_fifo_pop(&block->tx_fifo, &data) == SUCCESS) {
+    }
+    block->rx_timeout = 0;
+    set_rx_error(number, 0);
+    peripheral_set_cts(number, 1);
+}
+
+Status simulator_run(const SimulatorConfig* config, SimulatorResult* result) {
+    if (config == NULL || result == NULL || config->channel_count > UART_CHANNEL_COUNT
+        || (config->channels == NULL && config->channel_count != 0)) {
+        return FAILURE;
+    }
+    uint8_t used = 0;
+    for (size_t i = 0; i < config->channel_count; i++) {
+        const SimulatorChannelConfig* channel = &config->channels[i];
+        if (channel->channel >= UART_CHANNEL_COUNT || ((used >> channel->channel) & 0x1) || channel->baud_rate == 0
+            || channel->rx_message_min > channel->rx_message_max || channel->tx_message_min > channel->tx_message_max
+            || (channel->route && channel->read_interval_ns != 0)) {
+            return FAILURE;
+        }
+        used |= (uint8_t)(1U << channel->channel);
+    }
+    for (size_t i = 0; i < config->channel_count; i++) {
+        const SimulatorChannelConfig* channel = &config->channels[i];
+        if (channel->route && (channel->route_channel >= UART_CHANNEL_COUNT || !((used >> channel->route_channel) & 0x1))) return FAILURE;
+    }
+
+    static Simulation simulation;
+    memset(&simulation, 0, sizeof(simulation));
+    memset(result, 0, sizeof(*result));
+    simulation.random_state = config->seed;
+
+    Status status = SUCCESS;
+    uint8_t initialised = 0;
+    for (; initialised < config->channel_count; initialised++) {
+        const SimulatorChannelConfig* channel_config = &config->channels[initialised];
+        Channel* channel = &simulation.channels[initialised];
+        channel->config = channel_config;
+        channel->result = &result->channels[initialised];
+        channel->result->rx_digest = FNV_OFFSET_BASIS;
+        channel->result->tx_digest = FNV_OFFSET_BASIS;
+        reset_line(channel_config->channel);
+        if (initialise_uart(channel_config->channel, channel_config->uart_config, &channel->uart) != SUCCESS) {
+            status = FAILURE;
+            break;
+        }
+        uint8_t bits = channel_config->bits_per_character != 0 ? channel_config->bits_per_character : SIMULATOR_DEFAULT_BITS_PER_CHARACTER;
+        channel->character_ns = 1000000000ULL * bits / channel_config->baud_rate;
+        if (channel->character_ns == 0) channel->character_ns = 1;
+        channel->isr_latency_ns = channel_config->isr_latency_ns != 0 ? channel_config->isr_latency_ns : SIMULATOR_DEFAULT_ISR_LATENCY_NS;
+        UartFlowControl flow_control = channel_config->uart_config != NULL ? channel_config->uart_config->flow_control : UART_FLOW_NONE;
+        channel->hardware_flow_control = flow_control == UART_FLOW_RTS_CTS;
+        channel->software_flow_control = flow_control == UART_FLOW_XON_XOFF;
+
+        if (channel_config->rx_message_max != 0) {
+            start_rx_message(&simulation, initialised, random_between(&simulation, 0, channel_config->rx_gap_max_ns));
+        }
+        if (channel_config->read_interval_ns != 0) {
+            schedule(&simulation, initialised, EVENT_READ, channel_config->read_interval_ns);
+        }
+        if (channel_config->tx_message_max != 0) {
+            schedule(&simulation, initialised, EVENT_WRITE, random_between(&simulation, 0, channel_config->tx_gap_max_ns));
+        }
+    }
+
+    // Every channel has to be initialised before it can be routed to
+    for (uint8_t i = 0; status == SUCCESS && i < initialised; i++) {
+        Channel* channel = &simulation.channels[i];
+        if (!channel->config->route) continue;
+        UartHandle destination = NULL;
+        for (uint8_t j = 0; j < initialised; j++) {
+            if (simulation.channels[j].config->channel == channel->config->route_channel) destination = simulation.channels[j].uart;
+        }
+        if (uart_route(channel->uart, destination) != SUCCESS) status = FAILURE;
+    }
+
+    if (status == SUCCESS) {
+        uint64_t start = now_ns();
+        while (simulation.heap_length != 0 && simulation.heap[0].time <= config->duration_ns) {
+            Event event = next_event(&simulation);
+            simulation.now = event.time;
+            result->events++;
+            switch (event.type) {
+                case EVENT_RX_CHARACTER:
+                    receive_character(&simulation, event.channel);
+                    break;
+                case EVENT_RX_TIMEOUT:
+                    receive_timeout(&simulation, event.channel);
+                    break;
+                case EVENT_TX_CHARACTER:
+                    transmit_character(&simulation, event.channel);
+                    break;
+                case EVENT_ISR:
+                    simulation.channels[event.channel].isr_scheduled = 0;
+                    raise_pending_interrupt(simulation.channels[event.channel].config->channel);
+                    break;
+                case EVENT_READ:
+                    task_read(&simulation, event.channel);
+                    break;
+                case EVENT_WRITE:
+                    task_write(&simulation, event.channel);
+                    break;
+                default:
+                    break;
+            }
+            if (event.type == EVENT_ISR) {
+                // An ISR can start another channel's transmitter (through a route) or let its far end
+                // carry on (from the other end of one)
+                for (uint8_t i = 0; i < initialised; i++) check_channel(&simulation, i);
+            } else {
+                check_channel(&simulation, event.channel);
+            }
+        }
+        result->elapsed_ns = now_ns() - start;
+        result->simulated_ns = config->duration_ns;
+    }
+
+    for (uint8_t i = 0; i < initialised; i++) {
+        Channel* channel = &simulation.channels[i];
+        UartStats stats;
+        if (status == SUCCESS && uart_get_stats(channel->uart, &stats, 0) == SUCCESS) {
+            channel->result->rx_dropped = stats.rx_dropped;
+            channel->result->rx_errors = stats.rx_errors;
+            channel->result->isr_count = stats.isr_count;
+            channel->result->rx_queue_max_depth = stats.rx_queue_high_watermark;
+            channel->result->tx_queue_max_depth = stats.tx_queue_high_watermark;
+            UartRouteStats route;
+            if (uart_get_route_stats(channel->uart, &route) == SUCCESS) channel->result->routed_bytes = route.bytes;
+            if (config->duration_ns != 0) {
+                channel->result->rx_wire_utilisation = (double)channel->rx_busy_ns / (double)config->duration_ns;
+                channel->result->tx_wire_utilisation = (double)channel->tx_busy_ns / (double)config->duration_ns;
+            }
+        }
+    }
+    // Not until all the results are in, as stopping a channel takes down the routes to it
+    for (uint8_t i = 0; i < initialised; i++) stop_uart(simulation.channels[i].uart);
+    return status;
+}
@@ -0,0 +1,489 @@
+#define _POSIX_C_SOURCE 200809L
+#include "trace.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "processor_interface.h"
+#include "uart.h"
+
+#define TRACE_MAGIC "UTRC"
+#define TRACE_VERSION 1
+#define TRACE_EVENT_MAX_SIZE 16 // Header byte, a 10 byte varint timestamp and a 5 byte varint value
+
+#define TRACE_OFF 0
+#define TRACE_RECORDING 1
+#define TRACE_VERIFYING 2
+
+// What each channel looked like when recording started
+typedef struct {
+    uint8_t values[REGISTER_BLOCK_BYTES];
+    uint8_t rx_timeout;
+    uint8_t fifo_depth;
+    uint8_t rx_level;
+    uint8_t tx_level;
+    uint8_t rx_fifo[UART_FIFO_MAX_DEPTH];
+    uint8_t tx_fifo[UART_FIFO_MAX_DEPTH];
+} TraceChannelSnapshot;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    TraceChannelSnapshot channels[UART_CHANNEL_COUNT];
+} TraceHeader;
+
+typedef struct {
+    int file;
+    uint8_t* data;
+    size_t size;
+    size_t position;
+    uint64_t last_cycles;
+    size_t events;
+    size_t dropped;
+} TraceRecorder;
+
+// State of a replay, the verifying hooks work through the same reader as the replay loop
+typedef struct {
+    TraceReader reader;
+    TraceReader transmit_lookahead[UART_CHANNEL_COUNT]; // Where each channel's next data register write is
+    UartHandle uarts[UART_CHANNEL_COUNT];
+    TraceReplayMode mode;
+    TraceReplayResult* result;
+    uint8_t isr_channel; // Channel whose ISR is being checked
+    uint8_t isr_finished;
+} TraceReplay;
+
+_Atomic uint8_t trace_mode = TRACE_OFF;
+static atomic_flag trace_spin = ATOMIC_FLAG_INIT;
+static TraceRecorder recorder;
+static _Thread_local uint8_t in_isr;
+static TraceReplay* replay;
+
+static uint8_t* write_varint(uint8_t* out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+// NULL if the varint runs off the end
+static const uint8_t* read_varint(const uint8_t* in, const uint8_t* end, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+        uint8_t byte = *in++;
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return in;
+    }
+    return NULL;
+}
+
+#ifdef UART_TRACE
+static void snapshot_fifo(HardwareFifo* fifo, uint8_t* level, uint8_t* bytes) {
+    uint8_t front = atomic_load(&fifo->front);
+    *level = hardware_fifo_level(fifo);
+    for (uint8_t i = 0; i < *level; i++) {
+        bytes[i] = fifo->data[(uint8_t)(front + i) & (UART_FIFO_MAX_DEPTH - 1)];
+    }
+}
+#endif
+
+static void restore_fifo(HardwareFifo* fifo, uint8_t level, const uint8_t* bytes) {
+    atomic_store(&fifo->front, 0);
+    atomic_store(&fifo->rear, 0);
+    for (uint8_t i = 0; i < level; i++) {
+        hardware_fifo_push(fifo, UART_FIFO_MAX_DEPTH, bytes[i]);
+    }
+}
+
+uint8_t trace_lock(void) {
+    while (atomic_flag_test_and_set_explicit(&trace_spin, memory_order_acquire)) {
+    }
+    // Recording may have stopped while this was waiting
+    if (atomic_load_explicit(&trace_mode, memory_order_relaxed) == TRACE_OFF) {
+        atomic_flag_clear_explicit(&trace_spin, memory_order_release);
+        return 0;
+    }
+    return 1;
+}
+
+static void record_event(TraceEventType type, uint8_t channel, uint32_t value) {
+    if (type == TRACE_ISR_ENTER) in_isr = 1;
+    if (recorder.position + TRACE_EVENT_MAX_SIZE > recorder.size) {
+        recorder.dropped++;
+    } else {
+        // Cycle counters on different cores can be slightly out, so time never goes backwards
+        uint64_t now = read_cycle_counter();
+        uint64_t delta = now > recorder.last_cycles ? now - recorder.last_cycles : 0;
+        recorder.last_cycles += delta;
+        uint8_t* out = &recorder.data[recorder.position];
+        *out++ = (uint8_t)((type << 3) | channel);
+        out = write_varint(out, delta);
+        out = write_varint(out, ((uint64_t)value << 1) | in_isr);
+        recorder.position = (size_t)(out - recorder.data);
+        recorder.events++;
+    }
+    if (type == TRACE_ISR_EXIT) in_isr = 0;
+}
+
+static void mismatch(TraceReplay* state, size_t index) {
+    state->result->mismatches++;
+    if (state->result->first_mismatch == SIZE_MAX) state->result->first_mismatch = index;
+}
+
+static void replay_event(TraceReplay* state, const TraceEvent* event);
+
+// Checks one of the ISR's accesses against the next event it made in the recording. Anything else
+// recorded in between (the line, a task, other channels) is applied first, as it happened then.
+static void verify_event(TraceReplay* state, TraceEventType type, uint8_t channel, uint32_t value) {
+    if (type == TRACE_ISR_ENTER) return; // Already taken by the replay loop
+    TraceEvent expected;
+    while (1) {
+        TraceReader peek = state->reader;
+        if (trace_reader_next(&peek, &expected) != SUCCESS) {
+            mismatch(state, state->reader.events);
+            return;
+        }
+        if (expected.in_isr && expected.channel == state->isr_channel) break;
+        state->reader = peek;
+        if (expected.in_isr) {
+            // Another channel's ISR running at the same time on another thread
+            mismatch(state, state->reader.events - 1);
+            continue;
+        }
+        atomic_store_explicit(&trace_mode, TRACE_OFF, memory_order_relaxed);
+        replay_event(state, &expected);
+        atomic_store_explicit(&trace_mode, TRACE_VERIFYING, memory_order_relaxed);
+    }
+    // An ISR doing more than it did originally runs into the recorded exit, which is left for the
+    // exit hook
+    if (expected.type == TRACE_ISR_EXIT && type != TRACE_ISR_EXIT) {
+        mismatch(state, state->reader.events);
+        return;
+    }
+    size_t index = state->reader.events;
+    trace_reader_next(&state->reader, &expected);
+    if (expected.type != type || expected.channel != channel || expected.value != value) mismatch(state, index);
+    if (expected.type == TRACE_ISR_EXIT) state->isr_finished = 1;
+}
+
+void trace_end(TraceEventType type, uint8_t channel, uint32_t value) {
+    if (type < TRACE_EVENT_TYPE_COUNT) {
+        if (atomic_load_explicit(&trace_mode, memory_order_relaxed) == TRACE_RECORDING) {
+            record_event(type, channel, value);
+        } else if (replay != NULL) {
+            verify_event(replay, type, channel, value);
+        }
+    }
+    atomic_flag_clear_explicit(&trace_spin, memory_order_release);
+}
+
+Status trace_start(const char* path, size_t max_size) {
+#ifndef UART_TRACE
+    (void)path;
+    (void)max_size;
+    return FAILURE; // No hooks to record with
+#else
+    if (path == NULL || max_size < sizeof(TraceHeader) + TRACE_EVENT_MAX_SIZE) return FAILURE;
+    if (atomic_load(&trace_mode) != TRACE_OFF) return BUSY;
+    int file = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file < 0) return FAILURE;
+    if (ftruncate(file, (off_t)max_size) != 0) {
+        close(file);
+        return FAILURE;
+    }
+    void* data = mmap(NULL, max_size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    if (data == MAP_FAILED) {
+        close(file);
+        return FAILURE;
+    }
+
+    // The snapshot and switching recording on happen under the lock, so nothing recorded can
+    // come before the snapshot
+    while (atomic_flag_test_and_set_explicit(&trace_spin, memory_order_acquire)) {
+    }
+    TraceHeader* header = (TraceHeader*)data;
+    memcpy(header->magic, TRACE_MAGIC, sizeof(header->magic));
+    header->version = TRACE_VERSION;
+    for (uint8_t channel = 0; channel < UART_CHANNEL_COUNT; channel++) {
+        RegisterBlock* block = uart_registers(channel);
+        TraceChannelSnapshot* snapshot = &header->channels[channel];
+        for (int i = 0; i < REGISTER_BLOCK_BYTES; i++) snapshot->values[i] = block->values[i];
+        snapshot->rx_timeout = block->rx_timeout;
+        snapshot->fifo_depth = block->fifo_depth;
+        snapshot_fifo(&block->rx_fifo, &snapshot->rx_level, snapshot->rx_fifo);
+        snapshot_fifo(&block->tx_fifo, &snapshot->tx_level, snapshot->tx_fifo);
+    }
+    recorder = (TraceRecorder){ .file = file, .data = data, .size = max_size, .position = sizeof(TraceHeader),
+        .last_cycles = read_cycle_counter() };
+    atomic_store_explicit(&trace_mode, TRACE_RECORDING, memory_order_relaxed);
+    atomic_flag_clear_explicit(&trace_spin, memory_order_release);
+    return SUCCESS;
+#endif
+}
+
+Status trace_stop(size_t* events_recorded, size_t* events_dropped) {
+    while (atomic_flag_test_and_set_explicit(&trace_spin, memory_order_acquire)) {
+    }
+    uint8_t was_recording = atomic_load_explicit(&trace_mode, memory_order_relaxed) == TRACE_RECORDING;
+    if (was_recording) atomic_store_explicit(&trace_mode, TRACE_OFF, memory_order_relaxed);
+    atomic_flag_clear_explicit(&trace_spin, memory_order_release);
+    if (!was_recording) return FAILURE;
+
+    Status status = SUCCESS;
+    munmap(recorder.data, recorder.size);
+    if (ftruncate(recorder.file, (off_t)recorder.position) != 0) status = FAILURE;
+    close(recorder.file);
+    if (events_recorded != NULL) *events_recorded = recorder.events;
+    if (events_dropped != NULL) *events_dropped = recorder.dropped;
+    return status;
+}
+
+Status trace_reader_open(TraceReader* reader, const char* path) {
+    if (reader == NULL || path == NULL) return FAILURE;
+    memset(reader, 0, sizeof(*reader));
+    int file = open(path, O_RDONLY);
+    if (file < 0) return FAILURE;
+    struct stat file_stat;
+    if (fstat(file, &file_stat) != 0 || (size_t)file_stat.st_size < sizeof(TraceHeader)) {
+        close(file);
+        return FAILURE;
+    }
+    void* mapping = mmap(NULL, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (mapping == MAP_FAILED) return FAILURE;
+    const TraceHeader* header = mapping;
+    if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 || header->version != TRACE_VERSION) {
+        munmap(mapping, (size_t)file_stat.st_size);
+        return FAILURE;
+    }
+    reader->mapping = mapping;
+    reader->mapping_size = (size_t)file_stat.st_size;
+    reader->data = reader->mapping + sizeof(TraceHeader);
+    reader->size = reader->mapping_size - sizeof(TraceHeader);
+    return SUCCESS;
+}
+
+Status trace_reader_next(TraceReader* reader, TraceEvent* event) {
+    if (reader == NULL || event == NULL || reader->data == NULL) return FAILURE;
+    if (reader->position == reader->size) return EMPTY;
+    const uint8_t* in = &reader->data[reader->position];
+    const uint8_t* end = reader->data + reader->size;
+    uint8_t header = *in++;
+    uint64_t delta;
+    uint64_t value;
+    in = read_varint(in, end, &delta);
+    if (in != NULL) in = read_varint(in, end, &value);
+    if (in == NULL || (header >> 3) >= TRACE_EVENT_TYPE_COUNT) return FAILURE;
+    reader->position = (size_t)(in - reader->data);
+    reader->timestamp += delta;
+    reader->events++;
+    event->timestamp = reader->timestamp;
+    event->type = (TraceEventType)(header >> 3);
+    event->channel = header & 0x7;
+    event->in_isr = value & 0x1;
+    event->value = (uint32_t)(value >> 1);
+    return SUCCESS;
+}
+
+void trace_reader_close(TraceReader* reader) {
+    if (reader == NULL || reader->mapping == NULL) return;
+    munmap((void*)reader->mapping, reader->mapping_size);
+    reader->mapping = NULL;
+    reader->data = NULL;
+}
+
+static void check(TraceReplay* state, uint8_t matched) {
+    if (state->mode == TRACE_REPLAY_COMPARE && !matched) mismatch(state, state->reader.events - 1);
+}
+
+// The next byte the original ISR wrote to the channel's data register that hasn't been queued yet
+static uint8_t next_transmit_byte(TraceReplay* state, uint8_t channel, uint8_t* value) {
+    TraceEvent event;
+    while (trace_reader_next(&state->transmit_lookahead[channel], &event) == SUCCESS) {
+        if (event.type == TRACE_WRITE_DATA && event.channel == channel) {
+            *value = (uint8_t)event.value;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void replay_isr(TraceReplay* state, const TraceEvent* event) {
+    uint8_t channel = event->channel;
+    UartHandle uart = state->uarts[channel];
+    size_t receive_length = event->value & 0xFFFF;
+    size_t transmit_length = event->value >> 16;
+    state->result->isrs++;
+
+    // Put the queues back how they were. The reader had taken everything past receive_length by
+    // now, and the transmit queue gets whatever the ISR is going to send.
+    uart_replay_queues(uart, receive_length, NULL, 0);
+    size_t queued = uart_transmit_queue_length(uart);
+    check(state, queued <= transmit_length && uart_receive_queue_length(uart) == receive_length);
+    uint8_t transmit[64];
+    while (queued < transmit_length) {
+        size_t count = 0;
+        while (count < sizeof(transmit) && queued + count < transmit_length
+            && next_transmit_byte(state, channel, &transmit[count])) {
+            count++;
+        }
+        if (count == 0) break;
+        uart_replay_queues(uart, receive_length, transmit, count);
+        queued += count;
+    }
+
+    state->isr_channel = channel;
+    state->isr_finished = 0;
+    if (state->mode == TRACE_REPLAY_COMPARE) {
+        replay = state;
+        atomic_store(&trace_mode, TRACE_VERIFYING);
+        uart_isr(uart);
+        atomic_store(&trace_mode, TRACE_OFF);
+        replay = NULL;
+    } else {
+        uart_isr(uart);
+    }
+
+    // Anything the original ISR did that this one didn't is a mismatch, anything else that went
+    // on around it is applied as it comes
+    TraceEvent next;
+    while (!state->isr_finished && trace_reader_next(&state->reader, &next) == SUCCESS) {
+        if (next.in_isr && next.channel == channel) {
+            if (next.type == TRACE_ISR_EXIT) state->isr_finished = 1;
+            check(state, 0);
+        } else {
+            replay_event(state, &next);
+        }
+    }
+}
+
+// Applies one recorded event, checking what comes back in compare mode
+static void replay_event(TraceReplay* state, const TraceEvent* event) {
+    uint8_t channel = event->channel;
+    RegisterBlock* block = uart_registers(channel);
+    uint8_t byte;
+    switch (event->type) {
+        case TRACE_READ_STATUS_LOW:
+            check(state, read_uart_status_low(block) == event->value);
+            break;
+        case TRACE_READ_STATUS_HIGH:
+            check(state, read_uart_status_high(block) == event->value);
+            break;
+        case TRACE_READ_STATUS:
+            check(state, read_uart_status(block) == event->value);
+            break;
+        case TRACE_READ_DATA:
+            check(state, read_uart_data(block) == event->value);
+            break;
+        case TRACE_READ_STATUS_AND_DATA:
+            check(state, read_uart_status_and_data(block) == event->value);
+            break;
+        case TRACE_WRITE_STATUS:
+            write_address_16bit((uint16_t*)(uintptr_t)UART_STATUS_REGISTER_ADDRESS(channel), (uint16_t)event->value);
+            break;
+        case TRACE_WRITE_DATA:
+            write_uart_data(block, (uint8_t)event->value);
+            break;
+        case TRACE_WRITE_FIFO_CONTROL:
+            write_address_8bit((uint16_t*)(uintptr_t)(UART_FIFO_CONTROL_REGISTER_ADDRESS(channel) + (event->value >> 8)),
+                (uint8_t)event->value);
+            break;
+        case TRACE_SET_STATUS_BITS:
+            set_uart_status_bits(block, (uint16_t)event->value);
+            break;
+        case TRACE_CLEAR_STATUS_BITS:
+            clear_uart_status_bits(block, (uint16_t)event->value);
+            break;
+        case TRACE_FIFO_DEPTH:
+            configure_uart_fifo(channel, (uint8_t)event->value);
+            break;
+        case TRACE_ISR_ENTER:
+            replay_isr(state, event);
+            break;
+        case TRACE_ISR_EXIT:
+            check(state, 0); // An exit without an entry
+            break;
+        case TRACE_LINE_RECEIVE:
+            peripheral_receive_byte(channel, (uint8_t)event->value);
+            break;
+        case TRACE_LINE_TRANSMIT:
+            check(state, peripheral_transmit_byte(channel, &byte) == SUCCESS && byte == event->value);
+            break;
+        case TRACE_RX_TIMEOUT:
+            signal_rx_timeout(channel);
+            break;
+        case TRACE_RX_ERROR:
+            set_rx_error(channel, (uint8_t)event->value);
+            break;
+        case TRACE_LINE_CTS:
+            peripheral_set_cts(channel, (uint8_t)event->value);
+            break;
+        default:
+            break;
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ULL + (uint64_t)time.tv_nsec;
+}
+
+Status trace_replay(const char* path, TraceReplayMode mode, TraceReplayResult* result) {
+    if (path == NULL || result == NULL) return FAILURE;
+#ifndef UART_TRACE
+    if (mode == TRACE_REPLAY_COMPARE) return FAILURE; // No hooks to check with
+#endif
+    if (atomic_load(&trace_mode) != TRACE_OFF) return BUSY;
+    static TraceReplay state;
+    memset(&state, 0, sizeof(state));
+    if (trace_reader_open(&state.reader, path) != SUCCESS) return FAILURE;
+    for (uint8_t channel = 0; channel < UART_CHANNEL_COUNT; channel++) {
+        state.transmit_lookahead[channel] = state.reader;
+    }
+    state.mode = mode;
+    state.result = result;
+    memset(result, 0, sizeof(*result));
+    result->first_mismatch = SIZE_MAX;
+
+    Status status = SUCCESS;
+    uint8_t initialised = 0;
+    while (initialised < UART_CHANNEL_COUNT && status == SUCCESS) {
+        status = initialise_uart(initialised, NULL, &state.uarts[initialised]);
+        if (status == SUCCESS) initialised++;
+    }
+    if (status == SUCCESS) {
+        // Initialising wrote the registers, so they're put back to the snapshot afterwards
+        const TraceHeader* header = (const TraceHeader*)state.reader.mapping;
+        for (uint8_t channel = 0; channel < UART_CHANNEL_COUNT; channel++) {
+            const TraceChannelSnapshot* snapshot = &header->channels[channel];
+            RegisterBlock* block = uart_registers(channel);
+            for (int i = 0; i < REGISTER_BLOCK_BYTES; i++) block->values[i] = snapshot->values[i];
+            block->rx_timeout = snapshot->rx_timeout;
+            block->fifo_depth = snapshot->fifo_depth;
+            restore_fifo(&block->rx_fifo, snapshot->rx_level, snapshot->rx_fifo);
+            restore_fifo(&block->tx_fifo, snapshot->tx_level, snapshot->tx_fifo);
+        }
+
+        uint64_t start = now_ns();
+        TraceEvent event;
+        while ((status = trace_reader_next(&state.reader, &event)) == SUCCESS) {
+            replay_event(&state, &event);
+        }
+        result->elapsed_ns = now_ns() - start;
+        result->events = state.reader.events;
+        status = status == EMPTY ? SUCCESS : FAILURE;
+    } else {
+        status = FAILURE;
+    }
+
+    for (uint8_t channel = 0; channel < initialised; channel++) {
+        stop_uart(state.uarts[channel]);
+    }
+    trace_reader_close(&state.reader);
+    return status;
+}
@@ -1,228 +1,1635 @@
+#define _POSIX_C_SOURCE 200809L
 #include "uart.h"
 #include "queue.h"
 #include "processor_interface.h"
+#include "wait_event.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
 
-static Queue* transmit_queue;
-static Queue* receive_queue;
+// Counters written only by the ISR. They only ever go up (a relaxed load and store, no read
+// modify write needed with one writer) and a reset is done by the reader remembering a baseline.
+typedef struct {
+    _Atomic uint64_t rx_bytes;
+    _Atomic uint64_t tx_bytes;
+    _Atomic uint64_t rx_dropped;
+    _Atomic uint64_t rx_errors;
+    _Atomic uint64_t rx_flow_stops;
+    _Atomic uint64_t tx_flow_stops;
+    _Atomic uint64_t isr_count;
+    _Atomic uint64_t isr_spurious;
+    _Atomic uint64_t isr_cycles_histogram[UART_ISR_HISTOGRAM_BUCKETS];
+    _Atomic uint64_t tx_messages[UART_PRIORITY_COUNT];
+    _Atomic uint64_t tx_latency_samples[UART_PRIORITY_COUNT];
+    _Atomic uint64_t tx_latency_total_ns[UART_PRIORITY_COUNT];
+} UartCounters;
 
-static volatile uint32_t bytes_received;
+// Latency probe for one transmit lane. A writer claims it, fills it in before committing its
+// message (so the ISR can't have sent the message yet) and arms it, then the ISR times the message
+// and frees the probe once the message's last byte is in the TX FIFO.
+#define PROBE_FREE 0
+#define PROBE_CLAIMED 1
+#define PROBE_ARMED 2
+typedef struct {
+    _Atomic uint8_t state;
+    queue_index_t end; // Consumed index of the lane's queue once the message has gone
+    uint64_t committed_ns;
+} TransmitProbe;
 
-static volatile uint8_t receive_queue_error; // 0 if no error, 1 if error
-// Transmit error not required but implemented in case of queue issues
-static volatile uint8_t transmit_queue_error; // 0 if no error, 1 if error
+#define NO_TRANSMIT_LANE UART_PRIORITY_COUNT
 
+// All the state for one channel. Aligned to a cache line so that each channel's state sits on its
+// own lines and servicing one port never pulls in (or invalidates) another port's state.
+struct Uart {
+    // Written by the ISR
+    _Alignas(CACHE_LINE_SIZE) UartCounters counters;
+    _Atomic uint32_t rx_queue_high_watermark;
+    volatile uint8_t receive_queue_error; // 0 if no error, 1 if error
+    // Transmit error not required but implemented in case of queue issues
+    volatile uint8_t transmit_queue_error; // 0 if no error, 1 if error
+    _Atomic uint64_t tx_latency_max_ns[UART_PRIORITY_COUNT];
+    uint8_t transmit_lane; // Lane the message going out is from, NO_TRANSMIT_LANE between messages
+    uint32_t transmit_message_bytes; // How much of that message has gone
+    uint32_t starved_bytes[UART_PRIORITY_COUNT]; // Sent from higher lanes while each lane had a message waiting
+    _Atomic uint8_t transmit_paused; // The far end sent XOFF, the writers look at it before unmasking
+    // Flow control of the far end. The ISR sets receive_stopped once it has told it to stop and the
+    // reader clears it to tell it to carry on. flow_character is an XON or XOFF for the ISR to send
+    // ahead of the transmit lanes, 0 if there isn't one.
+    _Atomic uint8_t receive_stopped;
+    _Atomic uint8_t flow_character;
 
-// If this was running on a true processor would use:
-// void __attribute__((interrupt)) uart_isr(void)
-void uart_isr(void) {
+    // Signalled by the ISR, waited on by the blocking reader/writer. The wanted counts are set by
+    // the waiter so that the ISR only wakes it once there's enough data/space to be worth it.
+    WaitEvent receive_event;
+    WaitEvent transmit_event;
+    _Atomic size_t receive_bytes_wanted;
+    _Atomic size_t transmit_space_wanted[UART_PRIORITY_COUNT];
+    _Atomic uint64_t last_receive_ns; // Only kept while there's a receive idle timeout
+    // Routing (see uart_route). route_bytes is counted by the destination's ISR on the source's
+    // state. route_forwarding is set while this channel's ISR is using its route source's receive
+    // queue, so that uart_unroute can tell when it's finished with it.
+    _Atomic uint64_t route_bytes;
+    _Atomic uint8_t route_forwarding;
+    // Readiness for uart_poll. The poller arms the events it's about to wait for and the ISR disarms
+    // them as it signals the set. poll_signalling is set while it does, so that taking the channel
+    // out of the set can tell when the ISR is done with it.
+    _Atomic uint8_t poll_armed;
+    _Atomic uint8_t poll_signalling;
+    // in_isr is set while uart_isr is running and isr_stopped once stop_uart has started, so that
+    // stop_uart can wait for an ISR already under way (on the emulator or bridge thread, say) to
+    // finish before the queues go
+    _Atomic uint8_t in_isr;
+    _Atomic uint8_t isr_stopped;
+
+    // Written by the task side
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t tx_queue_high_watermark;
+    UartStats stats_baseline; // Counter values as of the last reset
+    // Set by uart_route and uart_unroute, read by the ISRs at either end
+    _Atomic(struct Uart*) route_source;
+    _Atomic(struct Uart*) route_destination;
+    uint64_t route_dropped_baseline; // The source's counters as of the route being set up
+    uint64_t route_flow_stops_baseline;
+    _Atomic(struct UartPollSet*) poll_set; // Set by uart_poll_add and uart_poll_remove
+    size_t poll_write_space;
+
+    // Notifications, set up by uart_set_*_callback under the notifier lock and used by the worker.
+    // The callbacks are atomic as the ISR looks at them to see if there's anything to flag.
+    _Alignas(CACHE_LINE_SIZE) _Atomic(UartCallback) receive_callback;
+    _Atomic(UartCallback) transmit_callback;
+    void* receive_context;
+    void* transmit_context;
+    size_t receive_watermark;
+    size_t transmit_watermark;
+    uint64_t receive_idle_timeout_ns;
+    uint64_t receive_notified_ns; // last_receive_ns as of the last receive callback
+    _Atomic uint8_t receive_idle_timing; // The worker has an idle deadline running for the channel
+
+    // Claimed by the writers, freed by the ISR
+    _Alignas(CACHE_LINE_SIZE) TransmitProbe probes[UART_PRIORITY_COUNT];
+
+    // Only touched by the reading task
+    size_t receive_scanned; // Bytes at the front of the receive queue known not to hold scan_delimiter
+    uint8_t scan_delimiter;
+
+    // Read only after initialisation
+    _Alignas(CACHE_LINE_SIZE) Queue* transmit_queues[UART_PRIORITY_COUNT];
+    Queue* receive_queue;
+    uint16_t* status_register;
+    uint16_t* data_register;
+    RegisterBlock* registers; // Used by the ISR instead of the register addresses
+    uint16_t flow_high_watermark;
+    uint16_t flow_low_watermark;
+    uint8_t flow_control;
+    uint8_t channel;
+    uint8_t is_initialised;
+};
+
+static struct Uart uarts[UART_CHANNEL_COUNT];
+
+// Each channel can only be in one set, so there's no use for more sets than channels. They're kept
+// here rather than allocated so the static queue build stays heap free.
+struct UartPollSet {
+    _Atomic uint8_t in_use;
+    int fd; // eventfd, readable once the set has been signalled
+    _Atomic uint8_t signalled; // fd has been written since the poller last drained it
+    UartHandle members[UART_CHANNEL_COUNT]; // Indexed by channel
+    uint8_t interest[UART_CHANNEL_COUNT];
+    uint8_t next_channel; // Where the next look starts, so a busy low channel can't hide the rest
+};
+
+static UartPollSet poll_sets[UART_CHANNEL_COUNT];
+
+// The notification worker. The ISR sets the channel's bit for whatever happened in pending and
+// signals the event, the worker makes the callbacks.
+#define WATERMARK_PENDING_SHIFT 0
+#define IDLE_PENDING_SHIFT 8
+#define TRANSMIT_PENDING_SHIFT 16
+_Static_assert(UART_CHANNEL_COUNT <= 8, "Pending notification bits overlap");
+static struct {
+    WaitEvent event;
+    _Atomic uint32_t pending;
+    pthread_mutex_t lock; // Held while the worker runs a channel's callbacks and while they're changed
+    pthread_t thread;
+    uint8_t started;
+} notifier = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static pthread_once_t notifier_once = PTHREAD_ONCE_INIT;
+
+#ifdef UART_STATIC_QUEUES
+// Each channel's queues and their storage, sized at compile time so there's no allocator anywhere
+// on the startup path
+typedef struct {
+    Queue* queue;
+    uint8_t* storage;
+    _Atomic queue_count_t* commits;
+    _Atomic uint8_t* message_ends;
+    uint16_t capacity;
+} StaticTransmitLane;
+
+typedef struct {
+    Queue* receive_queue;
+    uint8_t* receive_storage;
+    uint16_t receive_capacity;
+    StaticTransmitLane transmit_lanes[UART_PRIORITY_COUNT];
+} StaticQueues;
+
+#define DECLARE_TRANSMIT_LANE(channel, lane, capacity) \
+    static Queue lane##_queue_##channel; \
+    static uint8_t lane##_storage_##channel[capacity]; \
+    static _Atomic queue_count_t lane##_commits_##channel[capacity]; \
+    static _Atomic uint8_t lane##_message_ends_##channel[QUEUE_MESSAGE_ENDS_SIZE(capacity)];
+#define DECLARE_STATIC_QUEUES(channel, receive_capacity, transmit_capacity, priority_capacity) \
+    _Static_assert((receive_capacity) <= UART_STATIC_QUEUE_MAX_CAPACITY && (transmit_capacity) <= UART_STATIC_QUEUE_MAX_CAPACITY \
+        && (priority_capacity) <= UART_STATIC_QUEUE_MAX_CAPACITY, \
+        "Channel " #channel " has a queue bigger than UART_STATIC_QUEUE_MAX_CAPACITY"); \
+    static Queue receive_queue_##channel; \
+    static uint8_t receive_storage_##channel[receive_capacity]; \
+    DECLARE_TRANSMIT_LANE(channel, transmit, transmit_capacity) \
+    DECLARE_TRANSMIT_LANE(channel, priority, priority_capacity)
+UART_STATIC_QUEUE_CAPACITIES(DECLARE_STATIC_QUEUES)
+
+#define TRANSMIT_LANE_ENTRY(channel, lane, capacity) \
+    { &lane##_queue_##channel, lane##_storage_##channel, lane##_commits_##channel, lane##_message_ends_##channel, capacity }
+#define STATIC_QUEUES_ENTRY(channel, receive_capacity, transmit_capacity, priority_capacity) \
+    [channel] = { &receive_queue_##channel, receive_storage_##channel, receive_capacity, { \
+        [UART_PRIORITY_NORMAL] = TRANSMIT_LANE_ENTRY(channel, transmit, transmit_capacity), \
+        [UART_PRIORITY_HIGH] = TRANSMIT_LANE_ENTRY(channel, priority, priority_capacity) } },
+static const StaticQueues static_queues[UART_CHANNEL_COUNT] = { UART_STATIC_QUEUE_CAPACITIES(STATIC_QUEUES_ENTRY) };
+#endif
+
+// The per channel ISR entries below only go up to 8 channels
+_Static_assert(UART_CHANNEL_COUNT <= 8, "Add more uartN_isr entries for the extra channels");
+
+// Single writer so no read modify write needed
+static inline void counter_add(_Atomic uint64_t* counter, uint64_t amount) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+static void update_high_watermark(_Atomic uint32_t* watermark, size_t length) {
+    uint32_t current = atomic_load_explicit(watermark, memory_order_relaxed);
+    // Only a compare and swap once it's actually been exceeded, so a reset racing this isn't lost
+    while (length > current
+        && !atomic_compare_exchange_weak_explicit(watermark, &current, (uint32_t)length, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+// Same as above for the latency maximums
+static void update_maximum(_Atomic uint64_t* maximum, uint64_t value) {
+    uint64_t current = atomic_load_explicit(maximum, memory_order_relaxed);
+    while (value > current
+        && !atomic_compare_exchange_weak_explicit(maximum, &current, value, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+// Bytes waiting in all of the transmit lanes
+static size_t transmit_length(UartHandle uart) {
+    size_t length = 0;
+    for (uint8_t lane = 0; lane < UART_PRIORITY_COUNT; lane++) length += queue_length(uart->transmit_queues[lane]);
+    return length;
+}
+
+static uint8_t are_transmit_lanes_empty(UartHandle uart) {
+    for (uint8_t lane = 0; lane < UART_PRIORITY_COUNT; lane++) {
+        if (!is_queue_empty(uart->transmit_queues[lane])) return 0;
+    }
+    return 1;
+}
+
+// Reads the status register, picking up any RX error on the way as reading clears it
+static inline uint16_t read_status_register(UartHandle uart, uint32_t* errors) {
+    uint16_t status_register = read_uart_status(uart->registers);
+    if ((status_register>>RX_ERROR_BIT)&0x1) {
+        uart->receive_queue_error = 1;
+        // Counted as received as well as an error, see uart_total_bytes_received
+        (*errors)++;
+    }
+    return status_register;
+}
+
+// Same as above but with the data register in bits 16-23, popped if the status says RX not empty
+static inline uint32_t read_status_and_data_registers(UartHandle uart, uint32_t* errors) {
+    uint32_t snapshot = read_uart_status_and_data(uart->registers);
+    if ((snapshot>>RX_ERROR_BIT)&0x1) {
+        uart->receive_queue_error = 1;
+        (*errors)++;
+    }
+    return snapshot;
+}
+
+static inline uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ULL + (uint64_t)time.tv_nsec;
+}
+
+// Flags anything worth a callback for the notification worker. To keep the ISR short the worker is
+// only woken for the first bytes of a burst (so it can start timing the idle gap), the receive
+// queue reaching its watermark and the transmit space reaching its watermark, not every interrupt.
+// The transmit space watermark is on the normal lane, so only its bytes count in transmitted_normal.
+static void notify(UartHandle uart, uint32_t received, uint32_t transmitted_normal) {
+    uint32_t pending = 0;
+    if (received != 0 && atomic_load_explicit(&uart->receive_callback, memory_order_acquire) != NULL) {
+        if (uart->receive_idle_timeout_ns != 0) {
+            atomic_store_explicit(&uart->last_receive_ns, now_ns(), memory_order_relaxed);
+            // Pairs with the worker clearing receive_idle_timing then checking last_receive_ns
+            atomic_thread_fence(memory_order_seq_cst);
+            if (!atomic_load_explicit(&uart->receive_idle_timing, memory_order_relaxed)) {
+                pending |= 1U << (uart->channel + IDLE_PENDING_SHIFT);
+            }
+        }
+        size_t length = queue_length(uart->receive_queue);
+        size_t watermark = uart->receive_watermark;
+        if (watermark != 0 && length >= watermark && length - received < watermark) {
+            pending |= 1U << (uart->channel + WATERMARK_PENDING_SHIFT);
+        }
+    }
+    if (transmitted_normal != 0 && atomic_load_explicit(&uart->transmit_callback, memory_order_acquire) != NULL) {
+        size_t space = queue_free_space(uart->transmit_queues[UART_PRIORITY_NORMAL]);
+        size_t watermark = uart->transmit_watermark;
+        if (space >= watermark && space - transmitted_normal < watermark) pending |= 1U << (uart->channel + TRANSMIT_PENDING_SHIFT);
+    }
+    if (pending != 0) {
+        atomic_fetch_or_explicit(&notifier.pending, pending, memory_order_release);
+        if (wait_event_has_waiters(&notifier.event)) wait_event_signal(&notifier.event);
+    }
+}
+
+// The uart_poll events the channel is ready for right now
+static uint8_t poll_ready_events(UartHandle uart) {
+    uint8_t ready = 0;
+    if (!is_queue_empty(uart->receive_queue)) ready |= UART_POLL_READABLE;
+    if (queue_free_space(uart->transmit_queues[UART_PRIORITY_NORMAL]) >= uart->poll_write_space) ready |= UART_POLL_WRITABLE;
+    return ready;
+}
+
+// Wakes the channel's poll set, from the ISR. Only the first signal since the poller last drained
+// the eventfd writes it, so a burst across many channels is still one system call.
+static void signal_poll_set(UartHandle uart) {
+    atomic_store_explicit(&uart->poll_signalling, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    UartPollSet* set = atomic_load_explicit(&uart->poll_set, memory_order_acquire);
+    if (set != NULL && !atomic_exchange_explicit(&set->signalled, 1, memory_order_acq_rel)) {
+        uint64_t one = 1;
+        // Can only fail if the count is about to overflow, in which case it's readable anyway
+        ssize_t written = write(set->fd, &one, sizeof(one));
+        (void)written;
+    }
+    atomic_store_explicit(&uart->poll_signalling, 0, memory_order_release);
+}
+
+// Signals the poll set if the ISR has made the channel ready for anything the poller is waiting
+// for. With nothing armed this is a fence and a load. The fence pairs with the one the poller has
+// between arming and looking again, so either the poller sees the change or this sees it armed.
+static void check_poll(UartHandle uart) {
+    atomic_thread_fence(memory_order_seq_cst);
+    uint8_t armed = atomic_load_explicit(&uart->poll_armed, memory_order_relaxed);
+    if (armed == 0) return;
+    uint8_t ready = poll_ready_events(uart) & armed;
+    // Whichever of this and the poller disarms it first is the one that reports it
+    if (ready == 0 || (atomic_fetch_and_explicit(&uart->poll_armed, (uint8_t)~ready, memory_order_relaxed) & ready) == 0) return;
+    signal_poll_set(uart);
+}
+
+// TX interrupt gating. A TX empty interrupt with nothing to send would keep firing, so the ISR masks
+// it once the transmit queue runs dry and the writer unmasks it after queueing more. Both sides go
+// through the set/clear aliases so neither can undo the other's write, and each re-checks the other
+// side after a full fence so it can never end up masked with data still in the queue.
+static inline uint8_t is_tx_interrupt_enabled(UartHandle uart) {
+    uint8_t control = read_uart_status_high(uart->registers);
+    return (control >> (TX_INTERRUPT_ENABLE_BIT - 8)) & 0x1;
+}
+
+// Called by the writer after queueing. Normally the interrupt is already enabled and this is just a
+// register read, it's only written when the queue had drained. While the far end has transmitting
+// paused it's left masked, the ISR unmasks it itself when the XON comes in.
+static void unmask_tx_interrupt(UartHandle uart) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!is_tx_interrupt_enabled(uart) && !atomic_load_explicit(&uart->transmit_paused, memory_order_relaxed)) {
+        set_uart_status_bits(uart->registers, 1U << TX_INTERRUPT_ENABLE_BIT);
+    }
+}
+
+// The ISR's hold on its route source's receive queue. Flagging first and looking at the route
+// after a full fence means uart_unroute, which clears the route then waits for the flag, either
+// stops this from seeing the source or waits for it to finish. NULL if there's no route.
+static UartHandle begin_forwarding(UartHandle uart) {
+    if (atomic_load_explicit(&uart->route_source, memory_order_relaxed) == NULL) return NULL;
+    atomic_store_explicit(&uart->route_forwarding, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    UartHandle source = atomic_load_explicit(&uart->route_source, memory_order_acquire);
+    if (source == NULL) atomic_store_explicit(&uart->route_forwarding, 0, memory_order_release);
+    return source;
+}
+
+static inline void end_forwarding(UartHandle uart) {
+    atomic_store_explicit(&uart->route_forwarding, 0, memory_order_release);
+}
+
+// Whether the route into this channel has bytes waiting to go out
+static uint8_t has_routed_bytes(UartHandle uart) {
+    UartHandle source = begin_forwarding(uart);
+    if (source == NULL) return 0;
+    uint8_t waiting = !is_queue_empty(source->receive_queue);
+    end_forwarding(uart);
+    return waiting;
+}
+
+// Called by the ISR once the transmit lanes and any route into the channel are empty (or
+// transmitting is paused). Returns 1 if a writer (or the route's source ISR) got data in before the
+// mask took effect, in which case the interrupt is left enabled and there's more to send.
+static uint8_t mask_tx_interrupt(UartHandle uart) {
+    clear_uart_status_bits(uart->registers, 1U << TX_INTERRUPT_ENABLE_BIT);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&uart->flow_character, memory_order_relaxed) == 0
+        && (atomic_load_explicit(&uart->transmit_paused, memory_order_relaxed)
+            || (are_transmit_lanes_empty(uart) && !has_routed_bytes(uart)))) {
+        return 0;
+    }
+    // The writer may have seen the interrupt still enabled and left it alone, so put it back
+    set_uart_status_bits(uart->registers, 1U << TX_INTERRUPT_ENABLE_BIT);
+    return 1;
+}
+
+// Picks the lane to send the next message from, the highest priority one with a message waiting
+// unless a lower one has been kept waiting for UART_TX_STARVATION_BYTES, in which case the lowest
+// such lane. NO_TRANSMIT_LANE if there's nothing to send.
+static uint8_t next_transmit_lane(UartHandle uart) {
+    uint8_t chosen = NO_TRANSMIT_LANE;
+    for (int lane = UART_PRIORITY_COUNT - 1; lane >= 0; lane--) {
+        if (is_queue_empty(uart->transmit_queues[lane])) {
+            uart->starved_bytes[lane] = 0;
+        } else if (chosen == NO_TRANSMIT_LANE || uart->starved_bytes[lane] >= UART_TX_STARVATION_BYTES) {
+            chosen = (uint8_t)lane;
+        }
+    }
+    return chosen;
+}
+
+// The last byte of a message from lane has gone into the TX FIFO
+static void transmit_message_sent(UartHandle uart, uint8_t lane) {
+    UartCounters* counters = &uart->counters;
+    counter_add(&counters->tx_messages[lane], 1);
+    // Lower lanes with a message waiting were held up by this one
+    for (uint8_t lower = 0; lower < lane; lower++) {
+        if (!is_queue_empty(uart->transmit_queues[lower])) uart->starved_bytes[lower] += uart->transmit_message_bytes;
+    }
+    uart->starved_bytes[lane] = 0;
+    uart->transmit_message_bytes = 0;
+    uart->transmit_lane = NO_TRANSMIT_LANE;
+
+    TransmitProbe* probe = &uart->probes[lane];
+    if (atomic_load_explicit(&probe->state, memory_order_acquire) == PROBE_ARMED
+        && probe->end == queue_consumed_index(uart->transmit_queues[lane])) {
+        uint64_t latency = now_ns() - probe->committed_ns;
+        counter_add(&counters->tx_latency_samples[lane], 1);
+        counter_add(&counters->tx_latency_total_ns[lane], latency);
+        update_maximum(&uart->tx_latency_max_ns[lane], latency);
+        atomic_store_explicit(&probe->state, PROBE_FREE, memory_order_release);
+    }
+}
+
+// How many more bytes the ISR can queue before the far end has to be told to stop, SIZE_MAX if it
+// doesn't need telling (no flow control, or it already has been)
+static inline size_t receive_room(UartHandle uart) {
+    if (uart->flow_control == UART_FLOW_NONE || atomic_load_explicit(&uart->receive_stopped, memory_order_relaxed)) {
+        return SIZE_MAX;
+    }
+    size_t length = queue_length(uart->receive_queue);
+    return length < uart->flow_high_watermark ? uart->flow_high_watermark - length : 1;
+}
+
+// Tells the far end to stop sending, from the ISR. The line is changed before receive_stopped is set
+// so that a reader that sees it set always has something to undo.
+static void stop_receiving(UartHandle uart) {
+    if (uart->flow_control == UART_FLOW_RTS_CTS) {
+        clear_uart_status_bits(uart->registers, 1U << RTS_BIT);
+    } else {
+        // The TX loop further on in this interrupt picks it up
+        atomic_store_explicit(&uart->flow_character, UART_XOFF, memory_order_relaxed);
+        set_uart_status_bits(uart->registers, 1U << TX_INTERRUPT_ENABLE_BIT);
+    }
+    atomic_store_explicit(&uart->receive_stopped, 1, memory_order_release);
+    counter_add(&uart->counters.rx_flow_stops, 1);
+}
+
+// Tells the far end to carry on, from the reader once the receive queue is down to the low watermark
+static void resume_receiving(UartHandle uart) {
+    uint8_t stopped = 1;
+    if (!atomic_compare_exchange_strong_explicit(&uart->receive_stopped, &stopped, 0, memory_order_acquire, memory_order_relaxed)) {
+        return;
+    }
+    if (uart->flow_control == UART_FLOW_RTS_CTS) {
+        set_uart_status_bits(uart->registers, 1U << RTS_BIT);
+    } else {
+        // Replaces the XOFF if it hasn't gone yet. Unmasked even if transmitting is paused, flow
+        // characters still go out then.
+        atomic_store_explicit(&uart->flow_character, UART_XON, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!is_tx_interrupt_enabled(uart)) set_uart_status_bits(uart->registers, 1U << TX_INTERRUPT_ENABLE_BIT);
+    }
+}
+
+// Lets the far end carry on once the reader (or a route) has taken the receive queue down to the low watermark
+static inline void check_receive_resume(UartHandle uart) {
+    if (atomic_load_explicit(&uart->receive_stopped, memory_order_relaxed)
+        && queue_length(uart->receive_queue) <= uart->flow_low_watermark) {
+        resume_receiving(uart);
+    }
+}
+
+// Sends bytes out of the route source's receive queue straight into the TX FIFO for as long as it
+// takes them, then consumes them from the source. The queue is peeked again after each consume as
+// a burst in borrowed segments is only shown a couple of segments at a time. Returns how many went,
+// with status_register updated the same as the transmit loop does.
+static uint32_t forward_routed(UartHandle uart, uint16_t* status_register, uint32_t* errors) {
+    UartHandle source = begin_forwarding(uart);
+    if (source == NULL) return 0;
+    uint32_t forwarded = 0;
+    UartBuffer spans[2];
+    while ((*status_register & TX_INTERRUPT_BITS) == TX_INTERRUPT_BITS
+        && queue_peek(source->receive_queue, &spans[0], &spans[1]) == SUCCESS) {
+        size_t sent = 0;
+        size_t shown = spans[0].size + spans[1].size;
+        while (sent < shown && (*status_register & TX_INTERRUPT_BITS) == TX_INTERRUPT_BITS) {
+            uint8_t data = sent < spans[0].size ? spans[0].data[sent] : spans[1].data[sent - spans[0].size];
+            write_uart_data(uart->registers, data);
+            sent++;
+            *status_register = read_status_register(uart, errors);
+        }
+        queue_consume(source->receive_queue, sent);
+        forwarded += (uint32_t)sent;
+    }
+    if (forwarded != 0) {
+        counter_add(&source->route_bytes, forwarded);
+        check_receive_resume(source);
+    }
+    end_forwarding(uart);
+    return forwarded;
+}
+
+// XON or XOFF from the far end, in the ISR
+static void transmit_flow(UartHandle uart, uint8_t character) {
+    uint8_t paused = atomic_load_explicit(&uart->transmit_paused, memory_order_relaxed);
+    if (character == UART_XOFF && !paused) {
+        atomic_store_explicit(&uart->transmit_paused, 1, memory_order_relaxed);
+        counter_add(&uart->counters.tx_flow_stops, 1);
+    } else if (character == UART_XON && paused) {
+        // The writers don't unmask while paused so it's done here, after which the status read
+        // that follows shows it
+        atomic_store_explicit(&uart->transmit_paused, 0, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        set_uart_status_bits(uart->registers, 1U << TX_INTERRUPT_ENABLE_BIT);
+    }
+}
+
+void uart_isr(UartHandle uart) {
     // Assuming here that some combination of the reads and writes done here clear the interrupt
     // and that there's no dedicated interrupt clearing required
+    if (uart == NULL) return;
+    atomic_store_explicit(&uart->in_isr, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!uart->is_initialised || atomic_load_explicit(&uart->isr_stopped, memory_order_relaxed)) {
+        atomic_store_explicit(&uart->in_isr, 0, memory_order_release);
+        return;
+    }
+    uint64_t start_cycles = read_cycle_counter();
+#ifdef UART_TRACE
+    // The queue lengths go in the trace so that a replay can put them back the way they were
+    if (trace_begin()) {
+        trace_end(TRACE_ISR_ENTER, uart->channel,
+            (uint32_t)queue_length(uart->receive_queue) | ((uint32_t)transmit_length(uart) << 16));
+    }
+#endif
 
-    uint16_t status_register = read_address_16bit((uint16_t*)STATUS_REGISTER_ADDRESS);
-    if ((status_register>>RX_ERROR_BIT)&0x1) {
-        // Check the Rx Error bit
-        receive_queue_error = 1;
-        // Assuming here that still increment bytes received even if there is an error, 
-        // if didn't want to do this then remove this line
-        bytes_received++; 
-    } else if ((status_register & RX_INTERRUPT_BITS) == RX_INTERRUPT_BITS) {
-        // Read from UART and add to receive queue
-        uint8_t data = read_address_8bit((uint16_t*)DATA_REGISTER_ADDRESS);
-        // Assume here received data means received from UART rather than received and added to queue
-        // If the latter then should check if queue full first then if there's no error read data register and increment counter
-        bytes_received++;
-
-        if (is_queue_full(receive_queue)) {
-            // Check if receive queue is full
-            receive_queue_error = 1;
+    // Counted locally and published once at the end
+    uint32_t received = 0;
+    uint32_t dropped = 0;
+    uint32_t transmitted = 0;
+    uint32_t transmitted_normal = 0; // Out of transmitted, for the transmit space watermark
+    uint32_t forwarded = 0; // Sent for a route, kept apart as it frees no space in the transmit lanes
+    uint32_t errors = 0;
+
+    // The hardware has FIFOs so each interrupt empties the RX FIFO and fills the TX FIFO as far as
+    // it can, rather than moving one byte per interrupt. While receiving, the status and data
+    // registers are read together in one access rather than two.
+    size_t room = receive_room(uart);
+    uint32_t snapshot = read_status_and_data_registers(uart, &errors);
+    while ((snapshot & RX_INTERRUPT_BITS) == RX_INTERRUPT_BITS) {
+        // Add the byte from the UART to the receive queue
+        uint8_t data = (uint8_t)(snapshot >> 16);
+        if (uart->flow_control == UART_FLOW_XON_XOFF && (data == UART_XON || data == UART_XOFF)) {
+            transmit_flow(uart, data);
+            snapshot = read_status_and_data_registers(uart, &errors);
+            continue;
+        }
+
+        // The queue is lock-free so this never blocks, BUSY means the receive queue is full
+        Status return_status = enqueue(uart->receive_queue, data);
+        if (return_status == SUCCESS) {
+            received++;
+            if (received == room) stop_receiving(uart);
         } else {
-            Status return_status = enqueue(receive_queue, data); // Note here would use ISR safe enqueuing
-            if (return_status != SUCCESS) {
-                receive_queue_error = 1;
-            }
+            uart->receive_queue_error = 1;
+            dropped++;
         }
+        snapshot = read_status_and_data_registers(uart, &errors);
     }
 
-    if ((status_register & TX_INTERRUPT_BITS) == TX_INTERRUPT_BITS) {
-        // Read from transmit queue and add to UART
+    uint16_t status_register = (uint16_t)snapshot;
+    while ((status_register & TX_INTERRUPT_BITS) == TX_INTERRUPT_BITS) {
+        // XON/XOFF go out ahead of everything else, even while transmitting is paused
+        if (atomic_load_explicit(&uart->flow_character, memory_order_relaxed) != 0) {
+            uint8_t flow_character = atomic_exchange_explicit(&uart->flow_character, 0, memory_order_relaxed);
+            if (flow_character != 0) {
+                write_uart_data(uart->registers, flow_character);
+                status_register = read_status_register(uart, &errors);
+                continue;
+            }
+        }
+        if (atomic_load_explicit(&uart->transmit_paused, memory_order_relaxed)) {
+            // Part way through a message is fine, it carries on from there after the XON
+            if (mask_tx_interrupt(uart)) continue;
+            break;
+        }
+        // A lane is only picked between messages so they're never split up
+        if (uart->transmit_lane == NO_TRANSMIT_LANE) {
+            uart->transmit_lane = next_transmit_lane(uart);
+            if (uart->transmit_lane == NO_TRANSMIT_LANE) {
+                // Routed bytes go out between messages, once the lanes have nothing waiting
+                uint32_t routed = forward_routed(uart, &status_register, &errors);
+                if (routed != 0) {
+                    forwarded += routed;
+                    continue;
+                }
+                // If the transmit lanes are all empty then nothing more to do, stop the TX
+                // interrupt until there's more
+                if (mask_tx_interrupt(uart)) continue;
+                break;
+            }
+        }
+        // Read from the lane's queue and add to UART
+        uint8_t lane = uart->transmit_lane;
         uint8_t data;
-        Status return_status = dequeue(transmit_queue, &data); // Note here would use ISR safe dequeuing
-        // If transmit queue is empty will just skip this
-        if (return_status == SUCCESS) {
-            write_address_8bit((uint16_t*)DATA_REGISTER_ADDRESS, data);
-        } else if (return_status == FAILURE) {
+        uint8_t message_end;
+        Status return_status = dequeue_shared(uart->transmit_queues[lane], &data, &message_end);
+        if (return_status != SUCCESS) {
             // If there's an error in dequeuing flag error
-            transmit_queue_error = 1;
+            if (return_status == FAILURE) {
+                uart->transmit_queue_error = 1;
+                break;
+            }
+            // Messages are only ever published whole so this shouldn't happen part way through
+            // one, but if it does just pick again
+            uart->transmit_lane = NO_TRANSMIT_LANE;
+            continue;
+        }
+        write_uart_data(uart->registers, data);
+        transmitted++;
+        if (lane == UART_PRIORITY_NORMAL) transmitted_normal++;
+        uart->transmit_message_bytes++;
+        if (message_end) transmit_message_sent(uart, lane);
+        status_register = read_status_register(uart, &errors);
+    }
+
+    // Anything received on a routed channel is for the destination's transmitter to send
+    if (received != 0) {
+        UartHandle destination = atomic_load_explicit(&uart->route_destination, memory_order_acquire);
+        if (destination != NULL) unmask_tx_interrupt(destination);
+    }
+
+    // Wake any blocked reader/writer, but only once per interrupt and only if it now has enough
+    if (received && wait_event_has_waiters(&uart->receive_event)
+        && queue_length(uart->receive_queue) >= atomic_load_explicit(&uart->receive_bytes_wanted, memory_order_relaxed)) {
+        wait_event_signal(&uart->receive_event);
+    }
+    if (transmitted && wait_event_has_waiters(&uart->transmit_event)) {
+        uint8_t wake = 0;
+        for (uint8_t lane = 0; lane < UART_PRIORITY_COUNT; lane++) {
+            _Atomic size_t* wanted = &uart->transmit_space_wanted[lane];
+            if (queue_free_space(uart->transmit_queues[lane]) >= atomic_load_explicit(wanted, memory_order_relaxed)) {
+                // Every waiting writer wakes and puts its own count back if it still has to wait
+                atomic_store_explicit(wanted, SIZE_MAX, memory_order_relaxed);
+                wake = 1;
+            }
+        }
+        if (wake) wait_event_signal(&uart->transmit_event);
+    }
+
+    if (received != 0 || transmitted != 0) check_poll(uart);
+
+    UartCounters* counters = &uart->counters;
+    if (received != 0) {
+        counter_add(&counters->rx_bytes, received);
+        update_high_watermark(&uart->rx_queue_high_watermark, queue_length(uart->receive_queue));
+    }
+    if (dropped != 0) counter_add(&counters->rx_dropped, dropped);
+    if (errors != 0) counter_add(&counters->rx_errors, errors);
+    if (transmitted + forwarded != 0) counter_add(&counters->tx_bytes, transmitted + forwarded);
+    counter_add(&counters->isr_count, 1);
+    if (received == 0 && dropped == 0 && errors == 0 && transmitted == 0 && forwarded == 0) {
+        counter_add(&counters->isr_spurious, 1);
+    }
+    if (received != 0 || transmitted_normal != 0) notify(uart, received, transmitted_normal);
+    uint64_t cycles = read_cycle_counter() - start_cycles;
+    uint32_t bucket = cycles == 0 ? 0 : 64 - __builtin_clzll(cycles);
+    if (bucket >= UART_ISR_HISTOGRAM_BUCKETS) bucket = UART_ISR_HISTOGRAM_BUCKETS - 1;
+    counter_add(&counters->isr_cycles_histogram[bucket], 1);
+#ifdef UART_TRACE
+    if (trace_begin()) trace_end(TRACE_ISR_EXIT, uart->channel, 0);
+#endif
+    atomic_store_explicit(&uart->in_isr, 0, memory_order_release);
+}
+
+// If this was running on a true processor these would be declared as:
+// void __attribute__((interrupt)) uartN_isr(void)
+void uart0_isr(void) { uart_isr(&uarts[0]); }
+void uart1_isr(void) { uart_isr(&uarts[1]); }
+void uart2_isr(void) { uart_isr(&uarts[2]); }
+void uart3_isr(void) { uart_isr(&uarts[3]); }
+void uart4_isr(void) { uart_isr(&uarts[4]); }
+void uart5_isr(void) { uart_isr(&uarts[5]); }
+void uart6_isr(void) { uart_isr(&uarts[6]); }
+void uart7_isr(void) { uart_isr(&uarts[7]); }
+
+static const InterruptHandler uart_isr_entries[] = {
+    uart0_isr, uart1_isr, uart2_isr, uart3_isr, uart4_isr, uart5_isr, uart6_isr, uart7_isr
+};
+
+// Runs whichever of the channel's callbacks are due. Returns when the idle timeout will next need
+// looking at, UINT64_MAX if it won't.
+static uint64_t run_notifications(UartHandle uart, uint32_t pending, uint64_t now) {
+    uint8_t channel = uart->channel;
+    UartCallback receive = atomic_load_explicit(&uart->receive_callback, memory_order_acquire);
+    if (receive != NULL) {
+        if ((pending >> (channel + WATERMARK_PENDING_SHIFT)) & 0x1 && queue_length(uart->receive_queue) >= uart->receive_watermark) {
+            // Everything so far is covered by this callback, the idle one only goes for newer bytes
+            uart->receive_notified_ns = atomic_load_explicit(&uart->last_receive_ns, memory_order_relaxed);
+            receive(uart, UART_EVENT_RX_WATERMARK, uart->receive_context);
+        }
+        if (uart->receive_idle_timeout_ns != 0) {
+            atomic_store_explicit(&uart->receive_idle_timing, 0, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            uint64_t last_receive = atomic_load_explicit(&uart->last_receive_ns, memory_order_relaxed);
+            if (last_receive != uart->receive_notified_ns) {
+                uint64_t deadline = last_receive + uart->receive_idle_timeout_ns;
+                if (now < deadline) {
+                    // Still receiving (or only just stopped), so the ISR doesn't need to wake us
+                    atomic_store_explicit(&uart->receive_idle_timing, 1, memory_order_relaxed);
+                    return deadline;
+                }
+                uart->receive_notified_ns = last_receive;
+                receive(uart, UART_EVENT_RX_IDLE, uart->receive_context);
+            }
+        }
+    }
+    UartCallback transmit = atomic_load_explicit(&uart->transmit_callback, memory_order_acquire);
+    if (transmit != NULL && (pending >> (channel + TRANSMIT_PENDING_SHIFT)) & 0x1) {
+        transmit(uart, UART_EVENT_TX_SPACE, uart->transmit_context);
+    }
+    return UINT64_MAX;
+}
+
+static void* notification_worker(void* argument) {
+    (void)argument;
+    while (1) {
+        uint32_t sequence = wait_event_prepare(&notifier.event);
+        uint32_t pending = atomic_exchange_explicit(&notifier.pending, 0, memory_order_acquire);
+        uint64_t now = now_ns();
+        uint64_t next_deadline = UINT64_MAX;
+        pthread_mutex_lock(&notifier.lock);
+        for (uint8_t channel = 0; channel < UART_CHANNEL_COUNT; channel++) {
+            uint64_t deadline = run_notifications(&uarts[channel], pending, now);
+            if (deadline < next_deadline) next_deadline = deadline;
+        }
+        pthread_mutex_unlock(&notifier.lock);
+
+        if (atomic_load_explicit(&notifier.pending, memory_order_relaxed) == 0) {
+            if (next_deadline == UINT64_MAX) {
+                wait_event_wait(&notifier.event, sequence, NULL);
+            } else {
+                struct timespec deadline = { .tv_sec = (time_t)(next_deadline / 1000000000ULL),
+                    .tv_nsec = (long)(next_deadline % 1000000000ULL) };
+                wait_event_wait(&notifier.event, sequence, &deadline);
+            }
         }
-        // If the transmit queue is empty then nothing happens
+        wait_event_finish(&notifier.event);
+    }
+    return NULL;
+}
+
+static void start_notifier(void) {
+    wait_event_init(&notifier.event);
+    notifier.started = pthread_create(&notifier.thread, NULL, notification_worker, NULL) == 0;
+    if (notifier.started) pthread_detach(notifier.thread);
+}
+
+// Callbacks run with the lock held, so when one of them changes a callback it's already got it
+static uint8_t lock_notifier(void) {
+    if (notifier.started && pthread_equal(pthread_self(), notifier.thread)) return 0;
+    pthread_mutex_lock(&notifier.lock);
+    return 1;
+}
+
+static void unlock_notifier(uint8_t locked) {
+    if (locked) pthread_mutex_unlock(&notifier.lock);
+}
+
+Status uart_set_receive_callback(UartHandle uart, size_t watermark, uint32_t idle_timeout_us, UartCallback callback, void* context) {
+    if (uart == NULL || !uart->is_initialised || watermark > queue_capacity(uart->receive_queue)) return FAILURE;
+    if (callback != NULL && watermark == 0 && idle_timeout_us == 0) return FAILURE;
+    pthread_once(&notifier_once, start_notifier);
+    if (!notifier.started) return FAILURE;
+
+    uint8_t locked = lock_notifier();
+    // The ISR reads the settings without the lock, so they're only changed with the callback off
+    atomic_store(&uart->receive_callback, NULL);
+    uart->receive_context = context;
+    uart->receive_watermark = watermark;
+    uart->receive_idle_timeout_ns = (uint64_t)idle_timeout_us * 1000;
+    uart->receive_notified_ns = atomic_load(&uart->last_receive_ns);
+    atomic_store(&uart->receive_idle_timing, 0);
+    atomic_store_explicit(&uart->receive_callback, callback, memory_order_release);
+    unlock_notifier(locked);
+    return SUCCESS;
+}
+
+Status uart_set_transmit_callback(UartHandle uart, size_t space_watermark, UartCallback callback, void* context) {
+    if (uart == NULL || !uart->is_initialised || space_watermark > queue_capacity(uart->transmit_queues[UART_PRIORITY_NORMAL])) {
+        return FAILURE;
+    }
+    pthread_once(&notifier_once, start_notifier);
+    if (!notifier.started) return FAILURE;
+
+    uint8_t locked = lock_notifier();
+    atomic_store(&uart->transmit_callback, NULL);
+    uart->transmit_context = context;
+    uart->transmit_watermark = space_watermark;
+    atomic_store_explicit(&uart->transmit_callback, callback, memory_order_release);
+    unlock_notifier(locked);
+    return SUCCESS;
+}
+
+// Deletes the channel's queues (the static ones are just let go of)
+static void release_queues(UartHandle uart) {
+    for (uint8_t lane = 0; lane < UART_PRIORITY_COUNT; lane++) {
+#ifndef UART_STATIC_QUEUES
+        delete_queue(uart->transmit_queues[lane]);
+#endif
+        uart->transmit_queues[lane] = NULL;
     }
+#ifndef UART_STATIC_QUEUES
+    delete_queue(uart->receive_queue);
+#else
+    queue_release_segments(uart->receive_queue);
+#endif
+    uart->receive_queue = NULL;
 }
 
-Status initialise_uart(void) {
+Status initialise_uart(uint8_t channel, const UartConfig* config, UartHandle* handle) {
+    static const UartConfig default_config = UART_DEFAULT_CONFIG;
+    if (channel >= UART_CHANNEL_COUNT || handle == NULL) return FAILURE;
+    if (config == NULL) config = &default_config;
+    struct Uart* uart = &uarts[channel];
+    if (uart->is_initialised) return BUSY;
+
     // Initialise queues
-    transmit_queue = initialise_queue(QUEUE_SIZE);
-    receive_queue = initialise_queue(QUEUE_SIZE);
-    
-    if (transmit_queue == NULL || receive_queue == NULL) {
+#ifdef UART_STATIC_QUEUES
+    const StaticQueues* queues = &static_queues[channel];
+    if (queues->receive_queue == NULL) return FAILURE; // Channel left out of UART_STATIC_QUEUE_CAPACITIES
+    if (initialise_static_queue(queues->receive_queue, queues->receive_storage, queues->receive_capacity) != SUCCESS) return FAILURE;
+    for (uint8_t lane = 0; lane < UART_PRIORITY_COUNT; lane++) {
+        const StaticTransmitLane* queue = &queues->transmit_lanes[lane];
+        if (initialise_static_shared_queue(queue->queue, queue->storage, queue->commits, queue->message_ends, queue->capacity) != SUCCESS) {
+            return FAILURE;
+        }
+        uart->transmit_queues[lane] = queue->queue;
+    }
+    uart->receive_queue = queues->receive_queue;
+#else
+    // Any number of tasks can write to a channel so the transmit lanes take shared producers
+    const uint16_t lane_sizes[UART_PRIORITY_COUNT] = {
+        [UART_PRIORITY_NORMAL] = config->transmit_queue_size,
+        [UART_PRIORITY_HIGH] = config->priority_queue_size
+    };
+    uint8_t failed = 0;
+    for (uint8_t lane = 0; lane < UART_PRIORITY_COUNT; lane++) {
+        uart->transmit_queues[lane] = initialise_shared_queue(lane_sizes[lane]);
+        failed |= uart->transmit_queues[lane] == NULL;
+    }
+    uart->receive_queue = initialise_queue(config->receive_queue_size);
+
+    if (failed || uart->receive_queue == NULL) {
+        release_queues(uart);
+        return FAILURE;
+    }
+#endif
+    if (queue_set_elastic(uart->receive_queue, config->receive_burst_size) != SUCCESS) {
+        release_queues(uart);
+        return FAILURE;
+    }
+
+    // Flow control watermarks default to three quarters and a quarter of the receive queue
+    size_t receive_capacity = queue_capacity(uart->receive_queue);
+    size_t high_watermark = config->flow_high_watermark != 0 ? config->flow_high_watermark : receive_capacity - receive_capacity / 4;
+    size_t low_watermark = config->flow_low_watermark != 0 ? config->flow_low_watermark : receive_capacity / 4;
+    if ((unsigned)config->flow_control > UART_FLOW_XON_XOFF || high_watermark > receive_capacity || low_watermark >= high_watermark) {
+        release_queues(uart);
         return FAILURE;
     }
+    uart->flow_control = (uint8_t)config->flow_control;
+    uart->flow_high_watermark = (uint16_t)high_watermark;
+    uart->flow_low_watermark = (uint16_t)low_watermark;
+    atomic_init(&uart->transmit_paused, 0);
+    atomic_init(&uart->receive_stopped, 0);
+    atomic_init(&uart->flow_character, 0);
+
+    uart->channel = channel;
+    uart->status_register = (uint16_t*)(uintptr_t)UART_STATUS_REGISTER_ADDRESS(channel);
+    uart->data_register = (uint16_t*)(uintptr_t)UART_DATA_REGISTER_ADDRESS(channel);
+    uart->registers = uart_registers(channel);
 
-    // Initialise bytes received to 0
-    bytes_received = 0;
+    // Set the FIFO thresholds before the interrupts are turned on
+    write_address_16bit((uint16_t*)(uintptr_t)UART_FIFO_CONTROL_REGISTER_ADDRESS(channel),
+        (uint16_t)((config->tx_empty_threshold << 8) | config->rx_trigger_level));
+
+    // Initialise the counters to 0
+    memset((void*)&uart->counters, 0, sizeof(uart->counters));
+    memset(&uart->stats_baseline, 0, sizeof(uart->stats_baseline));
+    atomic_init(&uart->rx_queue_high_watermark, 0);
+    atomic_init(&uart->tx_queue_high_watermark, 0);
+    uart->transmit_lane = NO_TRANSMIT_LANE;
+    uart->transmit_message_bytes = 0;
+    for (uint8_t lane = 0; lane < UART_PRIORITY_COUNT; lane++) {
+        atomic_init(&uart->tx_latency_max_ns[lane], 0);
+        uart->starved_bytes[lane] = 0;
+        atomic_init(&uart->probes[lane].state, PROBE_FREE);
+        atomic_init(&uart->transmit_space_wanted[lane], SIZE_MAX);
+    }
 
     // Initialise that the receive queue has not overflown
-    receive_queue_error = 0;
-    transmit_queue_error = 0;
+    uart->receive_queue_error = 0;
+    uart->transmit_queue_error = 0;
+
+    wait_event_init(&uart->receive_event);
+    wait_event_init(&uart->transmit_event);
+    atomic_init(&uart->receive_bytes_wanted, 0);
+    uart->receive_scanned = 0;
+    atomic_store(&uart->receive_callback, NULL);
+    atomic_store(&uart->transmit_callback, NULL);
+    atomic_store(&uart->last_receive_ns, 0);
+    atomic_store(&uart->route_source, NULL);
+    atomic_store(&uart->route_destination, NULL);
+    atomic_store(&uart->route_forwarding, 0);
+    atomic_store(&uart->poll_set, NULL);
+    atomic_store(&uart->poll_armed, 0);
+    atomic_store(&uart->poll_signalling, 0);
+    atomic_store(&uart->in_isr, 0);
+    atomic_store(&uart->isr_stopped, 0);
 
     // Initialising UART
     // Get status register state
-    uint16_t status_register_state = read_address_16bit((uint16_t*)STATUS_REGISTER_ADDRESS);
+    uint16_t status_register_state = read_address_16bit(uart->status_register);
     // Set interrupt bit to enable interrupts
     status_register_state |= (1U << INTERRUPT_ENABLE_BIT);
     // Set Tx Enable bit
     status_register_state |= (1U << TX_ENABLE_BIT);
     // Set Rx Enable bit
     status_register_state |= (1U << RX_ENABLE_BIT);
+    // Nothing to send yet so the TX interrupt starts masked, the first write unmasks it
+    status_register_state &= ~(1U << TX_INTERRUPT_ENABLE_BIT);
+    // Ready to receive, and with hardware flow control the transmitter waits for the far end's CTS
+    status_register_state |= (1U << RTS_BIT);
+    if (uart->flow_control == UART_FLOW_RTS_CTS) {
+        status_register_state |= (1U << AUTO_CTS_ENABLE_BIT);
+    } else {
+        status_register_state &= ~(1U << AUTO_CTS_ENABLE_BIT);
+    }
     // Write updated status register
-    write_address_16bit((uint16_t*)STATUS_REGISTER_ADDRESS, status_register_state);
+    write_address_16bit(uart->status_register, status_register_state);
+
+    uart->is_initialised = 1;
+    *handle = uart;
+    set_interrupt_handler(channel, uart_isr_entries[channel]);
 
     INTERRUPT_ENABLE(); // Assuming here that we want to enable global interrupts
 
     return SUCCESS;
 }
 
-void stop_uart(void) {
-    // Disable global interrupts
-    INTERRUPT_DISABLE();
+void stop_uart(UartHandle uart) {
+    if (uart == NULL || !uart->is_initialised) return;
+
+    // Routes in or out of the channel come down first, so neither end's ISR is left using it
+    uart_unroute(uart);
+    UartHandle source = atomic_load(&uart->route_source);
+    if (source != NULL) uart_unroute(source);
+    UartPollSet* set = atomic_load(&uart->poll_set);
+    if (set != NULL) uart_poll_remove(set, uart);
 
-    // Disable UART peripheral
+    // Only this channel is being stopped so global interrupts are left alone, disabling the
+    // channel's own interrupt enable bit is enough to stop its ISR firing
     // Get status register state
-    uint16_t status_register_state = read_address_16bit((uint16_t*)STATUS_REGISTER_ADDRESS);
+    uint16_t status_register_state = read_address_16bit(uart->status_register);
     // Set interrupt bit to disable interrupts
     status_register_state &= ~(1U << INTERRUPT_ENABLE_BIT) ;
     // Set Tx Enable bit to disable
     status_register_state &= ~(1U << TX_ENABLE_BIT);
     // Set Rx Enable bit to disable
     status_register_state &= ~(1U << RX_ENABLE_BIT);
+    status_register_state &= ~(1U << TX_INTERRUPT_ENABLE_BIT);
+    status_register_state &= ~((1U << RTS_BIT) | (1U << AUTO_CTS_ENABLE_BIT));
     // Write updated status register
-    write_address_16bit((uint16_t*)STATUS_REGISTER_ADDRESS, status_register_state);
+    write_address_16bit(uart->status_register, status_register_state);
+    set_interrupt_handler(uart->channel, NULL);
+    // An ISR may already have been called before the handler went, it's left to finish. Any that
+    // gets in after this sees isr_stopped and does nothing.
+    atomic_store_explicit(&uart->isr_stopped, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (atomic_load_explicit(&uart->in_isr, memory_order_acquire)) sched_yield();
+
+    // No more callbacks once this returns
+    uint8_t locked = lock_notifier();
+    atomic_store(&uart->receive_callback, NULL);
+    atomic_store(&uart->transmit_callback, NULL);
+    unlock_notifier(locked);
 
     // Deleting queues and freeing memory
-    delete_queue(transmit_queue);
-    delete_queue(receive_queue);
+    uart->is_initialised = 0;
+    release_queues(uart);
 }
 
-Status uart_write_bytes_to_transmit_queue(uint8_t* data, size_t size) {
-    uint32_t counter = 0; // This wouldn't be here in real system, just here for this purpose
-    Status status;
-    for (uint16_t index = 0; index < size; index++) {
-        status = enqueue(transmit_queue, data[index]);
-        while (status == BUSY) {
-            // Some sort of delay here that allows other tasks to continue
-            // eg: vTaskDelay(1);
-            counter++;
+// As full as the receive queue can be counted on getting. With flow control the far end stops at
+// the high watermark, so waiting for any more than that could wait forever.
+static inline size_t receive_limit(UartHandle uart) {
+    return uart->flow_control != UART_FLOW_NONE ? uart->flow_high_watermark : queue_capacity(uart->receive_queue);
+}
 
-            status = enqueue(transmit_queue, data[index]);
+// Keeps the read until scan position in step when bytes are taken off the receive queue some other way
+static inline void receive_consumed(UartHandle uart, size_t count) {
+    uart->receive_scanned = uart->receive_scanned > count ? uart->receive_scanned - count : 0;
+    check_receive_resume(uart);
+}
+
+// Copies the next bytes of a message into a reservation. buffer and offset say how far through
+// the message's buffers the copying has got.
+static void copy_to_reservation(const QueueReservation* reservation, const UartBuffer* buffers, size_t* buffer, size_t* offset) {
+    for (int i = 0; i < 2; i++) {
+        uint8_t* out = reservation->spans[i].data;
+        size_t left = reservation->spans[i].size;
+        while (left != 0) {
+            const UartBuffer* from = &buffers[*buffer];
+            size_t count = from->size - *offset < left ? from->size - *offset : left;
+            memcpy(out, &from->data[*offset], count);
+            out += count;
+            left -= count;
+            *offset += count;
+            if (*offset == from->size) {
+                (*buffer)++;
+                *offset = 0;
+            }
+        }
+    }
+}
+
+// Lowers the lane's transmit_space_wanted to size if it's more. With several writers waiting it
+// holds the least any of them needs, the ISR puts it back to SIZE_MAX when it wakes them.
+static void want_transmit_space(UartHandle uart, UartPriority priority, size_t size) {
+    _Atomic size_t* wanted_space = &uart->transmit_space_wanted[priority];
+    size_t wanted = atomic_load_explicit(wanted_space, memory_order_relaxed);
+    while (size < wanted && !atomic_compare_exchange_weak(wanted_space, &wanted, size)) {
+    }
+}
+
+// Times the message if nothing else in its lane is being timed
+static void probe_message(UartHandle uart, UartPriority priority, const QueueReservation* reservation) {
+    TransmitProbe* probe = &uart->probes[priority];
+    uint8_t expected = PROBE_FREE;
+    if (atomic_load_explicit(&probe->state, memory_order_relaxed) != PROBE_FREE
+        || !atomic_compare_exchange_strong_explicit(&probe->state, &expected, PROBE_CLAIMED, memory_order_acquire, memory_order_relaxed)) {
+        return;
+    }
+    probe->end = reservation->start + reservation->size;
+    probe->committed_ns = now_ns();
+    atomic_store_explicit(&probe->state, PROBE_ARMED, memory_order_release);
+}
+
+// Commits a message to its lane and lets the ISR know there's something to send. If an earlier
+// writer is still filling its message this one isn't out yet, but then that writer unmasks once its
+// commit publishes both.
+static Status commit_message(UartHandle uart, UartPriority priority, const QueueReservation* reservation) {
+    probe_message(uart, priority, reservation);
+    Status status = queue_commit_shared(uart->transmit_queues[priority], reservation);
+    if (status == SUCCESS) {
+        unmask_tx_interrupt(uart);
+        update_high_watermark(&uart->tx_queue_high_watermark, transmit_length(uart));
+    }
+    return status;
+}
+
+// Queues the message made up of buffers until it's all in or the deadline (NULL for none) passes.
+// Space for the whole message is reserved in one go, so there's no lock between writers. Rather
+// than spinning while the queue is full it sleeps until the ISR has freed up enough space.
+static Status transmit_until(UartHandle uart, UartPriority priority, const UartBuffer* buffers, size_t buffer_count,
+    const struct timespec* deadline, size_t* bytes_written) {
+    size_t size = 0;
+    for (size_t i = 0; i < buffer_count; i++) size += buffers[i].size;
+    Queue* queue = uart->transmit_queues[priority];
+    size_t capacity = queue_capacity(queue);
+    size_t index = 0;
+    size_t buffer = 0;
+    size_t offset = 0;
+    Status status = SUCCESS;
+    while (index < size) {
+        // Messages longer than the queue can only go in a piece at a time
+        size_t chunk = size - index < capacity ? size - index : capacity;
+        QueueReservation reservation;
+        Status queue_status = queue_reserve_shared(queue, chunk, &reservation);
+        if (queue_status == SUCCESS) {
+            copy_to_reservation(&reservation, buffers, &buffer, &offset);
+            status = commit_message(uart, priority, &reservation);
+            if (status != SUCCESS) break; // Not queued, so not counted as written
+            index += chunk;
+            continue;
         }
         // If there's some sort of failure of the queue, this wouldn't happen in my implementation
         // But if there were some sort of FreeRTOS Queue error that would be caught here
-        if (status == FAILURE) { 
-            return FAILURE;
+        if (queue_status == FAILURE) {
+            status = FAILURE;
+            break;
         }
+
+        // Wait for room for the message. Lowering the wanted count after prepare means that if the
+        // ISR resets it before this writer is asleep, its signal still wakes this writer.
+        uint32_t sequence = wait_event_prepare(&uart->transmit_event);
+        want_transmit_space(uart, priority, chunk);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (queue_free_space(queue) < chunk) {
+            status = wait_event_wait(&uart->transmit_event, sequence, deadline);
+        }
+        wait_event_finish(&uart->transmit_event);
+        if (status == BUSY) break; // Timed out
     }
-    return SUCCESS;
+    if (bytes_written != NULL) *bytes_written = index;
+    return status;
 }
 
-Status uart_read_bytes_from_receive_queue_blocking(uint8_t* data, size_t size) {
-    uint32_t counter = 0; // This wouldn't be here in real system, just here for this purpose
-    Status status;
-    for (uint16_t index = 0; index < size; index++) {
-        status = dequeue(receive_queue, &data[index]);
-        while (status == EMPTY) {
-            // Some sort of delay here that allows other tasks to continue
-            // eg: vTaskDelay(1);
-            counter++;
-
-            status = dequeue(receive_queue, &data[index]);
-        }
+// Reads until size bytes have arrived or the deadline (NULL for none) passes. Sleeps until the ISR
+// has queued enough for the rest rather than spinning.
+static Status receive_until(UartHandle uart, uint8_t* data, size_t size, const struct timespec* deadline, size_t* bytes_read) {
+    size_t index = 0;
+    Status status = SUCCESS;
+    while (index < size) {
+        size_t read;
+        Status queue_status = dequeue_bulk(uart->receive_queue, &data[index], size - index, &read);
         // If there's some sort of failure of the queue, this wouldn't happen in my implementation
         // But if there were some sort of FreeRTOS Queue error that would be caught here
-        if (status == FAILURE) { 
+        if (queue_status == FAILURE) {
+            status = FAILURE;
+            break;
+        }
+        index += read;
+        receive_consumed(uart, read);
+        if (index == size) break;
+
+        // Wait for the rest, or a full queue's worth if the rest won't fit in it
+        size_t limit = receive_limit(uart);
+        size_t wanted = size - index < limit ? size - index : limit;
+        atomic_store_explicit(&uart->receive_bytes_wanted, wanted, memory_order_relaxed);
+        uint32_t sequence = wait_event_prepare(&uart->receive_event);
+        if (queue_length(uart->receive_queue) < wanted) {
+            status = wait_event_wait(&uart->receive_event, sequence, deadline);
+        }
+        wait_event_finish(&uart->receive_event);
+        if (status == BUSY) break; // Timed out
+    }
+    if (bytes_read != NULL) *bytes_read = index;
+    return status;
+}
+
+Status uart_write_bytes_to_transmit_queue(UartHandle uart, UartPriority priority, uint8_t* data, size_t size) {
+    if (uart == NULL || (unsigned)priority >= UART_PRIORITY_COUNT || (data == NULL && size != 0)) return FAILURE;
+    UartBuffer buffer = { data, size };
+    return transmit_until(uart, priority, &buffer, 1, NULL, NULL);
+}
+
+Status uart_write_bytes_to_transmit_queue_timeout(UartHandle uart, UartPriority priority, uint8_t* data, size_t size,
+    uint32_t timeout_ms, size_t* bytes_written) {
+    if (bytes_written != NULL) *bytes_written = 0;
+    if (uart == NULL || (unsigned)priority >= UART_PRIORITY_COUNT || (data == NULL && size != 0)) return FAILURE;
+    UartBuffer buffer = { data, size };
+    struct timespec deadline;
+    wait_event_deadline(timeout_ms, &deadline);
+    return transmit_until(uart, priority, &buffer, 1, &deadline, bytes_written);
+}
+
+Status uart_read_bytes_from_receive_queue_blocking(UartHandle uart, uint8_t* data, size_t size) {
+    if (uart == NULL) return FAILURE;
+    return receive_until(uart, data, size, NULL, NULL);
+}
+
+Status uart_read_bytes_from_receive_queue_timeout(UartHandle uart, uint8_t* data, size_t size, uint32_t timeout_ms, size_t* bytes_read) {
+    if (bytes_read != NULL) *bytes_read = 0;
+    if (uart == NULL) return FAILURE;
+    struct timespec deadline;
+    wait_event_deadline(timeout_ms, &deadline);
+    return receive_until(uart, data, size, &deadline, bytes_read);
+}
+
+Status uart_read_bytes_from_receive_queue_nonblocking(UartHandle uart, uint8_t* data, size_t size, size_t* bytes_read) {
+    if (bytes_read != NULL) *bytes_read = 0;
+    if (uart == NULL) return FAILURE;
+    size_t read = 0;
+    // EMPTY just means nothing was read which is still a successful nonblocking read
+    Status status = dequeue_bulk(uart->receive_queue, data, size, &read);
+    receive_consumed(uart, read);
+    if (bytes_read != NULL) {
+        *bytes_read = read;
+    }
+    return status == FAILURE ? FAILURE : SUCCESS;
+}
+
+Status uart_writev(UartHandle uart, UartPriority priority, const UartBuffer* buffers, size_t buffer_count) {
+    if (uart == NULL || (unsigned)priority >= UART_PRIORITY_COUNT || (buffers == NULL && buffer_count != 0)) return FAILURE;
+    for (size_t i = 0; i < buffer_count; i++) {
+        if (buffers[i].data == NULL && buffers[i].size != 0) return FAILURE;
+    }
+    return transmit_until(uart, priority, buffers, buffer_count, NULL, NULL);
+}
+
+Status uart_readv(UartHandle uart, const UartBuffer* buffers, size_t buffer_count, size_t* bytes_read) {
+    size_t total = 0;
+    if (bytes_read != NULL) *bytes_read = 0;
+    if (uart == NULL || (buffers == NULL && buffer_count != 0)) return FAILURE;
+    for (size_t i = 0; i < buffer_count; i++) {
+        size_t read = 0;
+        Status status = dequeue_bulk(uart->receive_queue, buffers[i].data, buffers[i].size, &read);
+        if (status == FAILURE) {
             return FAILURE;
         }
+        total += read;
+        receive_consumed(uart, read);
+        // Stop at the first buffer that couldn't be filled, the queue has run dry
+        if (read < buffers[i].size) {
+            break;
+        }
     }
+    if (bytes_read != NULL) *bytes_read = total;
     return SUCCESS;
 }
 
-Status uart_read_bytes_from_receive_queue_nonblocking(uint8_t* data, size_t size, size_t* bytes_read) {
-    Status status;
-    for (uint16_t index = 0; index < size; index++) {
-        status = dequeue(receive_queue, &data[index]);
-        if (status == EMPTY) {
-            if (bytes_read != NULL) {
-                *bytes_read = index;
-            }
+Status uart_transmit_reserve(UartHandle uart, UartPriority priority, size_t size, UartReservation* reservation) {
+    if (uart == NULL || reservation == NULL || (unsigned)priority >= UART_PRIORITY_COUNT) return FAILURE;
+    reservation->priority = priority;
+    return queue_reserve_shared(uart->transmit_queues[priority], size, &reservation->space);
+}
+
+Status uart_transmit_commit(UartHandle uart, const UartReservation* reservation) {
+    if (uart == NULL || reservation == NULL || (unsigned)reservation->priority >= UART_PRIORITY_COUNT) return FAILURE;
+    return commit_message(uart, reservation->priority, &reservation->space);
+}
+
+Status uart_receive_peek(UartHandle uart, UartBuffer* first, UartBuffer* second) {
+    if (uart == NULL) return FAILURE;
+    return queue_peek(uart->receive_queue, first, second);
+}
+
+Status uart_receive_consume(UartHandle uart, size_t size) {
+    if (uart == NULL) return FAILURE;
+    Status status = queue_consume(uart->receive_queue, size);
+    if (status == SUCCESS) receive_consumed(uart, size);
+    return status;
+}
+
+// Looks for the delimiter in the receive queue where it sits, starting from wherever the last look
+// got to so nothing is scanned twice. memchr is run over each contiguous span in turn (either side
+// of the wrap around and any borrowed segments). SUCCESS with *line_length set if there's a line to
+// take: up to and including the delimiter, or max bytes (or a full queue) if there wasn't one in
+// them. EMPTY if there isn't a line yet.
+static Status find_line(UartHandle uart, uint8_t delimiter, size_t max, size_t* line_length) {
+    if (delimiter != uart->scan_delimiter) {
+        uart->scan_delimiter = delimiter;
+        uart->receive_scanned = 0;
+    }
+    // A full queue with no delimiter can't get any more in, so it's handed over as it is
+    if (max > receive_limit(uart)) max = receive_limit(uart);
+    // An earlier call with a bigger max may have scanned past this one's, and none of that had the
+    // delimiter in it
+    if (uart->receive_scanned >= max) {
+        *line_length = max;
+        return SUCCESS;
+    }
+
+    UartBuffer span;
+    while (uart->receive_scanned < max && queue_peek_at(uart->receive_queue, uart->receive_scanned, &span) == SUCCESS) {
+        size_t size = span.size < max - uart->receive_scanned ? span.size : max - uart->receive_scanned;
+        const uint8_t* found = (const uint8_t*)memchr(span.data, delimiter, size);
+        if (found != NULL) {
+            *line_length = uart->receive_scanned + (size_t)(found - span.data) + 1;
             return SUCCESS;
         }
-        // If there's some sort of failure of the queue, this wouldn't happen in my implementation
-        // But if there were some sort of FreeRTOS Queue error that would be caught here
-        if (status == FAILURE) { 
+        uart->receive_scanned += size;
+    }
+    if (uart->receive_scanned == max) {
+        *line_length = max;
+        return SUCCESS;
+    }
+    return EMPTY;
+}
+
+// Reads a line if there is one, waiting for it until the deadline (NULL for none) if block is set
+static Status read_until(UartHandle uart, uint8_t delimiter, uint8_t* data, size_t max, uint8_t block,
+    const struct timespec* deadline, size_t* length) {
+    while (1) {
+        size_t line_length;
+        if (find_line(uart, delimiter, max, &line_length) == SUCCESS) {
+            size_t read;
+            if (dequeue_bulk(uart->receive_queue, data, line_length, &read) == FAILURE) return FAILURE;
+            uart->receive_scanned = 0;
+            check_receive_resume(uart);
+            *length = read;
+            return SUCCESS;
+        }
+        if (!block) return EMPTY;
+
+        // Sleep until at least one byte past what's been scanned turns up
+        Status status = SUCCESS;
+        atomic_store_explicit(&uart->receive_bytes_wanted, uart->receive_scanned + 1, memory_order_relaxed);
+        uint32_t sequence = wait_event_prepare(&uart->receive_event);
+        if (queue_length(uart->receive_queue) <= uart->receive_scanned) {
+            status = wait_event_wait(&uart->receive_event, sequence, deadline);
+        }
+        wait_event_finish(&uart->receive_event);
+        if (status == BUSY) return BUSY; // Timed out
+    }
+}
+
+Status uart_read_until(UartHandle uart, uint8_t delimiter, uint8_t* data, size_t max, size_t* length) {
+    if (length != NULL) *length = 0;
+    if (uart == NULL || data == NULL || length == NULL || max == 0) return FAILURE;
+    return read_until(uart, delimiter, data, max, 1, NULL, length);
+}
+
+Status uart_read_until_nonblocking(UartHandle uart, uint8_t delimiter, uint8_t* data, size_t max, size_t* length) {
+    if (length != NULL) *length = 0;
+    if (uart == NULL || data == NULL || length == NULL || max == 0) return FAILURE;
+    return read_until(uart, delimiter, data, max, 0, NULL, length);
+}
+
+Status uart_read_until_timeout(UartHandle uart, uint8_t delimiter, uint8_t* data, size_t max, uint32_t timeout_ms, size_t* length) {
+    if (length != NULL) *length = 0;
+    if (uart == NULL || data == NULL || length == NULL || max == 0) return FAILURE;
+    struct timespec deadline;
+    wait_event_deadline(timeout_ms, &deadline);
+    return read_until(uart, delimiter, data, max, 1, &deadline, length);
+}
+
+Status uart_route(UartHandle source, UartHandle destination) {
+    if (source == NULL || destination == NULL || !source->is_initialised || !destination->is_initialised) return FAILURE;
+    if (atomic_load(&source->route_destination) != NULL || atomic_load(&destination->route_source) != NULL) return BUSY;
+    atomic_store_explicit(&source->route_bytes, 0, memory_order_relaxed);
+    source->route_dropped_baseline = atomic_load_explicit(&source->counters.rx_dropped, memory_order_relaxed);
+    source->route_flow_stops_baseline = atomic_load_explicit(&source->counters.rx_flow_stops, memory_order_relaxed);
+    // The destination's ISR takes over as the receive queue's reader from here, so everything the
+    // reader did to it has to be visible first
+    atomic_store_explicit(&destination->route_source, source, memory_order_release);
+    atomic_store_explicit(&source->route_destination, destination, memory_order_release);
+    // Anything already received goes too
+    if (!is_queue_empty(source->receive_queue)) unmask_tx_interrupt(destination);
+    return SUCCESS;
+}
+
+Status uart_unroute(UartHandle source) {
+    if (source == NULL) return FAILURE;
+    UartHandle destination = atomic_load(&source->route_destination);
+    if (destination == NULL) return EMPTY;
+    atomic_store(&source->route_destination, NULL);
+    atomic_store(&destination->route_source, NULL);
+    // The destination's ISR may be part way through forwarding, it's only ever one TX FIFO's worth
+    while (atomic_load(&destination->route_forwarding)) sched_yield();
+    // Whatever the route didn't get to is left for the reader
+    source->receive_scanned = 0;
+    check_receive_resume(source);
+    return SUCCESS;
+}
+
+Status uart_get_route_stats(UartHandle source, UartRouteStats* stats) {
+    if (source == NULL || stats == NULL) return FAILURE;
+    if (atomic_load(&source->route_destination) == NULL) return EMPTY;
+    stats->bytes = atomic_load_explicit(&source->route_bytes, memory_order_relaxed);
+    stats->source_dropped = atomic_load_explicit(&source->counters.rx_dropped, memory_order_relaxed) - source->route_dropped_baseline;
+    stats->source_flow_stops = atomic_load_explicit(&source->counters.rx_flow_stops, memory_order_relaxed) - source->route_flow_stops_baseline;
+    stats->queued = (uint32_t)queue_length(source->receive_queue);
+    return SUCCESS;
+}
+
+Status uart_poll_create(UartPollSet** set) {
+    if (set == NULL) return FAILURE;
+    for (uint8_t i = 0; i < UART_CHANNEL_COUNT; i++) {
+        UartPollSet* candidate = &poll_sets[i];
+        uint8_t free = 0;
+        if (!atomic_compare_exchange_strong(&candidate->in_use, &free, 1)) continue;
+        candidate->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (candidate->fd < 0) {
+            atomic_store(&candidate->in_use, 0);
             return FAILURE;
         }
+        atomic_store(&candidate->signalled, 0);
+        memset(candidate->members, 0, sizeof(candidate->members));
+        memset(candidate->interest, 0, sizeof(candidate->interest));
+        candidate->next_channel = 0;
+        *set = candidate;
+        return SUCCESS;
+    }
+    return BUSY;
+}
+
+void uart_poll_destroy(UartPollSet* set) {
+    if (set == NULL || !atomic_load(&set->in_use)) return;
+    for (uint8_t channel = 0; channel < UART_CHANNEL_COUNT; channel++) {
+        if (set->members[channel] != NULL) uart_poll_remove(set, set->members[channel]);
+    }
+    close(set->fd);
+    atomic_store(&set->in_use, 0);
+}
+
+Status uart_poll_add(UartPollSet* set, UartHandle uart, uint8_t events, size_t write_space) {
+    if (set == NULL || uart == NULL || !uart->is_initialised || events == 0 || (events & ~(UART_POLL_READABLE | UART_POLL_WRITABLE)) != 0) {
+        return FAILURE;
     }
-    *bytes_read = size;
+    if (write_space == 0) write_space = 1;
+    if (write_space > queue_capacity(uart->transmit_queues[UART_PRIORITY_NORMAL])) return FAILURE;
+    UartPollSet* current = atomic_load(&uart->poll_set);
+    if (current != NULL && current != set) return BUSY;
+    // Picked up by the next uart_poll, which arms the channel for the new events
+    atomic_store(&uart->poll_armed, 0);
+    uart->poll_write_space = write_space;
+    set->interest[uart->channel] = events;
+    set->members[uart->channel] = uart;
+    atomic_store_explicit(&uart->poll_set, set, memory_order_release);
     return SUCCESS;
 }
 
-size_t uart_receive_queue_length(void) {
-    pthread_mutex_lock(&receive_queue->mutex);
-    size_t size = receive_queue->size;
-    pthread_mutex_unlock(&receive_queue->mutex);
-    return size;
+Status uart_poll_remove(UartPollSet* set, UartHandle uart) {
+    if (set == NULL || uart == NULL) return FAILURE;
+    if (atomic_load(&uart->poll_set) != set) return EMPTY;
+    atomic_store(&uart->poll_armed, 0);
+    atomic_store(&uart->poll_set, NULL);
+    // The ISR may be part way through signalling, which is only ever one write
+    while (atomic_load(&uart->poll_signalling)) sched_yield();
+    set->members[uart->channel] = NULL;
+    set->interest[uart->channel] = 0;
+    return SUCCESS;
+}
+
+int uart_poll_fd(const UartPollSet* set) {
+    return set != NULL ? set->fd : -1;
+}
+
+// Fills events with the channels that are ready, arming the ones that aren't. A channel is armed
+// before being looked at again so that a change the ISR makes in between is either seen here or
+// signalled.
+static size_t collect_ready(UartPollSet* set, UartPollEvent* events, size_t max_events) {
+    size_t count = 0;
+    uint8_t start = set->next_channel;
+    for (uint8_t step = 0; step < UART_CHANNEL_COUNT && count < max_events; step++) {
+        uint8_t channel = (uint8_t)((start + step) % UART_CHANNEL_COUNT);
+        UartHandle uart = set->members[channel];
+        if (uart == NULL) continue;
+        uint8_t interest = set->interest[channel];
+        uint8_t ready = poll_ready_events(uart) & interest;
+        if (ready == 0) {
+            atomic_store_explicit(&uart->poll_armed, interest, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            ready = poll_ready_events(uart) & interest;
+            if (ready == 0) continue;
+        }
+        // Being reported, so there's nothing to wake for
+        atomic_store_explicit(&uart->poll_armed, 0, memory_order_relaxed);
+        events[count++] = (UartPollEvent){ uart, ready };
+        // Anything left unlooked at once events is full goes first next time
+        set->next_channel = (uint8_t)((channel + 1) % UART_CHANNEL_COUNT);
+    }
+    return count;
+}
+
+Status uart_poll(UartPollSet* set, int32_t timeout_ms, UartPollEvent* events, size_t max_events, size_t* count) {
+    if (count != NULL) *count = 0;
+    if (set == NULL || events == NULL || max_events == 0) return FAILURE;
+    struct timespec deadline;
+    if (timeout_ms > 0) wait_event_deadline((uint32_t)timeout_ms, &deadline);
+    while (1) {
+        // Drained and then signalled cleared, both before looking. A signal for anything the look
+        // misses then always writes the eventfd again. Clearing first could let a signal land
+        // between the two and be drained, leaving signalled set on an empty eventfd for good.
+        uint64_t signals;
+        ssize_t drained = read(set->fd, &signals, sizeof(signals));
+        (void)drained;
+        atomic_store_explicit(&set->signalled, 0, memory_order_seq_cst);
+        atomic_thread_fence(memory_order_seq_cst);
+        size_t ready = collect_ready(set, events, max_events);
+        if (ready != 0) {
+            if (count != NULL) *count = ready;
+            return SUCCESS;
+        }
+        int wait_ms = -1;
+        if (timeout_ms == 0) return BUSY;
+        if (timeout_ms > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            int64_t left_ns = (int64_t)(deadline.tv_sec - now.tv_sec) * 1000000000LL + (deadline.tv_nsec - now.tv_nsec);
+            if (left_ns <= 0) return BUSY;
+            // Rounded up so it doesn't wake just short of the deadline and go round again
+            wait_ms = (int)((left_ns + 999999) / 1000000);
+        }
+        struct pollfd descriptor = { .fd = set->fd, .events = POLLIN };
+        if (poll(&descriptor, 1, wait_ms) < 0 && errno != EINTR) return FAILURE;
+    }
+}
+
+Status uart_replay_queues(UartHandle uart, size_t receive_length, const uint8_t* transmit_data, size_t transmit_size) {
+    if (uart == NULL || !uart->is_initialised || (transmit_data == NULL && transmit_size != 0)) return FAILURE;
+    size_t length = queue_length(uart->receive_queue);
+    if (length > receive_length) {
+        queue_consume(uart->receive_queue, length - receive_length);
+        receive_consumed(uart, length - receive_length);
+    }
+    if (transmit_size == 0) return SUCCESS;
+    QueueReservation reservation;
+    // The trace has the bytes in the order they went out, so one lane keeps them that way
+    Queue* queue = uart->transmit_queues[UART_PRIORITY_NORMAL];
+    Status status = queue_reserve_shared(queue, transmit_size, &reservation);
+    if (status != SUCCESS) return status;
+    UartBuffer buffer = { (uint8_t*)transmit_data, transmit_size };
+    size_t buffer_index = 0;
+    size_t offset = 0;
+    copy_to_reservation(&reservation, &buffer, &buffer_index, &offset);
+    return queue_commit_shared(queue, &reservation);
 }
 
-size_t uart_transmit_queue_length(void) {
-    pthread_mutex_lock(&transmit_queue->mutex);
-    size_t size = transmit_queue->size;
-    pthread_mutex_unlock(&transmit_queue->mutex);
-    return size;
+size_t uart_receive_queue_length(UartHandle uart) {
+    if (uart == NULL) return 0;
+    return queue_length(uart->receive_queue);
 }
 
-uint32_t uart_total_bytes_received(void) {
-    return bytes_received;
+size_t uart_transmit_queue_length(UartHandle uart) {
+    if (uart == NULL) return 0;
+    return transmit_length(uart);
 }
 
-Status uart_receive_error(void) {
-    if (receive_queue_error == 0) {
+uint32_t uart_total_bytes_received(UartHandle uart) {
+    if (uart == NULL) return 0;
+    // Received means received from the UART rather than received and added to queue, so anything
+    // dropped or errored still counts
+    UartCounters* counters = &uart->counters;
+    return (uint32_t)(atomic_load_explicit(&counters->rx_bytes, memory_order_relaxed)
+        + atomic_load_explicit(&counters->rx_dropped, memory_order_relaxed)
+        + atomic_load_explicit(&counters->rx_errors, memory_order_relaxed));
+}
+
+Status uart_get_stats(UartHandle uart, UartStats* stats, uint8_t reset) {
+    if (uart == NULL || stats == NULL || !uart->is_initialised) return FAILURE;
+    UartCounters* counters = &uart->counters;
+    UartStats now;
+    now.rx_bytes = atomic_load_explicit(&counters->rx_bytes, memory_order_relaxed);
+    now.tx_bytes = atomic_load_explicit(&counters->tx_bytes, memory_order_relaxed);
+    now.rx_dropped = atomic_load_explicit(&counters->rx_dropped, memory_order_relaxed);
+    now.rx_errors = atomic_load_explicit(&counters->rx_errors, memory_order_relaxed);
+    now.rx_flow_stops = atomic_load_explicit(&counters->rx_flow_stops, memory_order_relaxed);
+    now.tx_flow_stops = atomic_load_explicit(&counters->tx_flow_stops, memory_order_relaxed);
+    now.isr_count = atomic_load_explicit(&counters->isr_count, memory_order_relaxed);
+    now.isr_spurious = atomic_load_explicit(&counters->isr_spurious, memory_order_relaxed);
+    for (uint32_t i = 0; i < UART_ISR_HISTOGRAM_BUCKETS; i++) {
+        now.isr_cycles_histogram[i] = atomic_load_explicit(&counters->isr_cycles_histogram[i], memory_order_relaxed);
+    }
+    // The latency total goes in the average's place in the baseline
+    for (uint32_t lane = 0; lane < UART_PRIORITY_COUNT; lane++) {
+        now.tx_messages[lane] = atomic_load_explicit(&counters->tx_messages[lane], memory_order_relaxed);
+        now.tx_latency_samples[lane] = atomic_load_explicit(&counters->tx_latency_samples[lane], memory_order_relaxed);
+        now.tx_latency_average_ns[lane] = atomic_load_explicit(&counters->tx_latency_total_ns[lane], memory_order_relaxed);
+    }
+
+    // Report relative to the last reset
+    UartStats* baseline = &uart->stats_baseline;
+    stats->rx_bytes = now.rx_bytes - baseline->rx_bytes;
+    stats->tx_bytes = now.tx_bytes - baseline->tx_bytes;
+    stats->rx_dropped = now.rx_dropped - baseline->rx_dropped;
+    stats->rx_errors = now.rx_errors - baseline->rx_errors;
+    stats->rx_flow_stops = now.rx_flow_stops - baseline->rx_flow_stops;
+    stats->tx_flow_stops = now.tx_flow_stops - baseline->tx_flow_stops;
+    stats->isr_count = now.isr_count - baseline->isr_count;
+    stats->isr_spurious = now.isr_spurious - baseline->isr_spurious;
+    for (uint32_t i = 0; i < UART_ISR_HISTOGRAM_BUCKETS; i++) {
+        stats->isr_cycles_histogram[i] = now.isr_cycles_histogram[i] - baseline->isr_cycles_histogram[i];
+    }
+    for (uint32_t lane = 0; lane < UART_PRIORITY_COUNT; lane++) {
+        stats->tx_messages[lane] = now.tx_messages[lane] - baseline->tx_messages[lane];
+        stats->tx_latency_samples[lane] = now.tx_latency_samples[lane] - baseline->tx_latency_samples[lane];
+        uint64_t total = now.tx_latency_average_ns[lane] - baseline->tx_latency_average_ns[lane];
+        stats->tx_latency_average_ns[lane] = stats->tx_latency_samples[lane] != 0 ? total / stats->tx_latency_samples[lane] : 0;
+    }
+
+    if (reset) {
+        *baseline = now;
+        stats->rx_queue_high_watermark = atomic_exchange_explicit(&uart->rx_queue_high_watermark, 0, memory_order_relaxed);
+        stats->tx_queue_high_watermark = atomic_exchange_explicit(&uart->tx_queue_high_watermark, 0, memory_order_relaxed);
+        for (uint32_t lane = 0; lane < UART_PRIORITY_COUNT; lane++) {
+            stats->tx_latency_max_ns[lane] = atomic_exchange_explicit(&uart->tx_latency_max_ns[lane], 0, memory_order_relaxed);
+        }
+    } else {
+        stats->rx_queue_high_watermark = atomic_load_explicit(&uart->rx_queue_high_watermark, memory_order_relaxed);
+        stats->tx_queue_high_watermark = atomic_load_explicit(&uart->tx_queue_high_watermark, memory_order_relaxed);
+        for (uint32_t lane = 0; lane < UART_PRIORITY_COUNT; lane++) {
+            stats->tx_latency_max_ns[lane] = atomic_load_explicit(&uart->tx_latency_max_ns[lane], memory_order_relaxed);
+        }
+    }
+    return SUCCESS;
+}
+
+Status uart_receive_error(UartHandle uart) {
+    if (uart == NULL) return FAILURE;
+    if (uart->receive_queue_error == 0) {
         return SUCCESS;
     } else {
         return FAILURE;
     }
 }
 
-Status uart_transmit_error(void) {
-    if (transmit_queue_error == 0) {
+Status uart_transmit_error(UartHandle uart) {
+    if (uart == NULL) return FAILURE;
+    if (uart->transmit_queue_error == 0) {
         return SUCCESS;
     } else {
         return FAILURE;
     }
 }
 
-void display_uart_status(void) {
-    printf("UART Receive Queue length : %ld\n", uart_receive_queue_length());
-    printf("UART Transmit Queue length : %ld\n", uart_transmit_queue_length());
-    printf("Total bytes received : %d\n", uart_total_bytes_received());
+void display_uart_status(UartHandle uart) {
+    if (uart == NULL) return;
+    printf("UART Channel : %d\n", uart->channel);
+    printf("UART Receive Queue length : %ld\n", uart_receive_queue_length(uart));
+    printf("UART Transmit Queue length : %ld\n", uart_transmit_queue_length(uart));
+    printf("Total bytes received : %d\n", uart_total_bytes_received(uart));
+    UartStats stats;
+    if (uart_get_stats(uart, &stats, 0) == SUCCESS) {
+        printf("ISR invocations : %llu (%llu with nothing to do)\n", (unsigned long long)stats.isr_count,
+            (unsigned long long)stats.isr_spurious);
+        printf("Bytes dropped : %llu\n", (unsigned long long)stats.rx_dropped);
+    }
     printf("UART Receive Receive Error Status : ");
-    if (uart_receive_error() == SUCCESS) {
+    if (uart_receive_error(uart) == SUCCESS) {
         printf("No Error\n");
     } else {
         printf("Error\n");
     }
     printf("UART Receive Transmit Error Status : ");
-    if (uart_transmit_error() == SUCCESS) {
+    if (uart_transmit_error(uart) == SUCCESS) {
         printf("No Error\n");
     } else {
         printf("Error\n");
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,53 @@
+#define _GNU_SOURCE
+#include "wait_event.h"
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+void wait_event_init(WaitEvent* event) {
+    atomic_init(&event->sequence, 0);
+    atomic_init(&event->waiters, 0);
+}
+
+uint32_t wait_event_prepare(WaitEvent* event) {
+    atomic_fetch_add_explicit(&event->waiters, 1, memory_order_relaxed);
+    // Pairs with the fence in wait_event_has_waiters, either the signaller sees us waiting or we
+    // see whatever it changed before signalling when we check the condition
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load_explicit(&event->sequence, memory_order_acquire);
+}
+
+Status wait_event_wait(WaitEvent* event, uint32_t sequence, const struct timespec* deadline) {
+    // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline, FUTEX_WAIT would take a relative one
+    long result = syscall(SYS_futex, &event->sequence, FUTEX_WAIT_BITSET_PRIVATE, sequence, deadline,
+        NULL, FUTEX_BITSET_MATCH_ANY);
+    if (result == -1 && errno == ETIMEDOUT) return BUSY;
+    // Woken, the sequence had already moved on (EAGAIN) or interrupted (EINTR) all look the same
+    return SUCCESS;
+}
+
+void wait_event_finish(WaitEvent* event) {
+    atomic_fetch_sub_explicit(&event->waiters, 1, memory_order_relaxed);
+}
+
+uint8_t wait_event_has_waiters(WaitEvent* event) {
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load_explicit(&event->waiters, memory_order_relaxed) != 0;
+}
+
+void wait_event_signal(WaitEvent* event) {
+    atomic_fetch_add_explicit(&event->sequence, 1, memory_order_release);
+    syscall(SYS_futex, &event->sequence, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+void wait_event_deadline(uint32_t timeout_ms, struct timespec* deadline) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}